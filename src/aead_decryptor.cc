@@ -0,0 +1,84 @@
+#include "aead_decryptor.h"
+
+#include <openssl/evp.h>
+
+class AeadDecryptorErrorCategory : public std::error_category {
+ public:
+  const char* name() const noexcept override { return "AeadDecryptor"; }
+  std::string message(int ev) const override {
+    switch (ev) {
+      case 1:
+        return "Invalid Key";
+      case 2:
+        return "Authentication Failed";
+      default:
+        return "Unknown Error";
+    }
+  }
+};
+
+const std::error_category& aead_decryptor_category() {
+  static AeadDecryptorErrorCategory instance;
+  return instance;
+}
+
+const std::error_code AeadDecryptor::ErrInvalidKey = std::error_code(1, aead_decryptor_category());
+const std::error_code AeadDecryptor::ErrAuthenticationFailed =
+    std::error_code(2, aead_decryptor_category());
+
+AeadDecryptor::AeadDecryptor(const uint8_t* key, uint32_t key_length) {
+  const EVP_CIPHER* cipher = nullptr;
+  if (key_length == 16) {
+    cipher = EVP_aes_128_gcm();
+  } else if (key_length == 32) {
+    cipher = EVP_aes_256_gcm();
+  }
+  if (key == nullptr || cipher == nullptr) {
+    return;
+  }
+  ctx_ = EVP_CIPHER_CTX_new();
+  if (ctx_ == nullptr) {
+    return;
+  }
+  if (EVP_DecryptInit_ex(ctx_, cipher, nullptr, nullptr, nullptr) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_IVLEN, nonce_length, nullptr) != 1 ||
+      EVP_DecryptInit_ex(ctx_, nullptr, nullptr, key, nullptr) != 1) {
+    EVP_CIPHER_CTX_free(ctx_);
+    ctx_ = nullptr;
+  }
+}
+
+AeadDecryptor::~AeadDecryptor() { EVP_CIPHER_CTX_free(ctx_); }
+
+std::error_code AeadDecryptor::Open(const AeadParams& params, const uint8_t* first,
+                                    uint32_t first_length, const uint8_t* second,
+                                    uint32_t second_length, uint8_t* out) {
+  if (ctx_ == nullptr) {
+    return ErrInvalidKey;
+  }
+  int out_length = 0;
+  // only the nonce changes per frame, the key schedule is kept
+  if (params.nonce == nullptr || params.tag == nullptr ||
+      EVP_DecryptInit_ex(ctx_, nullptr, nullptr, nullptr, params.nonce) != 1) {
+    return ErrAuthenticationFailed;
+  }
+  if (params.aad_length > 0 &&
+      EVP_DecryptUpdate(ctx_, nullptr, &out_length, params.aad,
+                        static_cast<int>(params.aad_length)) != 1) {
+    return ErrAuthenticationFailed;
+  }
+  if (first_length > 0 &&
+      EVP_DecryptUpdate(ctx_, out, &out_length, first, static_cast<int>(first_length)) != 1) {
+    return ErrAuthenticationFailed;
+  }
+  if (second_length > 0 && EVP_DecryptUpdate(ctx_, out + first_length, &out_length, second,
+                                             static_cast<int>(second_length)) != 1) {
+    return ErrAuthenticationFailed;
+  }
+  if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, tag_length,
+                          const_cast<uint8_t*>(params.tag)) != 1 ||
+      EVP_DecryptFinal_ex(ctx_, out + first_length + second_length, &out_length) != 1) {
+    return ErrAuthenticationFailed;
+  }
+  return std::error_code();
+}
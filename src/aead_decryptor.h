@@ -0,0 +1,71 @@
+/**
+ * @file aead_decryptor.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_AEAD_DECRYPTOR_H_
+#define SRC_AEAD_DECRYPTOR_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <utility>
+
+struct evp_cipher_ctx_st;
+
+/// @brief The per-frame inputs of AES-GCM, usually pointing into the frame header.
+struct AeadParams {
+  const uint8_t* nonce = nullptr;  // `AeadDecryptor::nonce_length` bytes
+  const uint8_t* tag = nullptr;    // `AeadDecryptor::tag_length` bytes
+  const uint8_t* aad = nullptr;    // optional additional authenticated data
+  uint32_t aad_length = 0;
+};
+
+/// @brief AES-GCM (128 or 256 bit key) decryption and authentication of frame bodies with the
+/// system libcrypto, which uses AES-NI/PCLMUL when the CPU has them. The key schedule is set up
+/// once, each frame only loads its nonce. Not thread-safe, use one instance per parser.
+class AeadDecryptor final {
+ public:
+  constexpr static uint32_t nonce_length = 12;
+  constexpr static uint32_t tag_length = 16;
+  static const std::error_code ErrInvalidKey;
+  static const std::error_code ErrAuthenticationFailed;
+
+  AeadDecryptor(const uint8_t* key, uint32_t key_length);
+  AeadDecryptor(const AeadDecryptor&) = delete;
+  AeadDecryptor& operator=(const AeadDecryptor&) = delete;
+  ~AeadDecryptor();
+
+  /// @brief Decrypt the ciphertext made of `first` followed by `second` into `out` and check its
+  /// tag. `out` may be `first` to decrypt in place. On failure the contents of `out` are
+  /// unspecified and must not be used.
+  std::error_code Open(const AeadParams& params, const uint8_t* first, uint32_t first_length,
+                       const uint8_t* second, uint32_t second_length, uint8_t* out);
+
+  /// @brief Decrypt and authenticate `length` bytes at `data` in place.
+  std::error_code Open(const AeadParams& params, uint8_t* data, uint32_t length) {
+    return Open(params, data, length, nullptr, 0, data);
+  }
+
+ private:
+  evp_cipher_ctx_st* ctx_ = nullptr;
+};
+
+/// @brief Adapt `decryptor` to `StreamingParser::SetBodyDecryptor`. `params_fn` fills the AES-GCM
+/// parameters of a frame from its header.
+template <typename ProtoHeader, typename ParamsFn>
+auto MakeAeadBodyDecryptor(std::shared_ptr<AeadDecryptor> decryptor, ParamsFn params_fn) {
+  return [decryptor = std::move(decryptor), params_fn = std::move(params_fn)](
+             const ProtoHeader& header, const uint8_t* first, uint32_t first_length,
+             const uint8_t* second, uint32_t second_length, uint8_t* out) {
+    AeadParams params;
+    params_fn(header, params);
+    return !decryptor->Open(params, first, first_length, second, second_length, out);
+  };
+}
+
+#endif  // SRC_AEAD_DECRYPTOR_H_
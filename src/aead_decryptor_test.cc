@@ -0,0 +1,169 @@
+#include "aead_decryptor.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "streaming_parser.h"
+
+struct SealedHeader {
+  uint32_t body_length;
+  uint16_t msg_type;
+  uint8_t nonce[AeadDecryptor::nonce_length];
+  uint8_t tag[AeadDecryptor::tag_length];
+};
+
+namespace {
+const uint8_t kKey[32] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+                          17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32};
+
+/// @brief Encrypt `plaintext` with AES-256-GCM, returning the ciphertext and filling `tag`.
+std::vector<uint8_t> Seal(const uint8_t* nonce, const std::vector<uint8_t>& plaintext,
+                          uint8_t* tag) {
+  std::vector<uint8_t> ciphertext(plaintext.size());
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  int length = 0;
+  EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, AeadDecryptor::nonce_length, nullptr);
+  EVP_EncryptInit_ex(ctx, nullptr, nullptr, kKey, nonce);
+  if (!plaintext.empty()) {
+    EVP_EncryptUpdate(ctx, ciphertext.data(), &length, plaintext.data(),
+                      static_cast<int>(plaintext.size()));
+  }
+  EVP_EncryptFinal_ex(ctx, ciphertext.data() + length, &length);
+  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AeadDecryptor::tag_length, tag);
+  EVP_CIPHER_CTX_free(ctx);
+  return ciphertext;
+}
+
+std::vector<uint8_t> SealFrame(uint16_t msg_type, const std::vector<uint8_t>& plaintext) {
+  SealedHeader header = {};
+  header.body_length = htonl(static_cast<uint32_t>(plaintext.size()));
+  header.msg_type = msg_type;
+  for (uint32_t i = 0; i < AeadDecryptor::nonce_length; ++i) {
+    header.nonce[i] = static_cast<uint8_t>(msg_type + i);
+  }
+  auto ciphertext = Seal(header.nonce, plaintext, header.tag);
+  std::vector<uint8_t> frame(sizeof(header));
+  std::memcpy(frame.data(), &header, sizeof(header));
+  frame.insert(frame.end(), ciphertext.begin(), ciphertext.end());
+  return frame;
+}
+
+void FillParams(const SealedHeader& header, AeadParams& params) {
+  params.nonce = header.nonce;
+  params.tag = header.tag;
+}
+}  // namespace
+
+TEST(AeadDecryptor, open_in_place_and_split) {
+  uint8_t nonce[AeadDecryptor::nonce_length] = {9};
+  uint8_t tag[AeadDecryptor::tag_length];
+  std::vector<uint8_t> plaintext(300);
+  for (size_t i = 0; i < plaintext.size(); ++i) {
+    plaintext[i] = static_cast<uint8_t>(i * 7);
+  }
+  auto ciphertext = Seal(nonce, plaintext, tag);
+  AeadDecryptor decryptor(kKey, sizeof(kKey));
+  AeadParams params;
+  params.nonce = nonce;
+  params.tag = tag;
+
+  // split into two pieces decrypted into a separate buffer
+  std::vector<uint8_t> out(plaintext.size());
+  EXPECT_FALSE(decryptor.Open(params, ciphertext.data(), 100, ciphertext.data() + 100, 200,
+                              out.data()));
+  EXPECT_EQ(out, plaintext);
+
+  // in place
+  auto copy = ciphertext;
+  EXPECT_FALSE(decryptor.Open(params, copy.data(), static_cast<uint32_t>(copy.size())));
+  EXPECT_EQ(copy, plaintext);
+
+  // a modified ciphertext fails authentication
+  copy = ciphertext;
+  copy[10] ^= 1;
+  EXPECT_EQ(decryptor.Open(params, copy.data(), static_cast<uint32_t>(copy.size())),
+            AeadDecryptor::ErrAuthenticationFailed);
+
+  AeadDecryptor invalid(kKey, 7);
+  EXPECT_EQ(invalid.Open(params, copy.data(), static_cast<uint32_t>(copy.size())),
+            AeadDecryptor::ErrInvalidKey);
+}
+
+TEST(AeadDecryptor, parser_decrypts_bodies) {
+  using SealedParser = StreamingParser<SealedHeader>;
+  std::vector<uint16_t> headers;
+  std::vector<std::vector<uint8_t>> bodies;
+  SealedParser parser(
+      [&headers](const SealedHeader& header) {
+        headers.push_back(header.msg_type);
+        return true;
+      },
+      [&bodies](const uint8_t* data, uint32_t length) {
+        bodies.emplace_back(data, data + length);
+        return true;
+      });
+  parser.SetBodyDecryptor(MakeAeadBodyDecryptor<SealedHeader>(
+      std::make_shared<AeadDecryptor>(kKey, sizeof(kKey)), FillParams));
+
+  // frames of 36 + 400 bytes, some of them wrap around the 2048 bytes ring
+  std::vector<std::vector<uint8_t>> plaintexts;
+  for (uint16_t msg_type = 0; msg_type < 12; ++msg_type) {
+    plaintexts.emplace_back(400, static_cast<uint8_t>(msg_type));
+    auto frame = SealFrame(msg_type, plaintexts.back());
+    if (msg_type == 5) {
+      frame.back() ^= 0x80;  // tampered body
+    }
+    EXPECT_TRUE(parser.HandleData(frame.data(), static_cast<uint32_t>(frame.size())));
+  }
+  // a heartbeat carries a tag as well
+  auto heartbeat = SealFrame(100, {});
+  EXPECT_TRUE(parser.HandleData(heartbeat.data(), static_cast<uint32_t>(heartbeat.size())));
+
+  EXPECT_EQ(parser.rejected_frames(), 1);
+  ASSERT_EQ(bodies.size(), 11);
+  ASSERT_EQ(headers.size(), 12);
+  for (size_t i = 0, j = 0; i < plaintexts.size(); ++i) {
+    if (i == 5) {
+      continue;
+    }
+    EXPECT_EQ(headers[j], i);
+    EXPECT_EQ(bodies[j], plaintexts[i]);
+    ++j;
+  }
+  EXPECT_EQ(headers.back(), 100);
+}
+
+TEST(AeadDecryptor, counted_control_frames_are_authenticated) {
+  using SealedParser = StreamingParser<SealedHeader>;
+  uint32_t delivered = 0;
+  SealedParser parser(
+      [&delivered](const SealedHeader& header) {
+        ++delivered;
+        return true;
+      },
+      [](const uint8_t* data, uint32_t length) { return true; });
+  parser.SetBodyDecryptor(MakeAeadBodyDecryptor<SealedHeader>(
+      std::make_shared<AeadDecryptor>(kKey, sizeof(kKey)), FillParams));
+  parser.SetControlFrameMode(SealedParser::ControlFrameMode::kCount);
+
+  // three heartbeats, the second one forged
+  std::vector<uint8_t> stream;
+  for (uint16_t msg_type = 100; msg_type < 103; ++msg_type) {
+    auto heartbeat = SealFrame(msg_type, {});
+    if (msg_type == 101) {
+      heartbeat[offsetof(SealedHeader, tag)] ^= 1;
+    }
+    stream.insert(stream.end(), heartbeat.begin(), heartbeat.end());
+  }
+  EXPECT_TRUE(parser.HandleData(stream.data(), static_cast<uint32_t>(stream.size())));
+  EXPECT_EQ(parser.control_frames(), 2);
+  EXPECT_EQ(parser.rejected_frames(), 1);
+  EXPECT_EQ(delivered, 0);
+}
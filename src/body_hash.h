@@ -0,0 +1,132 @@
+/**
+ * @file body_hash.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_BODY_HASH_H_
+#define SRC_BODY_HASH_H_
+
+#include <cstdint>
+#include <cstring>
+
+/// @brief Streaming XXH64: bytes can be fed in pieces of any size as they arrive, the digest equals
+/// the one-shot hash of their concatenation.
+class BodyHasher final {
+ public:
+  explicit BodyHasher(uint64_t seed = 0) { Reset(seed); }
+
+  void Reset(uint64_t seed = 0) {
+    seed_ = seed;
+    acc_[0] = seed + kPrime1 + kPrime2;
+    acc_[1] = seed + kPrime2;
+    acc_[2] = seed;
+    acc_[3] = seed - kPrime1;
+    total_length_ = 0;
+    buffered_ = 0;
+  }
+
+  void Update(const uint8_t* data, uint32_t length) {
+    total_length_ += length;
+    if (buffered_ + length < kStripeLength) {
+      std::memcpy(stripe_ + buffered_, data, length);
+      buffered_ += length;
+      return;
+    }
+    if (buffered_ > 0) {
+      // complete the stripe left over from the previous piece
+      const uint32_t fill = kStripeLength - buffered_;
+      std::memcpy(stripe_ + buffered_, data, fill);
+      ConsumeStripe(stripe_);
+      data += fill;
+      length -= fill;
+      buffered_ = 0;
+    }
+    for (; length >= kStripeLength; data += kStripeLength, length -= kStripeLength) {
+      ConsumeStripe(data);
+    }
+    std::memcpy(stripe_, data, length);
+    buffered_ = length;
+  }
+
+  uint64_t Digest() const {
+    uint64_t hash;
+    if (total_length_ >= kStripeLength) {
+      hash = Rotl(acc_[0], 1) + Rotl(acc_[1], 7) + Rotl(acc_[2], 12) + Rotl(acc_[3], 18);
+      for (uint64_t acc : acc_) {
+        hash = (hash ^ Round(0, acc)) * kPrime1 + kPrime4;
+      }
+    } else {
+      hash = seed_ + kPrime5;
+    }
+    hash += total_length_;
+    const uint8_t* p = stripe_;
+    uint32_t left = buffered_;
+    for (; left >= 8; p += 8, left -= 8) {
+      hash ^= Round(0, Load64(p));
+      hash = Rotl(hash, 27) * kPrime1 + kPrime4;
+    }
+    if (left >= 4) {
+      hash ^= static_cast<uint64_t>(Load32(p)) * kPrime1;
+      hash = Rotl(hash, 23) * kPrime2 + kPrime3;
+      p += 4;
+      left -= 4;
+    }
+    for (; left > 0; ++p, --left) {
+      hash ^= *p * kPrime5;
+      hash = Rotl(hash, 11) * kPrime1;
+    }
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+  /// @brief The one-shot hash of `length` bytes.
+  static uint64_t Hash(const uint8_t* data, uint32_t length, uint64_t seed = 0) {
+    BodyHasher hasher(seed);
+    hasher.Update(data, length);
+    return hasher.Digest();
+  }
+
+ private:
+  constexpr static uint64_t kPrime1 = 11400714785074694791ull;
+  constexpr static uint64_t kPrime2 = 14029467366897019727ull;
+  constexpr static uint64_t kPrime3 = 1609587929392839161ull;
+  constexpr static uint64_t kPrime4 = 9650029242287828579ull;
+  constexpr static uint64_t kPrime5 = 2870177450012600261ull;
+  constexpr static uint32_t kStripeLength = 32;
+
+  static uint64_t Rotl(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+  static uint64_t Round(uint64_t acc, uint64_t input) {
+    return Rotl(acc + input * kPrime2, 31) * kPrime1;
+  }
+  static uint64_t Load64(const uint8_t* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+  static uint32_t Load32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  void ConsumeStripe(const uint8_t* p) {
+    for (int lane = 0; lane < 4; ++lane) {
+      acc_[lane] = Round(acc_[lane], Load64(p + 8 * lane));
+    }
+  }
+
+  uint64_t seed_ = 0;
+  uint64_t acc_[4] = {};
+  uint64_t total_length_ = 0;
+  uint8_t stripe_[kStripeLength] = {};
+  uint32_t buffered_ = 0;
+};
+
+#endif  // SRC_BODY_HASH_H_
@@ -0,0 +1,484 @@
+/**
+ * @file connection_balancer.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_CONNECTION_BALANCER_H_
+#define SRC_CONNECTION_BALANCER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "body_hash.h"
+#include "load_meter.h"
+#include "rate_limiter.h"
+#include "streaming_parser.h"
+
+struct BalancerOptions {
+  /// @brief Parser threads, 0 for the number of hardware threads.
+  uint32_t shards = 0;
+  /// @brief `Rebalance` moves connections while the busiest shard carries more than this times
+  /// the mean shard load.
+  double imbalance_threshold = 1.25;
+  /// @brief Connections moved by one `Rebalance` at most.
+  uint32_t max_moves = 8;
+  /// @brief Half life of the connection loads, see `LoadMeter`.
+  uint64_t load_half_life_ns = LoadMeter::kDefaultHalfLifeNs;
+  /// @brief Chunks parsed from one connection before the shard moves on to the next connection.
+  uint32_t connection_batch = 32;
+};
+
+struct RebalanceMove {
+  uint64_t connection = 0;
+  uint32_t from = 0;
+  uint32_t to = 0;
+  double load = 0;  // busy share of a core
+};
+
+struct RebalanceReport {
+  /// @brief Busy share of a core per shard, before and after the moves. The loads after are
+  /// projected from the same connection loads, the moves take effect at the next frame boundary.
+  std::vector<double> loads_before;
+  std::vector<double> loads_after;
+  /// @brief The load of the busiest shard divided by the mean shard load, 1 when balanced.
+  double imbalance_before = 1;
+  double imbalance_after = 1;
+  std::vector<RebalanceMove> moves;
+};
+
+/// @brief Parses connections on a fixed set of shard threads and moves connections between them
+/// by load.
+///
+/// A connection starts on the shard its id hashes to. Its bytes are queued on the connection and
+/// parsed by one shard at a time, so its frames are handled in order. Each parser measures its own
+/// load (`StreamingParser::SetLoadTracking`); `Rebalance`, called periodically from any thread,
+/// moves the heaviest connections of the busiest shards to the idlest ones. A moved connection
+/// changes shards once its parser stands at a frame boundary, its buffered bytes move along with
+/// the parser, and bytes queued in the meantime follow it.
+template <typename ProtoHeader>
+class ConnectionBalancer final {
+ public:
+  using Parser = StreamingParser<ProtoHeader>;
+
+  explicit ConnectionBalancer(const BalancerOptions& options = BalancerOptions());
+  ConnectionBalancer(const ConnectionBalancer&) = delete;
+  ConnectionBalancer& operator=(const ConnectionBalancer&) = delete;
+  /// @brief Parse the queued bytes, then stop the shards.
+  ~ConnectionBalancer();
+
+  /// @brief Add a connection parsed by `parser`. Returns false when `id` is already in use.
+  bool AddConnection(uint64_t id, std::unique_ptr<Parser> parser);
+
+  /// @brief Remove a connection, its queued bytes are still parsed.
+  void RemoveConnection(uint64_t id);
+
+  /// @brief Queue a copy of `data` for the connection. The bytes of a connection must be queued by
+  /// one thread at a time. Returns false for an unknown connection.
+  bool HandleData(uint64_t id, const uint8_t* data, uint32_t length);
+
+  /// @brief Move the connection to `shard` at its next frame boundary.
+  bool MoveConnection(uint64_t id, uint32_t shard);
+
+  /// @brief Plan and start moves from the busiest to the idlest shards, see `RebalanceReport`.
+  RebalanceReport Rebalance();
+
+  /// @brief The shard currently parsing the connection, -1 for an unknown connection.
+  int32_t shard_of(uint64_t id) const;
+
+  /// @brief The load of each shard, as the busy share of a core.
+  std::vector<double> shard_loads() const;
+
+  /// @brief Times a connection stalled because its ring was full and no frame could be parsed to
+  /// make room, e.g. a frame larger than the ring. The bytes stay queued and are retried when more
+  /// bytes arrive for the connection.
+  uint64_t rejected_chunks() const { return rejected_chunks_.load(std::memory_order_relaxed); }
+
+  uint32_t shard_count() const { return static_cast<uint32_t>(shards_.size()); }
+
+  /// @brief The shard a new connection starts on.
+  static uint32_t HomeShard(uint64_t id, uint32_t shards) {
+    return static_cast<uint32_t>(
+        BodyHasher::Hash(reinterpret_cast<const uint8_t*>(&id), sizeof(id)) % shards);
+  }
+
+  /// @brief The load of the busiest shard divided by the mean shard load.
+  static double Imbalance(const std::vector<double>& loads);
+
+ private:
+  struct Connection {
+    uint64_t id = 0;
+    std::unique_ptr<Parser> parser;
+    std::mutex mutex;
+    std::deque<std::vector<uint8_t>> chunks;
+    bool scheduled = false;  // queued or being parsed on a shard
+    uint32_t shard = 0;      // the shard parsing it, changed under `mutex`
+    uint32_t target = 0;     // where it is moving to
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::shared_ptr<Connection>> run_queue;
+    /// @brief Connections deferred by their ingress limits, by the time they may resume.
+    std::multimap<uint64_t, std::shared_ptr<Connection>> deferred;
+    std::thread thread;
+  };
+
+  void Run(Shard& shard);
+  void Schedule(const std::shared_ptr<Connection>& connection, uint32_t shard);
+  void ScheduleAt(const std::shared_ptr<Connection>& connection, uint32_t shard, uint64_t due_ns);
+  std::shared_ptr<Connection> NextConnection(Shard& shard);
+  /// @brief Feed as much of `chunk` as the parser takes. Returns the number of bytes taken.
+  static uint32_t Feed(Parser& parser, const std::vector<uint8_t>& chunk);
+  /// @brief Move the connection when it stands at a frame boundary. Called with its mutex.
+  static void MaybeMove(Connection& connection);
+  static void SetTarget(Connection& connection, uint32_t shard);
+  std::shared_ptr<Connection> Find(uint64_t id) const;
+
+  BalancerOptions options_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  mutable std::mutex table_mutex_;
+  std::unordered_map<uint64_t, std::shared_ptr<Connection>> connections_;
+  std::atomic<uint64_t> scheduled_{0};  // connections queued or being parsed
+  std::atomic<bool> stopping_{false};
+  std::atomic<uint64_t> rejected_chunks_{0};
+};
+
+template <typename ProtoHeader>
+ConnectionBalancer<ProtoHeader>::ConnectionBalancer(const BalancerOptions& options)
+    : options_(options) {
+  if (options_.shards == 0) {
+    options_.shards = std::max(1u, std::thread::hardware_concurrency());
+  }
+  options_.connection_batch = std::max(1u, options_.connection_batch);
+  for (uint32_t i = 0; i < options_.shards; ++i) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+  for (auto& shard : shards_) {
+    shard->thread = std::thread([this, raw = shard.get()]() { Run(*raw); });
+  }
+}
+
+template <typename ProtoHeader>
+ConnectionBalancer<ProtoHeader>::~ConnectionBalancer() {
+  stopping_.store(true);
+  for (auto& shard : shards_) {
+    // under the mutex, so that a shard cannot miss the wake-up between its check and its wait
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->ready.notify_all();
+  }
+  for (auto& shard : shards_) {
+    shard->thread.join();
+  }
+}
+
+template <typename ProtoHeader>
+bool ConnectionBalancer<ProtoHeader>::AddConnection(uint64_t id, std::unique_ptr<Parser> parser) {
+  auto connection = std::make_shared<Connection>();
+  connection->id = id;
+  connection->parser = std::move(parser);
+  connection->parser->SetLoadTracking(true, options_.load_half_life_ns);
+  connection->shard = HomeShard(id, shard_count());
+  connection->target = connection->shard;
+  std::lock_guard<std::mutex> lock(table_mutex_);
+  return connections_.emplace(id, std::move(connection)).second;
+}
+
+template <typename ProtoHeader>
+void ConnectionBalancer<ProtoHeader>::RemoveConnection(uint64_t id) {
+  std::lock_guard<std::mutex> lock(table_mutex_);
+  connections_.erase(id);
+}
+
+template <typename ProtoHeader>
+std::shared_ptr<typename ConnectionBalancer<ProtoHeader>::Connection>
+ConnectionBalancer<ProtoHeader>::Find(uint64_t id) const {
+  std::lock_guard<std::mutex> lock(table_mutex_);
+  auto it = connections_.find(id);
+  return it == connections_.end() ? nullptr : it->second;
+}
+
+template <typename ProtoHeader>
+bool ConnectionBalancer<ProtoHeader>::HandleData(uint64_t id, const uint8_t* data,
+                                                 uint32_t length) {
+  auto connection = Find(id);
+  if (connection == nullptr) {
+    return false;
+  }
+  uint32_t shard = 0;
+  {
+    std::lock_guard<std::mutex> lock(connection->mutex);
+    connection->chunks.emplace_back(data, data + length);
+    if (connection->scheduled) {
+      return true;
+    }
+    connection->scheduled = true;
+    shard = connection->shard;
+  }
+  scheduled_.fetch_add(1);
+  Schedule(connection, shard);
+  return true;
+}
+
+template <typename ProtoHeader>
+void ConnectionBalancer<ProtoHeader>::Schedule(const std::shared_ptr<Connection>& connection,
+                                               uint32_t shard) {
+  Shard& target = *shards_[shard];
+  std::lock_guard<std::mutex> lock(target.mutex);
+  target.run_queue.push_back(connection);
+  target.ready.notify_one();
+}
+
+template <typename ProtoHeader>
+void ConnectionBalancer<ProtoHeader>::MaybeMove(Connection& connection) {
+  if (connection.target != connection.shard && connection.parser->at_frame_boundary()) {
+    connection.shard = connection.target;
+  }
+}
+
+template <typename ProtoHeader>
+void ConnectionBalancer<ProtoHeader>::ScheduleAt(const std::shared_ptr<Connection>& connection,
+                                                 uint32_t shard, uint64_t due_ns) {
+  Shard& target = *shards_[shard];
+  std::lock_guard<std::mutex> lock(target.mutex);
+  target.deferred.emplace(due_ns, connection);
+  target.ready.notify_one();
+}
+
+/// @brief Wait for a connection to parse, deferred ones once their time has come (at once when
+/// stopping). Returns nullptr when the shard stops.
+template <typename ProtoHeader>
+std::shared_ptr<typename ConnectionBalancer<ProtoHeader>::Connection>
+ConnectionBalancer<ProtoHeader>::NextConnection(Shard& shard) {
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  while (true) {
+    const uint64_t now_ns = MonotonicNowNs();
+    while (!shard.deferred.empty() &&
+           (shard.deferred.begin()->first <= now_ns || stopping_.load())) {
+      shard.run_queue.push_back(std::move(shard.deferred.begin()->second));
+      shard.deferred.erase(shard.deferred.begin());
+    }
+    if (!shard.run_queue.empty()) {
+      auto connection = std::move(shard.run_queue.front());
+      shard.run_queue.pop_front();
+      return connection;
+    }
+    // a stopping shard stays until no connection can be rescheduled onto it
+    if (stopping_.load() && scheduled_.load() == 0) {
+      return nullptr;
+    }
+    if (shard.deferred.empty()) {
+      shard.ready.wait(lock);
+    } else {
+      shard.ready.wait_for(lock, std::chrono::nanoseconds(shard.deferred.begin()->first - now_ns));
+    }
+  }
+}
+
+template <typename ProtoHeader>
+uint32_t ConnectionBalancer<ProtoHeader>::Feed(Parser& parser, const std::vector<uint8_t>& chunk) {
+  const auto length = static_cast<uint32_t>(chunk.size());
+  if (parser.HandleData(chunk.data(), length)) {
+    return length;
+  }
+  // the ring is short of room: buffer what fits and parse it, which may free more
+  uint32_t fed = 0;
+  while (fed < length) {
+    uint32_t reserved = 0;
+    uint8_t* region = parser.ReserveInput(length - fed, reserved);
+    if (reserved == 0) {
+      break;
+    }
+    std::memcpy(region, chunk.data() + fed, reserved);
+    parser.CommitInput(reserved);
+    fed += reserved;
+  }
+  return fed;
+}
+
+template <typename ProtoHeader>
+void ConnectionBalancer<ProtoHeader>::Run(Shard& shard) {
+  while (auto connection = NextConnection(shard)) {
+    Parser& parser = *connection->parser;
+    if (parser.deferred()) {
+      parser.ParseBuffered();
+    }
+    bool stalled = false;
+    std::vector<uint8_t> chunk;
+    for (uint32_t i = 0; i < options_.connection_batch && !stalled; ++i) {
+      {
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        if (connection->chunks.empty()) {
+          break;
+        }
+        chunk = std::move(connection->chunks.front());
+        connection->chunks.pop_front();
+      }
+      const uint32_t fed = Feed(parser, chunk);
+      if (fed < chunk.size()) {
+        // the rest waits at the head of the queue, the stream stays contiguous
+        chunk.erase(chunk.begin(), chunk.begin() + fed);
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        connection->chunks.push_front(std::move(chunk));
+        stalled = fed == 0 || parser.deferred();
+      }
+    }
+    const bool deferred = parser.deferred() && !stopping_.load();
+    if (stalled && !deferred) {
+      rejected_chunks_.fetch_add(1, std::memory_order_relaxed);
+    }
+    {
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      MaybeMove(*connection);
+      const uint32_t next_shard = connection->shard;
+      if (deferred) {
+        // resumed by the shard once the ingress limits allow the next frame
+        ScheduleAt(connection, next_shard, MonotonicNowNs() + parser.defer_wait_ns());
+        continue;
+      }
+      if (!connection->chunks.empty() && !stalled) {
+        // more bytes arrived, they follow the connection
+        Schedule(connection, next_shard);
+        continue;
+      }
+      // a stalled connection is retried by the next `HandleData`
+      connection->scheduled = false;
+    }
+    if (scheduled_.fetch_sub(1) == 1 && stopping_.load()) {
+      for (auto& other : shards_) {
+        std::lock_guard<std::mutex> lock(other->mutex);
+        other->ready.notify_all();
+      }
+    }
+  }
+}
+
+template <typename ProtoHeader>
+bool ConnectionBalancer<ProtoHeader>::MoveConnection(uint64_t id, uint32_t shard) {
+  auto connection = Find(id);
+  if (connection == nullptr || shard >= shards_.size()) {
+    return false;
+  }
+  SetTarget(*connection, shard);
+  return true;
+}
+
+template <typename ProtoHeader>
+void ConnectionBalancer<ProtoHeader>::SetTarget(Connection& connection, uint32_t shard) {
+  std::lock_guard<std::mutex> lock(connection.mutex);
+  connection.target = shard;
+  if (!connection.scheduled) {
+    // no shard is parsing it, the parser can be inspected here
+    MaybeMove(connection);
+  }
+}
+
+template <typename ProtoHeader>
+int32_t ConnectionBalancer<ProtoHeader>::shard_of(uint64_t id) const {
+  auto connection = Find(id);
+  if (connection == nullptr) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(connection->mutex);
+  return static_cast<int32_t>(connection->shard);
+}
+
+template <typename ProtoHeader>
+std::vector<double> ConnectionBalancer<ProtoHeader>::shard_loads() const {
+  std::vector<double> loads(shards_.size(), 0);
+  const uint64_t now_ns = MonotonicNowNs();
+  std::lock_guard<std::mutex> lock(table_mutex_);
+  for (const auto& entry : connections_) {
+    std::lock_guard<std::mutex> connection_lock(entry.second->mutex);
+    loads[entry.second->shard] += entry.second->parser->load().busy_ns_per_second(now_ns) / 1e9;
+  }
+  return loads;
+}
+
+template <typename ProtoHeader>
+double ConnectionBalancer<ProtoHeader>::Imbalance(const std::vector<double>& loads) {
+  double total = 0;
+  double busiest = 0;
+  for (double load : loads) {
+    total += load;
+    busiest = std::max(busiest, load);
+  }
+  if (loads.empty() || total <= 0) {
+    return 1;
+  }
+  return busiest * static_cast<double>(loads.size()) / total;
+}
+
+/// @brief Greedy: while the busiest shard is over the threshold, move its heaviest connection that
+/// still leaves the idlest shard below the busiest one's current load, so that every move lowers
+/// the maximum.
+template <typename ProtoHeader>
+RebalanceReport ConnectionBalancer<ProtoHeader>::Rebalance() {
+  struct Candidate {
+    std::shared_ptr<Connection> connection;
+    uint32_t shard;
+    double load;
+  };
+  RebalanceReport report;
+  const uint64_t now_ns = MonotonicNowNs();
+  std::vector<Candidate> candidates;
+  {
+    std::lock_guard<std::mutex> lock(table_mutex_);
+    candidates.reserve(connections_.size());
+    for (const auto& entry : connections_) {
+      std::lock_guard<std::mutex> connection_lock(entry.second->mutex);
+      // a pending move counts where the connection is going
+      candidates.push_back({entry.second, entry.second->target,
+                            entry.second->parser->load().busy_ns_per_second(now_ns) / 1e9});
+    }
+  }
+  std::vector<double> loads(shards_.size(), 0);
+  double total = 0;
+  for (const auto& candidate : candidates) {
+    loads[candidate.shard] += candidate.load;
+    total += candidate.load;
+  }
+  report.loads_before = loads;
+  report.imbalance_before = Imbalance(loads);
+  const double limit = options_.imbalance_threshold * total / static_cast<double>(loads.size());
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate& a, const Candidate& b) { return a.load > b.load; });
+  while (report.moves.size() < options_.max_moves) {
+    const auto busiest = static_cast<uint32_t>(
+        std::max_element(loads.begin(), loads.end()) - loads.begin());
+    const auto idlest = static_cast<uint32_t>(
+        std::min_element(loads.begin(), loads.end()) - loads.begin());
+    if (loads[busiest] <= limit) {
+      break;
+    }
+    auto it = std::find_if(candidates.begin(), candidates.end(), [&](const Candidate& c) {
+      return c.shard == busiest && c.load > 0 && loads[idlest] + c.load < loads[busiest];
+    });
+    if (it == candidates.end()) {
+      break;
+    }
+    loads[busiest] -= it->load;
+    loads[idlest] += it->load;
+    it->shard = idlest;
+    report.moves.push_back({it->connection->id, busiest, idlest, it->load});
+    SetTarget(*it->connection, idlest);
+  }
+  report.loads_after = loads;
+  report.imbalance_after = Imbalance(loads);
+  return report;
+}
+
+#endif  // SRC_CONNECTION_BALANCER_H_
@@ -0,0 +1,254 @@
+#include "connection_balancer.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "load_meter.h"
+
+struct SeqHeader {
+  uint32_t body_length;
+  uint32_t seq;
+};
+
+namespace {
+/// @brief Poll `done` for up to `timeout_ms`.
+template <typename Fn>
+bool WaitFor(Fn&& done, int timeout_ms) {
+  for (int waited = 0; waited < timeout_ms; waited += 2) {
+    if (done()) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  return done();
+}
+
+std::vector<uint8_t> EncodeFrames(uint32_t first_seq, uint32_t count, uint32_t body_length) {
+  std::vector<uint8_t> stream;
+  for (uint32_t seq = first_seq; seq < first_seq + count; ++seq) {
+    SeqHeader header = {htonl(body_length), seq};
+    const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+    stream.insert(stream.end(), raw, raw + sizeof(header));
+    stream.insert(stream.end(), body_length, 0x5a);
+  }
+  return stream;
+}
+
+/// @brief What the handlers of one connection saw.
+struct Delivery {
+  std::mutex mutex;
+  std::vector<uint32_t> seqs;
+  std::vector<std::thread::id> threads;
+  uint32_t current = 0;
+};
+
+std::unique_ptr<StreamingParser<SeqHeader>> MakeParser(Delivery& delivery, uint32_t work_us) {
+  return std::make_unique<StreamingParser<SeqHeader>>(
+      [&delivery](const SeqHeader& header) {
+        delivery.current = header.seq;
+        return true;
+      },
+      [&delivery, work_us](const uint8_t* data, uint32_t length) {
+        const auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(work_us);
+        while (std::chrono::steady_clock::now() < until) {
+          // a handler burning CPU
+        }
+        std::lock_guard<std::mutex> lock(delivery.mutex);
+        delivery.seqs.push_back(delivery.current);
+        delivery.threads.push_back(std::this_thread::get_id());
+        return true;
+      });
+}
+}  // namespace
+
+TEST(LoadMeter, moving_averages) {
+  LoadMeter meter(160000000);
+  // 1000 bytes and 5 ms of work every 10 ms, for 2 s
+  uint64_t now_ns = 1000000000;
+  for (int i = 0; i < 200; ++i) {
+    now_ns += 10000000;
+    meter.Record(1000, 5000000, now_ns);
+  }
+  EXPECT_NEAR(meter.bytes_per_second(now_ns), 100000, 5000);
+  EXPECT_NEAR(meter.busy_ns_per_second(now_ns), 0.5e9, 0.025e9);
+  // an idle connection decays by half every half life, past the open window
+  EXPECT_NEAR(meter.bytes_per_second(now_ns + 10000000 + 160000000), 50000, 5000);
+  EXPECT_LT(meter.busy_ns_per_second(now_ns + 2000000000), 0.001e9);
+
+  // a new burst after the idle period
+  now_ns += 2000000000;
+  for (int i = 0; i < 100; ++i) {
+    now_ns += 10000000;
+    meter.Record(4000, 0, now_ns);
+  }
+  EXPECT_NEAR(meter.bytes_per_second(now_ns), 400000, 20000);
+  EXPECT_LT(meter.busy_ns_per_second(now_ns), 0.001e9);
+}
+
+TEST(ConnectionBalancer, moves_heavy_connections_off_a_hot_shard) {
+  BalancerOptions options;
+  options.shards = 4;
+  options.load_half_life_ns = 100000000;
+  ConnectionBalancer<SeqHeader> balancer(options);
+  ASSERT_EQ(balancer.shard_count(), 4u);
+
+  // four heavy connections that happen to hash onto shard 0, and light ones elsewhere
+  std::vector<uint64_t> heavy;
+  std::vector<uint64_t> light;
+  for (uint64_t id = 0; heavy.size() < 4 || light.size() < 4; ++id) {
+    ASSERT_LT(id, 1000u);
+    std::vector<uint64_t>& group = ConnectionBalancer<SeqHeader>::HomeShard(id, 4) == 0 ? heavy
+                                                                                       : light;
+    if (group.size() < 4) {
+      group.push_back(id);
+    }
+  }
+  std::vector<std::unique_ptr<Delivery>> deliveries(8);
+  for (size_t i = 0; i < 8; ++i) {
+    deliveries[i] = std::make_unique<Delivery>();
+    const uint64_t id = i < 4 ? heavy[i] : light[i - 4];
+    ASSERT_TRUE(balancer.AddConnection(id, MakeParser(*deliveries[i], i < 4 ? 200 : 0)));
+    ASSERT_FALSE(balancer.AddConnection(id, MakeParser(*deliveries[i], 0)));
+    EXPECT_EQ(balancer.shard_of(id) == 0, i < 4);
+  }
+  EXPECT_EQ(balancer.shard_of(1000000), -1);
+
+  // frames trickle in for about 150 ms
+  constexpr uint32_t kRounds = 50;
+  constexpr uint32_t kFramesPerRound = 3;
+  auto delivered = [&](size_t i) {
+    std::lock_guard<std::mutex> lock(deliveries[i]->mutex);
+    return deliveries[i]->seqs.size();
+  };
+  auto all_delivered = [&](size_t count) {
+    for (size_t i = 0; i < 8; ++i) {
+      if (delivered(i) != count) {
+        return false;
+      }
+    }
+    return true;
+  };
+  for (uint32_t round = 0; round < kRounds; ++round) {
+    auto frames = EncodeFrames(round * kFramesPerRound, kFramesPerRound, 64);
+    for (size_t i = 0; i < 8; ++i) {
+      const uint64_t id = i < 4 ? heavy[i] : light[i - 4];
+      ASSERT_TRUE(balancer.HandleData(id, frames.data(), static_cast<uint32_t>(frames.size())));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+  }
+  ASSERT_TRUE(WaitFor([&]() { return all_delivered(kRounds * kFramesPerRound); }, 20000));
+
+  std::vector<double> loads = balancer.shard_loads();
+  EXPECT_GT(loads[0], loads[1] + loads[2] + loads[3]);
+  RebalanceReport report = balancer.Rebalance();
+  EXPECT_GT(report.imbalance_before, 2.5);
+  EXPECT_LT(report.imbalance_after, 1.5);
+  EXPECT_LT(report.imbalance_after, report.imbalance_before);
+  ASSERT_EQ(report.moves.size(), 3u);
+  std::set<uint32_t> destinations;
+  for (const RebalanceMove& move : report.moves) {
+    EXPECT_EQ(move.from, 0u);
+    destinations.insert(move.to);
+    // idle connections stand at a frame boundary and move at once
+    EXPECT_EQ(balancer.shard_of(move.connection), static_cast<int32_t>(move.to));
+  }
+  EXPECT_EQ(destinations, std::set<uint32_t>({1, 2, 3}));
+
+  // the moved connections keep their order and now run on other threads
+  auto frames = EncodeFrames(kRounds * kFramesPerRound, 10, 64);
+  for (size_t i = 0; i < 8; ++i) {
+    const uint64_t id = i < 4 ? heavy[i] : light[i - 4];
+    ASSERT_TRUE(balancer.HandleData(id, frames.data(), static_cast<uint32_t>(frames.size())));
+  }
+  ASSERT_TRUE(WaitFor([&]() { return all_delivered(kRounds * kFramesPerRound + 10); }, 20000));
+  std::set<std::thread::id> heavy_threads;
+  for (size_t i = 0; i < 4; ++i) {
+    std::lock_guard<std::mutex> lock(deliveries[i]->mutex);
+    for (size_t n = 0; n < deliveries[i]->seqs.size(); ++n) {
+      ASSERT_EQ(deliveries[i]->seqs[n], n);
+    }
+    heavy_threads.insert(deliveries[i]->threads.back());
+  }
+  EXPECT_EQ(heavy_threads.size(), 4u);
+  EXPECT_EQ(balancer.rejected_chunks(), 0u);
+}
+
+TEST(ConnectionBalancer, moves_at_a_frame_boundary) {
+  BalancerOptions options;
+  options.shards = 2;
+  ConnectionBalancer<SeqHeader> balancer(options);
+  Delivery delivery;
+  ASSERT_TRUE(balancer.AddConnection(7, MakeParser(delivery, 0)));
+  const int32_t home = balancer.shard_of(7);
+  const auto other = static_cast<uint32_t>(1 - home);
+
+  // half a frame is buffered: the move waits for the rest of it
+  auto frames = EncodeFrames(0, 2, 100);
+  const uint32_t half = sizeof(SeqHeader) + 50;
+  ASSERT_TRUE(balancer.HandleData(7, frames.data(), half));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_TRUE(balancer.MoveConnection(7, other));
+  EXPECT_FALSE(balancer.MoveConnection(7, 2));
+  EXPECT_EQ(balancer.shard_of(7), home);
+
+  ASSERT_TRUE(balancer.HandleData(7, frames.data() + half,
+                                  static_cast<uint32_t>(frames.size()) - half));
+  ASSERT_TRUE(WaitFor([&]() { return balancer.shard_of(7) == static_cast<int32_t>(other); }, 5000));
+  std::lock_guard<std::mutex> lock(delivery.mutex);
+  EXPECT_EQ(delivery.seqs, std::vector<uint32_t>({0, 1}));
+  // both frames completed on the original shard, the move came after them
+  EXPECT_EQ(delivery.threads[0], delivery.threads[1]);
+}
+
+TEST(ConnectionBalancer, feeds_a_chunk_larger_than_the_ring) {
+  ConnectionBalancer<SeqHeader> balancer(BalancerOptions{});
+  Delivery delivery;
+  ASSERT_TRUE(balancer.AddConnection(3, MakeParser(delivery, 0)));
+  // 100 frames of 72 bytes in one chunk, more than three times the ring
+  auto frames = EncodeFrames(0, 100, 64);
+  ASSERT_TRUE(balancer.HandleData(3, frames.data(), static_cast<uint32_t>(frames.size())));
+  frames = EncodeFrames(100, 10, 64);
+  ASSERT_TRUE(balancer.HandleData(3, frames.data(), static_cast<uint32_t>(frames.size())));
+  ASSERT_TRUE(WaitFor(
+      [&]() {
+        std::lock_guard<std::mutex> lock(delivery.mutex);
+        return delivery.seqs.size() == 110;
+      },
+      5000));
+  std::lock_guard<std::mutex> lock(delivery.mutex);
+  for (uint32_t n = 0; n < 110; ++n) {
+    ASSERT_EQ(delivery.seqs[n], n);
+  }
+  EXPECT_EQ(balancer.rejected_chunks(), 0u);
+}
+
+TEST(ConnectionBalancer, resumes_a_deferred_connection) {
+  ConnectionBalancer<SeqHeader> balancer(BalancerOptions{});
+  Delivery delivery;
+  auto parser = MakeParser(delivery, 0);
+  IngressLimits limits;
+  limits.frames_per_second = 200;
+  limits.frame_burst = 2;
+  limits.action = RateLimitAction::kDefer;
+  parser->SetIngressLimits(limits);
+  ASSERT_TRUE(balancer.AddConnection(5, std::move(parser)));
+
+  // no more bytes arrive: the shard resumes the connection once the bucket refills
+  auto frames = EncodeFrames(0, 6, 16);
+  ASSERT_TRUE(balancer.HandleData(5, frames.data(), static_cast<uint32_t>(frames.size())));
+  ASSERT_TRUE(WaitFor(
+      [&]() {
+        std::lock_guard<std::mutex> lock(delivery.mutex);
+        return delivery.seqs.size() == 6;
+      },
+      5000));
+  std::lock_guard<std::mutex> lock(delivery.mutex);
+  EXPECT_EQ(delivery.seqs, std::vector<uint32_t>({0, 1, 2, 3, 4, 5}));
+}
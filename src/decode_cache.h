@@ -0,0 +1,311 @@
+/**
+ * @file decode_cache.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_DECODE_CACHE_H_
+#define SRC_DECODE_CACHE_H_
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "header_field.h"
+#include "streaming_parser.h"
+
+/// @brief Identifies a body by content: the message type, the length and the XXH64 of the body.
+struct DecodeCacheKey {
+  uint64_t msg_type = 0;
+  uint32_t length = 0;
+  uint64_t digest = 0;
+
+  bool operator==(const DecodeCacheKey& other) const {
+    return msg_type == other.msg_type && length == other.length && digest == other.digest;
+  }
+};
+
+struct DecodeCacheOptions {
+  /// @brief Upper bound of the summed cost of the cached objects.
+  size_t capacity = 4 << 20;
+  /// @brief Upper bound of the number of cached objects.
+  uint32_t max_entries = 4096;
+  /// @brief Keep a copy of each body and compare it on a hit, so that a hash collision is a miss
+  /// rather than a wrong object. Costs a copy per insertion and a compare per hit.
+  bool verify_bodies = false;
+};
+
+struct DecodeCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t insertions = 0;
+  uint64_t evictions = 0;
+  /// @brief Lookups whose key matched an entry holding a different body (with `verify_bodies`).
+  uint64_t collisions = 0;
+  /// @brief Objects not cached because their cost alone exceeds the capacity.
+  uint64_t oversized = 0;
+};
+
+/// @brief A content-addressed cache of decoded bodies, for channels that resend identical bodies.
+/// Objects are handed out as shared pointers: an evicted object stays alive for as long as a
+/// consumer holds it. The cache is bounded by entries and by a caller supplied cost per object, and
+/// evicts with CLOCK: a hit only sets the entry's reference bit, the hand clears the bits it passes
+/// and evicts the first entry found without one. One cache may be shared by several connections,
+/// it is guarded by a mutex.
+/// @tparam Decoded The type of the decoded objects.
+template <typename Decoded>
+class DecodeCache {
+ public:
+  using Ptr = std::shared_ptr<const Decoded>;
+
+  explicit DecodeCache(const DecodeCacheOptions& options = DecodeCacheOptions());
+  DecodeCache(const DecodeCache&) = delete;
+  DecodeCache& operator=(const DecodeCache&) = delete;
+
+  /// @brief The object cached for `key`, or nullptr. `body` is only read with `verify_bodies`.
+  Ptr Find(const DecodeCacheKey& key, const uint8_t* body);
+
+  /// @brief Cache `value` decoded from `body` under `key`, evicting entries until `cost` fits.
+  void Insert(const DecodeCacheKey& key, const uint8_t* body, Ptr value, size_t cost);
+
+  /// @brief Drop every entry.
+  void Clear();
+
+  size_t size() const;
+  size_t cost() const;
+  DecodeCacheStats stats() const;
+
+ private:
+  struct Entry {
+    DecodeCacheKey key;
+    Ptr value;
+    std::vector<uint8_t> body;  // with `verify_bodies`
+    size_t cost = 0;
+    bool used = false;
+    bool referenced = false;
+  };
+  struct KeyHash {
+    size_t operator()(const DecodeCacheKey& key) const {
+      // the digest is already well mixed
+      return static_cast<size_t>(key.digest ^ (key.msg_type * 0x9E3779B97F4A7C15ull) ^ key.length);
+    }
+  };
+
+  void Evict(uint32_t slot);
+  /// @brief Advance the clock hand to the next entry without a reference bit and evict it.
+  void EvictOne();
+
+  DecodeCacheOptions options_;
+  mutable std::mutex mutex_;
+  std::vector<Entry> entries_;
+  std::vector<uint32_t> free_slots_;
+  std::unordered_map<DecodeCacheKey, uint32_t, KeyHash> index_;
+  uint32_t hand_ = 0;
+  size_t cost_ = 0;
+  DecodeCacheStats stats_;
+};
+
+template <typename Decoded>
+DecodeCache<Decoded>::DecodeCache(const DecodeCacheOptions& options)
+    : options_(options), entries_(options.max_entries) {
+  assert(options.max_entries > 0);
+  free_slots_.reserve(options.max_entries);
+  for (uint32_t slot = options.max_entries; slot > 0; --slot) {
+    free_slots_.push_back(slot - 1);
+  }
+  index_.reserve(options.max_entries);
+}
+
+template <typename Decoded>
+typename DecodeCache<Decoded>::Ptr DecodeCache<Decoded>::Find(const DecodeCacheKey& key,
+                                                              const uint8_t* body) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    ++stats_.misses;
+    return nullptr;
+  }
+  Entry& entry = entries_[it->second];
+  if (options_.verify_bodies && key.length > 0 &&
+      std::memcmp(entry.body.data(), body, key.length) != 0) {
+    ++stats_.collisions;
+    ++stats_.misses;
+    return nullptr;
+  }
+  entry.referenced = true;
+  ++stats_.hits;
+  return entry.value;
+}
+
+template <typename Decoded>
+void DecodeCache<Decoded>::Insert(const DecodeCacheKey& key, const uint8_t* body, Ptr value,
+                                  size_t cost) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (cost > options_.capacity) {
+    ++stats_.oversized;
+    return;
+  }
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    // decoded concurrently by another connection, or a collision replacing the older body
+    Evict(it->second);
+  }
+  while (free_slots_.empty() || cost_ + cost > options_.capacity) {
+    EvictOne();
+  }
+  const uint32_t slot = free_slots_.back();
+  free_slots_.pop_back();
+  Entry& entry = entries_[slot];
+  entry.key = key;
+  entry.value = std::move(value);
+  if (options_.verify_bodies) {
+    entry.body.assign(body, body + key.length);
+  }
+  entry.cost = cost;
+  entry.used = true;
+  // a new entry survives one pass of the hand only once it is hit
+  entry.referenced = false;
+  cost_ += cost;
+  index_.emplace(key, slot);
+  ++stats_.insertions;
+}
+
+template <typename Decoded>
+void DecodeCache<Decoded>::Evict(uint32_t slot) {
+  Entry& entry = entries_[slot];
+  index_.erase(entry.key);
+  cost_ -= entry.cost;
+  entry.value.reset();
+  entry.body.clear();
+  entry.used = false;
+  entry.referenced = false;
+  free_slots_.push_back(slot);
+}
+
+template <typename Decoded>
+void DecodeCache<Decoded>::EvictOne() {
+  // every entry holds a reference bit at worst, the second pass evicts
+  for (;;) {
+    Entry& entry = entries_[hand_];
+    const uint32_t slot = hand_;
+    hand_ = hand_ + 1 == entries_.size() ? 0 : hand_ + 1;
+    if (!entry.used) {
+      continue;
+    }
+    if (entry.referenced) {
+      entry.referenced = false;
+      continue;
+    }
+    Evict(slot);
+    ++stats_.evictions;
+    return;
+  }
+}
+
+template <typename Decoded>
+void DecodeCache<Decoded>::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (uint32_t slot = 0; slot < entries_.size(); ++slot) {
+    if (entries_[slot].used) {
+      Evict(slot);
+    }
+  }
+}
+
+template <typename Decoded>
+size_t DecodeCache<Decoded>::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index_.size();
+}
+
+template <typename Decoded>
+size_t DecodeCache<Decoded>::cost() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cost_;
+}
+
+template <typename Decoded>
+DecodeCacheStats DecodeCache<Decoded>::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+/// @brief A decode stage between a parser and the application: bodies already decoded are looked
+/// up in a `DecodeCache` by the hash the parser computed while buffering them, and only misses
+/// reach the decode function. Wire `OnHeader` and `OnBody` as the parser's handlers and `Attach`
+/// the parser, which turns its body hashing on. Frames without a body are decoded uncached.
+/// @tparam ProtoHeader The protocol header struct type.
+/// @tparam Decoded The type of the decoded objects.
+template <typename ProtoHeader, typename Decoded>
+class CachedDecoder {
+ public:
+  using Parser = StreamingParser<ProtoHeader>;
+  using Ptr = typename DecodeCache<Decoded>::Ptr;
+  /// @brief Decodes a body, nullptr when it is malformed. Failed decodes are not cached.
+  using DecodeFn =
+      std::function<Ptr(const ProtoHeader& header, const uint8_t* data, uint32_t length)>;
+  /// @brief The cost of a decoded object against the cache capacity, by default its body length.
+  using CostFn = std::function<size_t(const Decoded& value, uint32_t length)>;
+  /// @brief Receives the decoded object of each frame, nullptr when decoding failed.
+  using ResultHandler = std::function<bool(const ProtoHeader& header, const Ptr& value)>;
+
+  /// @param msg_type The header field that, with the body, determines the decoded object, see
+  /// `MakeHeaderField`.
+  CachedDecoder(DecodeCache<Decoded>& cache, HeaderField msg_type, DecodeFn&& decode,
+                ResultHandler&& handler, CostFn&& cost = nullptr)
+      : cache_(cache),
+        msg_type_(msg_type),
+        decode_(std::move(decode)),
+        handler_(std::move(handler)),
+        cost_(std::move(cost)) {}
+
+  void Attach(Parser& parser) {
+    parser_ = &parser;
+    parser.SetBodyHashing(true);
+  }
+
+  bool OnHeader(const ProtoHeader& header) {
+    current_header_ = header;
+    if (header.body_length == 0) {
+      return handler_(header, decode_(header, nullptr, 0));
+    }
+    return true;
+  }
+
+  bool OnBody(const uint8_t* data, uint32_t length) {
+    assert(parser_ != nullptr);
+    const DecodeCacheKey key{msg_type_.Load(&current_header_), length, parser_->body_digest()};
+    Ptr value = cache_.Find(key, data);
+    if (value == nullptr) {
+      ++decoded_bodies_;
+      value = decode_(current_header_, data, length);
+      if (value != nullptr) {
+        cache_.Insert(key, data, value, cost_ ? cost_(*value, length) : length);
+      }
+    }
+    return handler_(current_header_, value);
+  }
+
+  /// @brief Bodies that went through the decode function.
+  uint64_t decoded_bodies() const { return decoded_bodies_; }
+
+ private:
+  DecodeCache<Decoded>& cache_;
+  HeaderField msg_type_;
+  DecodeFn decode_;
+  ResultHandler handler_;
+  CostFn cost_;
+  const Parser* parser_ = nullptr;
+  ProtoHeader current_header_;
+  uint64_t decoded_bodies_ = 0;
+};
+
+#endif  // SRC_DECODE_CACHE_H_
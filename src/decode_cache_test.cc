@@ -0,0 +1,171 @@
+#include "decode_cache.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "body_hash.h"
+#include "streaming_parser.h"
+
+struct ConfigHeader {
+  uint32_t body_length;
+  uint16_t msg_type;
+  uint16_t flags;
+};
+
+namespace {
+void AppendFrame(std::vector<uint8_t>& stream, uint16_t msg_type, const std::string& body) {
+  ConfigHeader header = {};
+  header.body_length = htonl(static_cast<uint32_t>(body.size()));
+  header.msg_type = msg_type;
+  const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+  stream.insert(stream.end(), raw, raw + sizeof(header));
+  stream.insert(stream.end(), body.begin(), body.end());
+}
+
+const uint8_t* Bytes(const std::string& text) {
+  return reinterpret_cast<const uint8_t*>(text.data());
+}
+
+DecodeCacheKey KeyOf(uint64_t msg_type, const std::string& body) {
+  return DecodeCacheKey{msg_type, static_cast<uint32_t>(body.size()),
+                        BodyHasher::Hash(Bytes(body), static_cast<uint32_t>(body.size()))};
+}
+}  // namespace
+
+TEST(BodyHasher, known_values) {
+  EXPECT_EQ(BodyHasher::Hash(nullptr, 0), 0xEF46DB3751D8E999ull);
+  EXPECT_EQ(BodyHasher::Hash(Bytes("a"), 1), 0xD24EC4F1A98C6E5Bull);
+  EXPECT_EQ(BodyHasher::Hash(Bytes("abc"), 3), 0x44BC2CF5AD770999ull);
+}
+
+TEST(BodyHasher, streaming_matches_one_shot) {
+  std::vector<uint8_t> data(1000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<uint8_t>(i * 31 + 7);
+  }
+  const uint64_t expected = BodyHasher::Hash(data.data(), static_cast<uint32_t>(data.size()), 5);
+  for (uint32_t piece : {1u, 3u, 31u, 32u, 33u, 100u}) {
+    BodyHasher hasher(5);
+    for (uint32_t offset = 0; offset < data.size(); offset += piece) {
+      hasher.Update(data.data() + offset,
+                    std::min<uint32_t>(piece, static_cast<uint32_t>(data.size()) - offset));
+    }
+    EXPECT_EQ(hasher.Digest(), expected) << "piece " << piece;
+  }
+}
+
+TEST(DecodeCache, parser_hashes_bodies_while_buffering) {
+  // bodies fed a few bytes at a time, and wrapping around the end of the ring
+  std::vector<std::string> bodies;
+  std::vector<uint8_t> stream;
+  for (int i = 0; i < 40; ++i) {
+    bodies.push_back(std::string(90 + i * 7, static_cast<char>('a' + i % 26)) + std::to_string(i));
+    AppendFrame(stream, 1, bodies.back());
+  }
+  std::vector<uint64_t> digests;
+  std::unique_ptr<StreamingParser<ConfigHeader>> parser;
+  parser = std::make_unique<StreamingParser<ConfigHeader>>(
+      [](const ConfigHeader&) { return true; },
+      [&](const uint8_t* data, uint32_t length) {
+        EXPECT_EQ(parser->body_digest(), BodyHasher::Hash(data, length));
+        digests.push_back(parser->body_digest());
+        return true;
+      });
+  parser->SetBodyHashing(true);
+  for (size_t offset = 0; offset < stream.size(); offset += 13) {
+    parser->HandleData(stream.data() + offset,
+                       static_cast<uint32_t>(std::min<size_t>(13, stream.size() - offset)));
+  }
+  ASSERT_EQ(digests.size(), bodies.size());
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    EXPECT_EQ(digests[i], KeyOf(1, bodies[i]).digest);
+  }
+}
+
+TEST(DecodeCache, repeated_bodies_decode_once) {
+  DecodeCache<std::string> cache;
+  std::vector<std::string> results;
+  CachedDecoder<ConfigHeader, std::string> decoder(
+      cache, MakeHeaderField(&ConfigHeader::msg_type),
+      [](const ConfigHeader& header, const uint8_t* data, uint32_t length) {
+        return std::make_shared<const std::string>(std::to_string(header.msg_type) + ":" +
+                                                   std::string(data, data + length));
+      },
+      [&results](const ConfigHeader&, const std::shared_ptr<const std::string>& value) {
+        results.push_back(value != nullptr ? *value : "<null>");
+        return true;
+      });
+  StreamingParser<ConfigHeader> parser(
+      [&decoder](const ConfigHeader& header) { return decoder.OnHeader(header); },
+      [&decoder](const uint8_t* data, uint32_t length) { return decoder.OnBody(data, length); });
+  decoder.Attach(parser);
+
+  std::vector<uint8_t> stream;
+  for (int round = 0; round < 10; ++round) {
+    AppendFrame(stream, 1, "config-v1");
+    AppendFrame(stream, 2, "config-v1");  // same body, another message type
+    AppendFrame(stream, 1, "config-v2");
+  }
+  parser.HandleData(stream.data(), static_cast<uint32_t>(stream.size()));
+
+  ASSERT_EQ(results.size(), 30u);
+  EXPECT_EQ(results[0], "1:config-v1");
+  EXPECT_EQ(results[1], "2:config-v1");
+  EXPECT_EQ(results[29], "1:config-v2");
+  EXPECT_EQ(decoder.decoded_bodies(), 3u);
+  const DecodeCacheStats stats = cache.stats();
+  EXPECT_EQ(stats.misses, 3u);
+  EXPECT_EQ(stats.hits, 27u);
+  EXPECT_EQ(cache.size(), 3u);
+}
+
+TEST(DecodeCache, clock_eviction_bounds_cost) {
+  DecodeCacheOptions options;
+  options.capacity = 100;
+  options.max_entries = 4;
+  DecodeCache<int> cache(options);
+  const std::string bodies[] = {"b0", "b1", "b2", "b3", "b4"};
+  for (int i = 0; i < 4; ++i) {
+    cache.Insert(KeyOf(0, bodies[i]), Bytes(bodies[i]), std::make_shared<const int>(i), 20);
+  }
+  EXPECT_EQ(cache.cost(), 80u);
+  // referenced entries get a second chance
+  ASSERT_NE(cache.Find(KeyOf(0, bodies[0]), Bytes(bodies[0])), nullptr);
+  ASSERT_NE(cache.Find(KeyOf(0, bodies[2]), Bytes(bodies[2])), nullptr);
+  std::shared_ptr<const int> held = cache.Find(KeyOf(0, bodies[1]), Bytes(bodies[1]));
+  cache.Insert(KeyOf(0, bodies[4]), Bytes(bodies[4]), std::make_shared<const int>(4), 20);
+
+  EXPECT_EQ(cache.stats().evictions, 1u);
+  EXPECT_EQ(cache.Find(KeyOf(0, bodies[3]), Bytes(bodies[3])), nullptr);
+  EXPECT_NE(cache.Find(KeyOf(0, bodies[4]), Bytes(bodies[4])), nullptr);
+
+  // over the cost bound, an evicted object stays alive for its holder
+  cache.Insert(KeyOf(1, bodies[0]), Bytes(bodies[0]), std::make_shared<const int>(5), 90);
+  EXPECT_LE(cache.cost(), options.capacity);
+  EXPECT_EQ(cache.size(), 1u);
+  EXPECT_EQ(cache.Find(KeyOf(0, bodies[1]), Bytes(bodies[1])), nullptr);
+  ASSERT_NE(held, nullptr);
+  EXPECT_EQ(*held, 1);
+
+  cache.Insert(KeyOf(2, bodies[0]), Bytes(bodies[0]), std::make_shared<const int>(6), 101);
+  EXPECT_EQ(cache.stats().oversized, 1u);
+}
+
+TEST(DecodeCache, verify_bodies_detects_collisions) {
+  DecodeCacheOptions options;
+  options.verify_bodies = true;
+  DecodeCache<int> cache(options);
+  const std::string body = "payload-a";
+  const std::string other = "payload-b";
+  const DecodeCacheKey key = KeyOf(3, body);
+  cache.Insert(key, Bytes(body), std::make_shared<const int>(1), 1);
+  EXPECT_NE(cache.Find(key, Bytes(body)), nullptr);
+  // the same key presented with another body of that length
+  EXPECT_EQ(cache.Find(key, Bytes(other)), nullptr);
+  EXPECT_EQ(cache.stats().collisions, 1u);
+}
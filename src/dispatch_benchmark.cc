@@ -0,0 +1,120 @@
+/**
+ * @file dispatch_benchmark.cc
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief Time per frame of the parser dispatching small frames to objects chosen by a header
+ * field, for several prefetch distances. Run by hand: dispatch_benchmark [frames] [objects].
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "streaming_parser.h"
+
+struct BenchHeader {
+  uint32_t body_length;
+  uint32_t object;  // index of the object the frame updates
+};
+
+namespace {
+/// @brief A destination object, one cache line.
+struct alignas(64) Object {
+  uint64_t frames;
+  uint64_t sum;
+  uint8_t padding[48];
+};
+
+constexpr uint32_t kBodyLength = 24;
+// bytes per HandleData call, the lookahead is bounded by what the ring holds
+constexpr uint32_t kChunk = 1024;
+
+std::vector<uint8_t> EncodeStream(uint32_t frames, uint32_t objects) {
+  std::mt19937 random(42);
+  std::uniform_int_distribution<uint32_t> pick(0, objects - 1);
+  std::vector<uint8_t> stream;
+  stream.reserve(static_cast<size_t>(frames) * (sizeof(BenchHeader) + kBodyLength));
+  for (uint32_t i = 0; i < frames; ++i) {
+    BenchHeader header = {htonl(kBodyLength), pick(random)};
+    const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+    stream.insert(stream.end(), raw, raw + sizeof(header));
+    stream.insert(stream.end(), kBodyLength, static_cast<uint8_t>(i));
+  }
+  return stream;
+}
+
+/// @brief Nanoseconds per frame to parse `stream` with the given prefetch distance.
+double Run(const std::vector<uint8_t>& stream, uint32_t frames, std::vector<Object>& objects,
+           uint32_t distance, bool prefetch_objects) {
+  BenchHeader current = {};
+  StreamingParser<BenchHeader> parser(
+      [&current](const BenchHeader& header) {
+        current = header;
+        return true;
+      },
+      [&](const uint8_t* data, uint32_t length) {
+        Object& object = objects[current.object];
+        ++object.frames;
+        for (uint32_t i = 0; i < length; ++i) {
+          object.sum += data[i];
+        }
+        return true;
+      });
+  parser.SetPrefetchDistance(distance, kBodyLength);
+  if (prefetch_objects) {
+    parser.SetPrefetchHandler([&objects](const BenchHeader& header) {
+      __builtin_prefetch(&objects[header.object], 1, 3);
+    });
+  }
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t offset = 0; offset < stream.size(); offset += kChunk) {
+    const auto length = static_cast<uint32_t>(std::min<size_t>(kChunk, stream.size() - offset));
+    if (!parser.HandleData(stream.data() + offset, length)) {
+      std::fprintf(stderr, "the ring overflowed\n");
+      std::exit(1);
+    }
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  const auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  return static_cast<double>(elapsed_ns) / frames;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  const uint32_t frames = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 2000000;
+  const uint32_t objects = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 1 << 20;
+  const std::vector<uint8_t> stream = EncodeStream(frames, objects);
+  std::vector<Object> table(objects);
+  std::printf("%u frames of %u bytes over %u objects (%zu MiB)\n", frames,
+              static_cast<uint32_t>(sizeof(BenchHeader) + kBodyLength), objects,
+              table.size() * sizeof(Object) >> 20);
+  std::printf("%10s %18s %18s\n", "distance", "ns/frame (ring)", "ns/frame (+objects)");
+  for (uint32_t distance : {0u, 1u, 2u, 4u, 8u, 16u, 32u}) {
+    // best of three, the first run also warms the page tables
+    double ring_only = 1e18;
+    double with_objects = 1e18;
+    for (int round = 0; round < 3; ++round) {
+      ring_only = std::min(ring_only, Run(stream, frames, table, distance, false));
+      if (distance > 0) {
+        with_objects = std::min(with_objects, Run(stream, frames, table, distance, true));
+      }
+    }
+    if (distance == 0) {
+      std::printf("%10u %18.1f %18s\n", distance, ring_only, "-");
+    } else {
+      std::printf("%10u %18.1f %18.1f\n", distance, ring_only, with_objects);
+    }
+  }
+  uint64_t check = 0;
+  for (const Object& object : table) {
+    check += object.frames;
+  }
+  return check == 0 ? 1 : 0;
+}
@@ -0,0 +1,331 @@
+#include "elastic_executor.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace {
+/// @brief Sleep while `*word == expected`, at most `timeout_ns` (0 for no limit). Returns early on
+/// a wake up, a signal or when the word already changed.
+void FutexWait(std::atomic<uint32_t>* word, uint32_t expected, uint64_t timeout_ns) {
+  timespec timeout{static_cast<time_t>(timeout_ns / 1000000000ull),
+                   static_cast<long>(timeout_ns % 1000000000ull)};
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected,
+          timeout_ns > 0 ? &timeout : nullptr, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr,
+          0);
+}
+}  // namespace
+
+ElasticExecutor::ElasticExecutor(const ExecutorOptions& options) : options_(options) {
+  if (options_.max_workers == 0) {
+    options_.max_workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  options_.min_workers = std::max(1u, std::min(options_.min_workers, options_.max_workers));
+  options_.strand_batch = std::max(1u, options_.strand_batch);
+  workers_.resize(options_.max_workers);
+  target_workers_.store(options_.min_workers);
+  last_evaluation_ns_ = NowNs();
+  next_evaluation_ns_.store(last_evaluation_ns_ + options_.evaluate_interval_ns);
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  EnableWorkers();
+}
+
+ElasticExecutor::~ElasticExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    stopping_.store(true);
+    for (Worker* worker : idle_) {
+      worker->park.store(kRunning);
+      FutexWake(&worker->park);
+    }
+    idle_.clear();
+    for (Worker* worker : retired_) {
+      worker->park.store(kRunning);
+      FutexWake(&worker->park);
+    }
+    retired_.clear();
+  }
+  const uint32_t threads = threads_.load(std::memory_order_acquire);
+  for (uint32_t i = 0; i < threads; ++i) {
+    workers_[i]->thread.join();
+  }
+}
+
+uint64_t ElasticExecutor::NowNs() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+std::shared_ptr<ElasticExecutor::Strand> ElasticExecutor::NewStrand() {
+  return std::make_shared<Strand>();
+}
+
+void ElasticExecutor::Submit(const std::shared_ptr<Strand>& strand, Task&& task) {
+  bool schedule = false;
+  {
+    std::lock_guard<std::mutex> lock(strand->mutex);
+    strand->tasks.push_back(std::move(task));
+    schedule = !strand->scheduled;
+    strand->scheduled = true;
+  }
+  const uint64_t depth = queued_.fetch_add(1, std::memory_order_relaxed) + 1;
+  uint64_t max_depth = max_queued_.load(std::memory_order_relaxed);
+  while (depth > max_depth &&
+         !max_queued_.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed)) {
+  }
+  if (schedule) {
+    Schedule(strand);
+  }
+  MaybeRescale(NowNs());
+}
+
+/// @brief Queue a strand that has tasks and is on no worker, waking an idle worker for it.
+void ElasticExecutor::Schedule(std::shared_ptr<Strand> strand) {
+  Worker* wake = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    run_queue_.push_back(std::move(strand));
+    if (!idle_.empty()) {
+      wake = idle_.back();
+      idle_.pop_back();
+      wake->park.store(kRunning);
+    }
+  }
+  if (wake != nullptr) {
+    FutexWake(&wake->park);
+  }
+}
+
+void ElasticExecutor::Run(Worker& worker) {
+  for (;;) {
+    if (MaybeRetire(worker)) {
+      continue;
+    }
+    std::shared_ptr<Strand> strand = PopStrand(worker);
+    if (strand != nullptr) {
+      RunStrand(strand, worker);
+      running_strands_.fetch_sub(1);
+      continue;
+    }
+    if (stopping_.load()) {
+      return;
+    }
+    // woke up idle
+    MaybeRescale(NowNs());
+  }
+}
+
+/// @brief Park the worker while the pool is above its target. Returns true once re-enabled.
+bool ElasticExecutor::MaybeRetire(Worker& worker) {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (stopping_.load() || active_workers_.load() <= target_workers_.load()) {
+      return false;
+    }
+    active_workers_.fetch_sub(1);
+    retired_.push_back(&worker);
+    worker.park.store(kParked);
+  }
+  parks_.fetch_add(1, std::memory_order_relaxed);
+  while (worker.park.load() == kParked) {
+    FutexWait(&worker.park, kParked, 0);
+  }
+  return true;
+}
+
+/// @brief The next strand to run, parking the worker while there is none. Returns nullptr when
+/// the idle wait timed out, when the worker should retire, or when stopping with nothing queued.
+std::shared_ptr<ElasticExecutor::Strand> ElasticExecutor::PopStrand(Worker& worker) {
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  for (;;) {
+    if (!run_queue_.empty()) {
+      std::shared_ptr<Strand> strand = std::move(run_queue_.front());
+      run_queue_.pop_front();
+      running_strands_.fetch_add(1);
+      return strand;
+    }
+    if (stopping_.load() || active_workers_.load() > target_workers_.load()) {
+      return nullptr;
+    }
+    idle_.push_back(&worker);
+    worker.park.store(kParked);
+    lock.unlock();
+    parks_.fetch_add(1, std::memory_order_relaxed);
+    FutexWait(&worker.park, kParked, options_.idle_timeout_ns);
+    lock.lock();
+    if (worker.park.load() == kParked) {
+      // not woken by a submission, leave the idle list and re-evaluate
+      idle_.erase(std::find(idle_.begin(), idle_.end(), &worker));
+      worker.park.store(kRunning);
+      return nullptr;
+    }
+  }
+}
+
+void ElasticExecutor::RunStrand(const std::shared_ptr<Strand>& strand, Worker& worker) {
+  for (uint32_t run = 0; run < options_.strand_batch; ++run) {
+    Task task;
+    {
+      std::lock_guard<std::mutex> lock(strand->mutex);
+      if (strand->tasks.empty()) {
+        strand->scheduled = false;
+        return;
+      }
+      task = std::move(strand->tasks.front());
+      strand->tasks.pop_front();
+    }
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+    const uint64_t start_ns = NowNs();
+    task();
+    const uint64_t end_ns = NowNs();
+    worker.busy_ns.fetch_add(end_ns - start_ns, std::memory_order_relaxed);
+    worker.tasks.fetch_add(1, std::memory_order_relaxed);
+    // a burst queued at once is only measured once its handlers run
+    MaybeRescale(end_ns);
+  }
+  {
+    std::lock_guard<std::mutex> lock(strand->mutex);
+    if (strand->tasks.empty()) {
+      strand->scheduled = false;
+      return;
+    }
+  }
+  // yield to the other strands, it stays scheduled
+  Schedule(strand);
+}
+
+void ElasticExecutor::MaybeRescale(uint64_t now_ns) {
+  uint64_t due = next_evaluation_ns_.load(std::memory_order_relaxed);
+  if (now_ns < due || !next_evaluation_ns_.compare_exchange_strong(
+                          due, now_ns + options_.evaluate_interval_ns, std::memory_order_relaxed)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  Rescale(now_ns);
+}
+
+void ElasticExecutor::Rescale(uint64_t now_ns) {
+  uint64_t busy_ns = 0;
+  uint64_t tasks = 0;
+  const uint32_t threads = threads_.load(std::memory_order_acquire);
+  for (uint32_t i = 0; i < threads; ++i) {
+    busy_ns += workers_[i]->busy_ns.load(std::memory_order_relaxed);
+    tasks += workers_[i]->tasks.load(std::memory_order_relaxed);
+  }
+  const uint64_t busy_delta = busy_ns - last_busy_ns_;
+  const uint64_t task_delta = tasks - last_tasks_;
+  const uint64_t elapsed_ns = now_ns - std::min(now_ns, last_evaluation_ns_);
+  last_busy_ns_ = busy_ns;
+  last_tasks_ = tasks;
+  last_evaluation_ns_ = now_ns;
+  if (task_delta > 0) {
+    const uint64_t sample = busy_delta / task_delta;
+    service_ns_ = service_ns_ == 0 ? sample : (service_ns_ * 7 + sample) / 8;
+  }
+  const uint32_t target = target_workers_.load();
+  if (elapsed_ns > 0) {
+    utilization_ =
+        std::min(1.0, static_cast<double>(busy_delta) / (static_cast<double>(elapsed_ns) * target));
+  }
+
+  const double depth = static_cast<double>(queued_.load(std::memory_order_relaxed));
+  const double expected_delay_ns = depth * service_ns_ / target;
+  uint32_t new_target = target;
+  if (expected_delay_ns > options_.target_delay_ns) {
+    // enough workers to drain the queue within the target delay, but a strand runs on one worker
+    // at a time: workers beyond the runnable strands would only idle
+    const double needed = std::ceil(depth * service_ns_ / options_.target_delay_ns);
+    uint32_t runnable = 0;
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      runnable = static_cast<uint32_t>(run_queue_.size()) + running_strands_.load();
+    }
+    new_target = std::max(
+        target, static_cast<uint32_t>(std::min<double>({static_cast<double>(options_.max_workers),
+                                                        needed, static_cast<double>(runnable)})));
+    calm_since_ns_ = 0;
+  } else if (expected_delay_ns <= options_.target_delay_ns * options_.shrink_delay_fraction &&
+             utilization_ <= options_.shrink_utilization && target > options_.min_workers) {
+    if (calm_since_ns_ == 0) {
+      calm_since_ns_ = now_ns;
+    } else if (now_ns - calm_since_ns_ >= options_.shrink_hold_ns) {
+      new_target = target - 1;
+      // the next step down needs another hold period
+      calm_since_ns_ = now_ns;
+    }
+  } else {
+    calm_since_ns_ = 0;
+  }
+  if (new_target > target) {
+    ++grow_events_;
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    target_workers_.store(new_target);
+    EnableWorkers();
+  } else if (new_target < target) {
+    ++shrink_events_;
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    target_workers_.store(new_target);
+    // an idle worker retires right away rather than at its next wake up
+    if (!idle_.empty() && active_workers_.load() > new_target) {
+      Worker* worker = idle_.back();
+      idle_.pop_back();
+      worker->park.store(kRunning);
+      FutexWake(&worker->park);
+    }
+  }
+}
+
+void ElasticExecutor::EnableWorkers() {
+  const uint32_t target = target_workers_.load();
+  // a task still running during the destruction must not start threads nobody joins
+  while (!stopping_.load() && active_workers_.load() < target) {
+    active_workers_.fetch_add(1);
+    if (!retired_.empty()) {
+      Worker* worker = retired_.back();
+      retired_.pop_back();
+      worker->park.store(kRunning);
+      FutexWake(&worker->park);
+      continue;
+    }
+    const uint32_t index = threads_.load(std::memory_order_relaxed);
+    assert(index < workers_.size());
+    workers_[index] = std::make_unique<Worker>();
+    Worker& worker = *workers_[index];
+    threads_.store(index + 1, std::memory_order_release);
+    worker.thread = std::thread([this, &worker]() { Run(worker); });
+  }
+}
+
+ExecutorMetrics ElasticExecutor::metrics() const {
+  ExecutorMetrics metrics;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    metrics.idle_workers = static_cast<uint32_t>(idle_.size());
+  }
+  metrics.target_workers = target_workers_.load();
+  metrics.active_workers = active_workers_.load();
+  metrics.threads = threads_.load(std::memory_order_acquire);
+  metrics.queue_depth = queued_.load(std::memory_order_relaxed);
+  metrics.max_queue_depth = max_queued_.load(std::memory_order_relaxed);
+  for (uint32_t i = 0; i < metrics.threads; ++i) {
+    metrics.completed_tasks += workers_[i]->tasks.load(std::memory_order_relaxed);
+  }
+  metrics.parks = parks_.load(std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  metrics.service_ns = service_ns_;
+  metrics.utilization = utilization_;
+  metrics.grow_events = grow_events_;
+  metrics.shrink_events = shrink_events_;
+  return metrics;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file elastic_executor.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_ELASTIC_EXECUTOR_H_
+#define SRC_ELASTIC_EXECUTOR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ExecutorOptions {
+  uint32_t min_workers = 1;
+  /// @brief 0 for the number of hardware threads.
+  uint32_t max_workers = 0;
+  /// @brief Grow when a newly queued frame is expected to wait longer than this: queue depth
+  /// times the mean service time, divided by the workers.
+  uint64_t target_delay_ns = 1000000;
+  /// @brief Shrink by one worker once the expected wait stayed below this fraction of
+  /// `target_delay_ns` and the utilization below `shrink_utilization` for `shrink_hold_ns`.
+  double shrink_delay_fraction = 0.25;
+  double shrink_utilization = 0.5;
+  uint64_t shrink_hold_ns = 100000000;
+  /// @brief Minimum time between two evaluations of the worker count.
+  uint64_t evaluate_interval_ns = 1000000;
+  /// @brief An idle worker wakes after this long to re-evaluate, so that an idle pool shrinks.
+  uint64_t idle_timeout_ns = 50000000;
+  /// @brief Tasks run from one strand before the worker moves on to the next strand.
+  uint32_t strand_batch = 32;
+};
+
+struct ExecutorMetrics {
+  uint32_t target_workers = 0;
+  uint32_t active_workers = 0;  // not retired
+  uint32_t threads = 0;         // ever started
+  uint32_t idle_workers = 0;    // active but parked for lack of work
+  uint64_t queue_depth = 0;
+  uint64_t max_queue_depth = 0;
+  uint64_t completed_tasks = 0;
+  /// @brief Moving average of the handler service time.
+  uint64_t service_ns = 0;
+  /// @brief Busy fraction of the target workers over the last evaluation interval.
+  double utilization = 0;
+  uint64_t grow_events = 0;
+  uint64_t shrink_events = 0;
+  uint64_t parks = 0;
+};
+
+/// @brief Runs the handlers of parsed frames on a pool of threads that grows and shrinks with the
+/// load.
+///
+/// Frames are submitted as tasks to a strand, typically one per connection; the tasks of a strand
+/// run one at a time in submission order, on whichever worker picks the strand up, so that a
+/// connection's frames are handled in order. The body a parser hands to its handler only lives
+/// during the call, a task must own a copy.
+///
+/// The worker count is re-evaluated at most every `evaluate_interval_ns`, on submission, after a
+/// task and when an idle worker wakes up. It grows at once, to as many workers as drain the queue within the
+/// target delay, and shrinks one worker at a time after a calm hold period, so that it does not
+/// oscillate. Idle and retired workers sleep on a futex of their own and are woken one by one.
+class ElasticExecutor final {
+ public:
+  using Task = std::function<void()>;
+  class Strand;
+
+  explicit ElasticExecutor(const ExecutorOptions& options = ExecutorOptions());
+  ElasticExecutor(const ElasticExecutor&) = delete;
+  ElasticExecutor& operator=(const ElasticExecutor&) = delete;
+  /// @brief Run the queued tasks, then stop the workers.
+  ~ElasticExecutor();
+
+  /// @brief A new ordering domain, e.g. for a connection.
+  std::shared_ptr<Strand> NewStrand();
+
+  /// @brief Queue `task` behind the tasks already submitted to `strand`.
+  void Submit(const std::shared_ptr<Strand>& strand, Task&& task);
+
+  ExecutorMetrics metrics() const;
+
+  static uint64_t NowNs();
+
+ private:
+  enum ParkState : uint32_t { kRunning = 0, kParked = 1 };
+  struct Worker {
+    std::atomic<uint32_t> park{kRunning};  // the futex word
+    std::atomic<uint64_t> busy_ns{0};
+    std::atomic<uint64_t> tasks{0};
+    std::thread thread;
+  };
+
+  void Run(Worker& worker);
+  bool MaybeRetire(Worker& worker);
+  std::shared_ptr<Strand> PopStrand(Worker& worker);
+  void RunStrand(const std::shared_ptr<Strand>& strand, Worker& worker);
+  void Schedule(std::shared_ptr<Strand> strand);
+  void MaybeRescale(uint64_t now_ns);
+  void Rescale(uint64_t now_ns);
+  /// @brief Wake retired workers or start new ones up to the target. Called with `queue_mutex_`.
+  void EnableWorkers();
+
+  ExecutorOptions options_;
+  mutable std::mutex queue_mutex_;
+  std::deque<std::shared_ptr<Strand>> run_queue_;
+  std::vector<Worker*> idle_;
+  std::vector<Worker*> retired_;
+  std::vector<std::unique_ptr<Worker>> workers_;  // `max_workers` slots, the first `threads_` used
+  std::atomic<uint32_t> threads_{0};
+  std::atomic<uint32_t> target_workers_;
+  std::atomic<uint32_t> active_workers_{0};
+  std::atomic<uint32_t> running_strands_{0};  // popped from `run_queue_` and on a worker
+  std::atomic<bool> stopping_{false};
+  std::atomic<uint64_t> queued_{0};
+  std::atomic<uint64_t> max_queued_{0};
+  std::atomic<uint64_t> parks_{0};
+
+  // evaluation state, under `control_mutex_`
+  std::atomic<uint64_t> next_evaluation_ns_{0};
+  mutable std::mutex control_mutex_;
+  uint64_t last_evaluation_ns_ = 0;
+  uint64_t last_busy_ns_ = 0;
+  uint64_t last_tasks_ = 0;
+  uint64_t service_ns_ = 0;
+  double utilization_ = 0;
+  uint64_t calm_since_ns_ = 0;
+  uint64_t grow_events_ = 0;
+  uint64_t shrink_events_ = 0;
+};
+
+class ElasticExecutor::Strand {
+ private:
+  friend class ElasticExecutor;
+  std::mutex mutex;
+  std::deque<Task> tasks;
+  bool scheduled = false;  // queued or running on a worker
+};
+
+#endif  // SRC_ELASTIC_EXECUTOR_H_
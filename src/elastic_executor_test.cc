@@ -0,0 +1,189 @@
+#include "elastic_executor.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "streaming_parser.h"
+
+struct JobHeader {
+  uint32_t body_length;
+  uint16_t msg_type;
+  uint16_t connection;
+};
+
+namespace {
+/// @brief Poll `done` for up to `timeout_ms`.
+template <typename Fn>
+bool WaitFor(Fn&& done, int timeout_ms) {
+  for (int waited = 0; waited < timeout_ms; waited += 2) {
+    if (done()) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  return done();
+}
+}  // namespace
+
+TEST(ElasticExecutor, strands_keep_submission_order) {
+  ExecutorOptions options;
+  options.min_workers = 2;
+  options.max_workers = 4;
+  options.strand_batch = 3;
+  constexpr int kStrands = 8;
+  constexpr int kTasks = 500;
+  std::vector<std::vector<int>> seen(kStrands);
+  std::atomic<int> concurrent_in_strand{0};
+  std::vector<std::unique_ptr<std::atomic<bool>>> running;
+  for (int s = 0; s < kStrands; ++s) {
+    running.push_back(std::make_unique<std::atomic<bool>>(false));
+  }
+  {
+    ElasticExecutor executor(options);
+    std::vector<std::shared_ptr<ElasticExecutor::Strand>> strands;
+    for (int s = 0; s < kStrands; ++s) {
+      strands.push_back(executor.NewStrand());
+    }
+    for (int i = 0; i < kTasks; ++i) {
+      for (int s = 0; s < kStrands; ++s) {
+        executor.Submit(strands[s], [&, s, i]() {
+          if (running[s]->exchange(true)) {
+            ++concurrent_in_strand;
+          }
+          seen[s].push_back(i);
+          running[s]->store(false);
+        });
+      }
+    }
+    // the destructor runs what is still queued
+  }
+  EXPECT_EQ(concurrent_in_strand.load(), 0);
+  for (int s = 0; s < kStrands; ++s) {
+    ASSERT_EQ(seen[s].size(), static_cast<size_t>(kTasks));
+    for (int i = 0; i < kTasks; ++i) {
+      ASSERT_EQ(seen[s][i], i);
+    }
+  }
+}
+
+TEST(ElasticExecutor, grows_for_a_backlog_and_shrinks_when_calm) {
+  ExecutorOptions options;
+  options.min_workers = 1;
+  options.max_workers = 4;
+  options.target_delay_ns = 2000000;
+  options.evaluate_interval_ns = 500000;
+  options.shrink_hold_ns = 20000000;
+  options.idle_timeout_ns = 5000000;
+  ElasticExecutor executor(options);
+  EXPECT_EQ(executor.metrics().target_workers, 1u);
+
+  // a burst of slow handlers on many connections
+  std::atomic<int> done{0};
+  std::vector<std::shared_ptr<ElasticExecutor::Strand>> strands;
+  for (int s = 0; s < 16; ++s) {
+    strands.push_back(executor.NewStrand());
+  }
+  for (int i = 0; i < 160; ++i) {
+    executor.Submit(strands[i % strands.size()], [&done]() {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+      ++done;
+    });
+  }
+  ASSERT_TRUE(WaitFor([&]() { return done.load() == 160; }, 10000));
+  ExecutorMetrics metrics = executor.metrics();
+  EXPECT_GT(metrics.grow_events, 0u);
+  EXPECT_GT(metrics.threads, 1u);
+  EXPECT_EQ(metrics.completed_tasks, 160u);
+  EXPECT_GE(metrics.max_queue_depth, 100u);
+  EXPECT_GT(metrics.service_ns, 400000u);
+
+  // idle workers re-evaluate on their own and retire one per hold period
+  EXPECT_TRUE(WaitFor([&]() { return executor.metrics().active_workers == 1; }, 5000));
+  metrics = executor.metrics();
+  EXPECT_EQ(metrics.target_workers, 1u);
+  EXPECT_GT(metrics.shrink_events, 0u);
+  EXPECT_EQ(metrics.queue_depth, 0u);
+
+  // retired workers come back for the next burst
+  const uint32_t threads = metrics.threads;
+  for (int i = 0; i < 160; ++i) {
+    executor.Submit(strands[i % strands.size()], [&done]() {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+      ++done;
+    });
+  }
+  ASSERT_TRUE(WaitFor([&]() { return done.load() == 320; }, 10000));
+  EXPECT_GT(executor.metrics().grow_events, metrics.grow_events);
+  EXPECT_EQ(executor.metrics().threads, threads);
+}
+
+TEST(ElasticExecutor, grows_no_further_than_the_runnable_strands) {
+  ExecutorOptions options;
+  options.min_workers = 1;
+  options.max_workers = 8;
+  options.target_delay_ns = 2000000;
+  options.evaluate_interval_ns = 500000;
+  ElasticExecutor executor(options);
+
+  // a deep backlog on two connections only keeps two workers busy
+  std::atomic<int> done{0};
+  std::vector<std::shared_ptr<ElasticExecutor::Strand>> strands = {executor.NewStrand(),
+                                                                   executor.NewStrand()};
+  for (int i = 0; i < 120; ++i) {
+    executor.Submit(strands[i % strands.size()], [&done]() {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+      ++done;
+    });
+  }
+  ASSERT_TRUE(WaitFor([&]() { return done.load() == 120; }, 10000));
+  ExecutorMetrics metrics = executor.metrics();
+  EXPECT_GT(metrics.grow_events, 0u);
+  EXPECT_LE(metrics.threads, 2u);
+}
+
+TEST(ElasticExecutor, parsed_frames_per_connection) {
+  // the body handler copies each frame into a task on its connection's strand
+  ElasticExecutor executor;
+  std::vector<std::shared_ptr<ElasticExecutor::Strand>> strands = {executor.NewStrand(),
+                                                                   executor.NewStrand()};
+  std::mutex mutex;
+  std::vector<std::vector<uint8_t>> handled(2);
+  JobHeader current = {};
+  StreamingParser<JobHeader> parser(
+      [&current](const JobHeader& header) {
+        current = header;
+        return true;
+      },
+      [&](const uint8_t* data, uint32_t length) {
+        const uint16_t connection = current.connection;
+        executor.Submit(strands[connection],
+                        [&, connection, body = std::vector<uint8_t>(data, data + length)]() {
+                          std::lock_guard<std::mutex> lock(mutex);
+                          handled[connection].push_back(body[0]);
+                        });
+        return true;
+      });
+  std::vector<uint8_t> stream;
+  for (uint8_t i = 0; i < 100; ++i) {
+    JobHeader header = {htonl(4), 1, static_cast<uint16_t>(i % 2)};
+    const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+    stream.insert(stream.end(), raw, raw + sizeof(header));
+    stream.insert(stream.end(), 4, i);
+  }
+  parser.HandleData(stream.data(), static_cast<uint32_t>(stream.size()));
+  ASSERT_TRUE(WaitFor([&]() { return executor.metrics().completed_tasks == 100; }, 5000));
+  std::lock_guard<std::mutex> lock(mutex);
+  for (uint16_t connection = 0; connection < 2; ++connection) {
+    ASSERT_EQ(handled[connection].size(), 50u);
+    for (size_t i = 0; i < 50; ++i) {
+      EXPECT_EQ(handled[connection][i], i * 2 + connection);
+    }
+  }
+}
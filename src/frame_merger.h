@@ -0,0 +1,270 @@
+/**
+ * @file frame_merger.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_FRAME_MERGER_H_
+#define SRC_FRAME_MERGER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "streaming_parser.h"
+
+/// @brief Merges the frames of many StreamingParsers (one per connection, used in pull mode) into a
+/// single stream ordered by a header timestamp.
+///
+/// The sources compete in a loser tree, so emitting a frame only replays the path of the winning
+/// source: O(log k) per frame for k sources. Frames are handed out as views into the parsers' rings
+/// and are never copied. Each source must be ordered by timestamp. A source without a buffered
+/// frame holds the merge back until the newest timestamp buffered in any source exceeds its last
+/// timestamp by more than `max_lateness`; it then stops taking part until `Notify` finds a frame
+/// for it. Frames older than the last emitted one are late: they go to the late frame handler, or
+/// are dropped.
+/// @tparam ProtoHeader The protocol header struct type.
+template <typename ProtoHeader>
+class FrameMerger {
+ public:
+  using Parser = StreamingParser<ProtoHeader>;
+  using FrameView = typename Parser::FrameView;
+  using TimestampFn = uint64_t (*)(const ProtoHeader& header);
+  using FrameHandler = std::function<bool(uint32_t source, const FrameView& frame)>;
+
+  FrameMerger(TimestampFn timestamp, uint64_t max_lateness)
+      : timestamp_(timestamp), max_lateness_(max_lateness) {}
+
+  /// @brief Add a source, returns its index. The parser must outlive the merger. The tree is built
+  /// once by the next `Drain`, so adding k sources up front costs O(k) rather than O(k^2).
+  uint32_t AddSource(Parser* parser);
+
+  /// @brief Tell the merger that bytes were buffered in `source`. The headers of the new complete
+  /// frames are scanned to advance the newest timestamp seen.
+  void Notify(uint32_t source);
+
+  /// @brief Mark `source` as finished, the merge no longer waits for it.
+  void Close(uint32_t source);
+
+  /// @brief Frames older than the last emitted frame are passed to `handler` instead of dropped.
+  void SetLateFrameHandler(FrameHandler&& handler) { late_handler_ = std::move(handler); }
+
+  /// @brief Emit up to `max_frames` frames in timestamp order. Stops early when the next frame
+  /// depends on a source with nothing buffered yet. Returns the number of frames emitted.
+  size_t Drain(const FrameHandler& handler,
+               size_t max_frames = std::numeric_limits<size_t>::max());
+
+  uint32_t sources() const { return static_cast<uint32_t>(sources_.size()); }
+  uint64_t emitted_frames() const { return emitted_frames_; }
+  uint64_t late_frames() const { return late_frames_; }
+
+ private:
+  enum class SourceState : uint8_t {
+    kReady,    // `head` holds a frame
+    kPending,  // nothing buffered, the next frame is no older than `last_timestamp`
+    kIdle,     // nothing buffered and past the lateness window
+    kClosed,
+  };
+  struct Source {
+    Parser* parser;
+    FrameView head;
+    uint64_t key;  // timestamp of `head`, or a lower bound for a pending source
+    uint64_t last_timestamp;
+    uint32_t scan_offset;  // bytes past the ring head whose frames were scanned by `Scan`
+    SourceState state;
+  };
+
+  /// @brief Whether source `a` goes before source `b`. Ready and pending sources are ordered by
+  /// key, a ready source winning ties, and all of them go before idle and closed sources.
+  bool Less(uint32_t a, uint32_t b) const {
+    const Source& lhs = sources_[a];
+    const Source& rhs = sources_[b];
+    const bool lhs_out = lhs.state >= SourceState::kIdle;
+    const bool rhs_out = rhs.state >= SourceState::kIdle;
+    if (lhs_out != rhs_out) {
+      return rhs_out;
+    }
+    if (!lhs_out && lhs.key != rhs.key) {
+      return lhs.key < rhs.key;
+    }
+    if (!lhs_out && lhs.state != rhs.state) {
+      return lhs.state < rhs.state;
+    }
+    return a < b;
+  }
+
+  void Scan(uint32_t index);
+  void Pop(uint32_t index);
+  void Refresh(uint32_t index);
+  void Replay(uint32_t index);
+  void Rebuild();
+
+  TimestampFn timestamp_;
+  uint64_t max_lateness_;
+  FrameHandler late_handler_;
+  std::vector<Source> sources_;
+  std::vector<uint32_t> tree_;  // tree_[0] is the winner, tree_[1..k-1] the losers of each match
+  uint64_t watermark_ = 0;      // newest timestamp seen at any source
+  uint64_t last_emitted_ = 0;
+  uint64_t emitted_frames_ = 0;
+  uint64_t late_frames_ = 0;
+  bool rebuild_needed_ = false;
+};
+
+template <typename ProtoHeader>
+uint32_t FrameMerger<ProtoHeader>::AddSource(Parser* parser) {
+  const auto index = static_cast<uint32_t>(sources_.size());
+  sources_.push_back(Source{parser, FrameView{}, last_emitted_, last_emitted_, 0,
+                            SourceState::kPending});
+  Scan(index);
+  Refresh(index);
+  rebuild_needed_ = true;
+  return index;
+}
+
+/// @brief A pending source is refreshed lazily when it wins, since its key is a lower bound of its
+/// next frame. An idle source rejoins the merge, which rebuilds the tree on the next `Drain`:
+/// replaying a loser tree is only valid along the path of the current winner.
+template <typename ProtoHeader>
+void FrameMerger<ProtoHeader>::Notify(uint32_t source) {
+  Source& entry = sources_[source];
+  Scan(source);
+  if (entry.state == SourceState::kIdle) {
+    Refresh(source);
+    rebuild_needed_ |= entry.state == SourceState::kReady;
+  }
+}
+
+/// @brief Frames already buffered are still merged, the source closes once it wins without a
+/// frame.
+template <typename ProtoHeader>
+void FrameMerger<ProtoHeader>::Close(uint32_t source) {
+  Source& entry = sources_[source];
+  entry.last_timestamp = std::numeric_limits<uint64_t>::max();
+  if (entry.state == SourceState::kIdle) {
+    entry.state = SourceState::kClosed;
+  }
+}
+
+template <typename ProtoHeader>
+void FrameMerger<ProtoHeader>::Scan(uint32_t index) {
+  Source& entry = sources_[index];
+  ProtoHeader header;
+  while (entry.parser->PeekHeader(entry.scan_offset, header)) {
+    watermark_ = std::max(watermark_, timestamp_(header));
+    entry.scan_offset += Parser::protocol_header_length + header.body_length;
+  }
+}
+
+template <typename ProtoHeader>
+void FrameMerger<ProtoHeader>::Pop(uint32_t index) {
+  Source& entry = sources_[index];
+  const uint32_t frame_length = Parser::protocol_header_length + entry.head.body_length;
+  entry.scan_offset -= std::min(entry.scan_offset, frame_length);
+  entry.parser->PopFrame(entry.head);
+}
+
+/// @brief Load the next frame of a source that is not ready, passing late frames on.
+template <typename ProtoHeader>
+void FrameMerger<ProtoHeader>::Refresh(uint32_t index) {
+  Source& entry = sources_[index];
+  while (entry.parser->PeekFrame(entry.head)) {
+    const uint64_t timestamp = timestamp_(entry.head.header);
+    if (timestamp >= last_emitted_ || emitted_frames_ == 0) {
+      entry.key = timestamp;
+      entry.state = SourceState::kReady;
+      watermark_ = std::max(watermark_, timestamp);
+      return;
+    }
+    ++late_frames_;
+    if (late_handler_) {
+      late_handler_(index, entry.head);
+    }
+    Pop(index);
+  }
+  if (entry.last_timestamp == std::numeric_limits<uint64_t>::max()) {
+    entry.state = SourceState::kClosed;
+  } else if (entry.state != SourceState::kIdle) {
+    entry.key = entry.last_timestamp;
+    entry.state = SourceState::kPending;
+  }
+}
+
+/// @brief Replay the matches on the path from the leaf of `index` to the root.
+template <typename ProtoHeader>
+void FrameMerger<ProtoHeader>::Replay(uint32_t index) {
+  const auto k = static_cast<uint32_t>(sources_.size());
+  uint32_t winner = index;
+  for (uint32_t node = (index + k) >> 1; node > 0; node >>= 1) {
+    if (Less(tree_[node], winner)) {
+      std::swap(tree_[node], winner);
+    }
+  }
+  tree_[0] = winner;
+}
+
+template <typename ProtoHeader>
+void FrameMerger<ProtoHeader>::Rebuild() {
+  const auto k = static_cast<uint32_t>(sources_.size());
+  // leaves are nodes [k, 2k), internal node n plays the winners of nodes 2n and 2n + 1
+  std::vector<uint32_t> winners(2 * k);
+  for (uint32_t i = 0; i < k; ++i) {
+    winners[k + i] = i;
+  }
+  tree_.assign(k, 0);
+  for (uint32_t node = k - 1; node > 0; --node) {
+    const uint32_t a = winners[2 * node];
+    const uint32_t b = winners[2 * node + 1];
+    const bool a_wins = Less(a, b);
+    winners[node] = a_wins ? a : b;
+    tree_[node] = a_wins ? b : a;
+  }
+  tree_[0] = k > 1 ? winners[1] : 0;
+}
+
+template <typename ProtoHeader>
+size_t FrameMerger<ProtoHeader>::Drain(const FrameHandler& handler, size_t max_frames) {
+  size_t emitted = 0;
+  if (rebuild_needed_) {
+    Rebuild();
+    rebuild_needed_ = false;
+  }
+  while (emitted < max_frames && !sources_.empty()) {
+    const uint32_t winner = tree_[0];
+    Source& entry = sources_[winner];
+    if (entry.state == SourceState::kPending) {
+      // pending sources are only refreshed once they win
+      Refresh(winner);
+      if (entry.state == SourceState::kPending) {
+        if (watermark_ - std::min(watermark_, entry.last_timestamp) <= max_lateness_) {
+          // its next frame may still be the oldest one
+          break;
+        }
+        entry.state = SourceState::kIdle;
+      }
+      Replay(winner);
+      continue;
+    }
+    if (entry.state != SourceState::kReady) {
+      // every source is idle or closed
+      break;
+    }
+    handler(winner, entry.head);
+    last_emitted_ = entry.key;
+    entry.last_timestamp = std::max(entry.last_timestamp, entry.key);
+    Pop(winner);
+    ++emitted_frames_;
+    ++emitted;
+    entry.state = SourceState::kPending;
+    Refresh(winner);
+    Replay(winner);
+  }
+  return emitted;
+}
+
+#endif  // SRC_FRAME_MERGER_H_
@@ -0,0 +1,152 @@
+#include "frame_merger.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+struct TickHeader {
+  uint32_t body_length;
+  uint32_t sequence;
+  uint64_t timestamp;
+};
+
+using TickParser = StreamingParser<TickHeader>;
+using TickMerger = FrameMerger<TickHeader>;
+
+namespace {
+uint64_t TickTimestamp(const TickHeader& header) { return header.timestamp; }
+
+std::unique_ptr<TickParser> MakeParser() {
+  return std::make_unique<TickParser>([](const TickHeader&) { return true; },
+                                      [](const uint8_t*, uint32_t) { return true; });
+}
+
+void Feed(TickParser& parser, uint64_t timestamp, uint32_t sequence, uint32_t body_length = 8) {
+  TickHeader header = {};
+  header.body_length = htonl(body_length);
+  header.sequence = sequence;
+  header.timestamp = timestamp;
+  std::vector<uint8_t> frame(sizeof(header) + body_length, static_cast<uint8_t>(sequence));
+  std::memcpy(frame.data(), &header, sizeof(header));
+  ASSERT_TRUE(parser.BufferData(frame.data(), static_cast<uint32_t>(frame.size())));
+}
+}  // namespace
+
+TEST(FrameMerger, merge_in_timestamp_order) {
+  std::vector<std::unique_ptr<TickParser>> parsers;
+  for (int i = 0; i < 3; ++i) {
+    parsers.push_back(MakeParser());
+  }
+  Feed(*parsers[0], 10, 0);
+  Feed(*parsers[0], 40, 1);
+  Feed(*parsers[1], 20, 2);
+  Feed(*parsers[1], 30, 3);
+  Feed(*parsers[2], 5, 4);
+  Feed(*parsers[2], 50, 5);
+
+  TickMerger merger(TickTimestamp, 1000);
+  for (auto& parser : parsers) {
+    merger.AddSource(parser.get());
+  }
+  std::vector<uint64_t> timestamps;
+  auto collect = [&timestamps](uint32_t, const TickMerger::FrameView& frame) {
+    EXPECT_EQ(frame.body_length, 8);
+    EXPECT_EQ(frame.body[0], frame.header.sequence);
+    timestamps.push_back(frame.header.timestamp);
+    return true;
+  };
+  // source 1 runs dry after 30 and holds the merge back
+  EXPECT_EQ(merger.Drain(collect), 4);
+  EXPECT_EQ(timestamps, std::vector<uint64_t>({5, 10, 20, 30}));
+
+  Feed(*parsers[0], 45, 6);
+  merger.Notify(0);
+  merger.Close(1);
+  // now source 0 runs dry after 45
+  EXPECT_EQ(merger.Drain(collect), 2);
+  EXPECT_EQ(timestamps, std::vector<uint64_t>({5, 10, 20, 30, 40, 45}));
+  merger.Close(0);
+  merger.Close(2);
+  EXPECT_EQ(merger.Drain(collect), 1);
+  EXPECT_EQ(timestamps.back(), 50);
+  EXPECT_EQ(merger.emitted_frames(), 7);
+}
+
+TEST(FrameMerger, bounded_lateness) {
+  auto fast = MakeParser();
+  auto slow = MakeParser();
+  TickMerger merger(TickTimestamp, 100);
+  merger.AddSource(fast.get());
+  merger.AddSource(slow.get());
+  uint32_t late = 0;
+  merger.SetLateFrameHandler([&late](uint32_t source, const TickMerger::FrameView&) {
+    EXPECT_EQ(source, 1);
+    ++late;
+    return true;
+  });
+
+  std::vector<uint64_t> timestamps;
+  auto collect = [&timestamps](uint32_t, const TickMerger::FrameView& frame) {
+    timestamps.push_back(frame.header.timestamp);
+    return true;
+  };
+  Feed(*fast, 10, 0);
+  Feed(*fast, 50, 1);
+  // the slow source may still deliver something older than 10
+  EXPECT_EQ(merger.Drain(collect), 0);
+  // once the fast source is more than 100 ahead the slow one stops holding it back
+  Feed(*fast, 300, 2);
+  merger.Notify(0);
+  EXPECT_EQ(merger.Drain(collect), 3);
+  EXPECT_EQ(timestamps, std::vector<uint64_t>({10, 50, 300}));
+
+  // the slow source comes back: old frames are late, new ones are merged again
+  Feed(*slow, 200, 3);
+  Feed(*slow, 310, 4);
+  merger.Notify(1);
+  Feed(*fast, 320, 5);
+  merger.Notify(0);
+  // 320 waits, the slow source may still send something older within the window
+  EXPECT_EQ(merger.Drain(collect), 1);
+  EXPECT_EQ(timestamps, std::vector<uint64_t>({10, 50, 300, 310}));
+  EXPECT_EQ(late, 1);
+  EXPECT_EQ(merger.late_frames(), 1);
+  merger.Close(1);
+  EXPECT_EQ(merger.Drain(collect), 1);
+  EXPECT_EQ(timestamps.back(), 320);
+}
+
+TEST(FrameMerger, many_sources) {
+  constexpr uint32_t num_sources = 2000;
+  constexpr uint32_t frames_per_source = 8;
+  std::vector<std::unique_ptr<TickParser>> parsers;
+  parsers.reserve(num_sources);
+  std::srand(11);
+  for (uint32_t i = 0; i < num_sources; ++i) {
+    parsers.push_back(MakeParser());
+    uint64_t timestamp = 0;
+    for (uint32_t j = 0; j < frames_per_source; ++j) {
+      timestamp += std::rand() % 1000;
+      Feed(*parsers.back(), timestamp, j, 16);
+    }
+  }
+  TickMerger merger(TickTimestamp, 0);
+  for (auto& parser : parsers) {
+    merger.AddSource(parser.get());
+  }
+  for (uint32_t i = 0; i < num_sources; ++i) {
+    merger.Close(i);
+  }
+  uint64_t previous = 0;
+  size_t emitted = merger.Drain([&previous](uint32_t, const TickMerger::FrameView& frame) {
+    EXPECT_LE(previous, frame.header.timestamp);
+    previous = frame.header.timestamp;
+    return true;
+  });
+  EXPECT_EQ(emitted, num_sources * frames_per_source);
+  EXPECT_EQ(merger.late_frames(), 0);
+}
@@ -0,0 +1,71 @@
+/**
+ * @file header_field.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_HEADER_FIELD_H_
+#define SRC_HEADER_FIELD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/// @brief The location of an integral field inside a protocol header, resolved once from a member
+/// pointer so that the field can be loaded from raw header bytes.
+struct HeaderField {
+  uint16_t offset = 0;
+  uint8_t width = 0;
+
+  /// @brief Load the field from the header bytes at `header`, widened to uint64_t. No byte order
+  /// conversion is applied.
+  uint64_t Load(const void* header) const {
+    const auto* src = static_cast<const uint8_t*>(header) + offset;
+    switch (width) {
+      case sizeof(uint8_t):
+        return *src;
+      case sizeof(uint16_t): {
+        uint16_t value;
+        std::memcpy(&value, src, sizeof(value));
+        return value;
+      }
+      case sizeof(uint32_t): {
+        uint32_t value;
+        std::memcpy(&value, src, sizeof(value));
+        return value;
+      }
+      case sizeof(uint64_t): {
+        uint64_t value;
+        std::memcpy(&value, src, sizeof(value));
+        return value;
+      }
+      default:
+        return 0;
+    }
+  }
+};
+
+/// @brief The byte offset of `member` inside `ProtoHeader`. It is computed on a static probe
+/// object, which the compiler folds to a constant.
+template <typename ProtoHeader, typename Field>
+size_t FieldOffset(Field ProtoHeader::*member) {
+  static_assert(std::is_trivially_copyable_v<ProtoHeader>,
+                "ProtoHeader must be trivially copyable");
+  static const ProtoHeader probe{};
+  return static_cast<size_t>(reinterpret_cast<const uint8_t*>(&(probe.*member)) -
+                             reinterpret_cast<const uint8_t*>(&probe));
+}
+
+/// @brief Resolve `member` of `ProtoHeader` into a HeaderField.
+template <typename ProtoHeader, typename Field>
+HeaderField MakeHeaderField(Field ProtoHeader::*member) {
+  static_assert(std::is_integral_v<Field> && sizeof(Field) <= sizeof(uint64_t),
+                "header field must be an integral type of at most 64 bits");
+  return HeaderField{static_cast<uint16_t>(FieldOffset(member)),
+                     static_cast<uint8_t>(sizeof(Field))};
+}
+
+#endif  // SRC_HEADER_FIELD_H_
@@ -0,0 +1,306 @@
+/**
+ * @file header_filter.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_HEADER_FILTER_H_
+#define SRC_HEADER_FILTER_H_
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <type_traits>
+#include <vector>
+
+#include "header_field.h"
+
+/// @brief A declarative predicate over `ProtoHeader` fields.
+///
+/// Predicates are built from field tests (`In`, `Range`, `AnyBits`, `AllBits`) combined with `&&`,
+/// `||` and `!`, and are compiled into a flat postfix program. `Evaluate` runs the program column by
+/// column over a batch of up to `max_batch_size` headers, producing one match bit per header; the
+/// field comparisons use SSE2 when available. A default constructed filter matches every header.
+///
+/// Fields are compared in wire order: the parser only converts `body_length` to host order, every
+/// other field holds the bytes as received. Values for multi-byte fields must be given in the same
+/// order, e.g. `Equal(&Header::msg_type, htons(7))` for a protocol in network byte order.
+///
+/// A predicate nested deeper than `max_stack_depth` is invalid (`valid()` is false) in every build
+/// type. An invalid filter matches no header and is refused by `StreamingParser::SetHeaderFilter`.
+/// @tparam ProtoHeader The protocol header struct type.
+template <typename ProtoHeader>
+class HeaderFilter {
+ public:
+  constexpr static uint32_t max_batch_size = 64;
+  constexpr static uint32_t max_stack_depth = 32;
+
+  HeaderFilter() = default;
+
+  /// @brief Matches when the field equals one of `values`.
+  template <typename Field>
+  static HeaderFilter In(Field ProtoHeader::*member, std::initializer_list<uint32_t> values) {
+    HeaderFilter filter;
+    std::vector<uint32_t> sorted(values);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    filter.program_.push_back(Instruction{Op::kIn, FieldOf(member), 0,
+                                          static_cast<uint32_t>(sorted.size())});
+    filter.values_ = std::move(sorted);
+    filter.max_depth_ = 1;
+    return filter;
+  }
+
+  /// @brief Matches when the field equals `value`.
+  template <typename Field>
+  static HeaderFilter Equal(Field ProtoHeader::*member, uint32_t value) {
+    return In(member, {value});
+  }
+
+  /// @brief Matches when `min <= field <= max`.
+  template <typename Field>
+  static HeaderFilter Range(Field ProtoHeader::*member, uint32_t min, uint32_t max) {
+    return Leaf(Op::kRange, member, min, max);
+  }
+
+  /// @brief Matches when any bit of `mask` is set in the field.
+  template <typename Field>
+  static HeaderFilter AnyBits(Field ProtoHeader::*member, uint32_t mask) {
+    return Leaf(Op::kAnyBits, member, mask, 0);
+  }
+
+  /// @brief Matches when all bits of `mask` are set in the field.
+  template <typename Field>
+  static HeaderFilter AllBits(Field ProtoHeader::*member, uint32_t mask) {
+    return Leaf(Op::kAllBits, member, mask, 0);
+  }
+
+  friend HeaderFilter operator&&(const HeaderFilter& lhs, const HeaderFilter& rhs) {
+    return Combine(lhs, rhs, Op::kAnd);
+  }
+
+  friend HeaderFilter operator||(const HeaderFilter& lhs, const HeaderFilter& rhs) {
+    return Combine(lhs, rhs, Op::kOr);
+  }
+
+  friend HeaderFilter operator!(const HeaderFilter& operand) {
+    HeaderFilter filter;
+    filter.Append(operand);
+    filter.program_.push_back(Instruction{Op::kNot, HeaderField{}, 0, 0});
+    filter.max_depth_ = std::max<uint32_t>(operand.max_depth_, 1);
+    return filter;
+  }
+
+  /// @brief Whether the filter has no predicate, i.e. matches every header.
+  bool empty() const { return program_.empty(); }
+
+  /// @brief Whether the program fits the evaluation stack, see `max_stack_depth`.
+  bool valid() const { return max_depth_ <= max_stack_depth; }
+
+  /// @brief Evaluate the filter against a single header.
+  bool Match(const ProtoHeader& header) const { return Evaluate(&header, 1) & 1; }
+
+  /// @brief Evaluate the filter against `count` headers (at most `max_batch_size`). Bit `i` of the
+  /// result is set when `headers[i]` matches.
+  uint64_t Evaluate(const ProtoHeader* headers, uint32_t count) const {
+    assert(count <= max_batch_size);
+    const uint64_t lanes = count >= 64 ? ~uint64_t{0} : ((uint64_t{1} << count) - 1);
+    if (program_.empty()) {
+      return lanes;
+    }
+    if (!valid()) {
+      return 0;
+    }
+    uint64_t stack[max_stack_depth];
+    uint32_t depth = 0;
+    alignas(16) uint32_t column[max_batch_size];
+    for (const auto& ins : program_) {
+      switch (ins.op) {
+        case Op::kTrue:
+          stack[depth++] = lanes;
+          break;
+        case Op::kAnd:
+          --depth;
+          stack[depth - 1] &= stack[depth];
+          break;
+        case Op::kOr:
+          --depth;
+          stack[depth - 1] |= stack[depth];
+          break;
+        case Op::kNot:
+          stack[depth - 1] = ~stack[depth - 1] & lanes;
+          break;
+        default:
+          LoadColumn(ins.field, headers, count, column);
+          stack[depth++] = TestColumn(ins, column, count) & lanes;
+          break;
+      }
+    }
+    assert(depth == 1);
+    return stack[0];
+  }
+
+ private:
+  enum class Op : uint8_t { kTrue, kIn, kRange, kAnyBits, kAllBits, kAnd, kOr, kNot };
+  struct Instruction {
+    Op op;
+    HeaderField field;
+    uint32_t a;  // kIn: index into values_; kRange: min; kAnyBits/kAllBits: mask
+    uint32_t b;  // kIn: number of values; kRange: max
+  };
+
+  template <typename Field>
+  static HeaderField FieldOf(Field ProtoHeader::*member) {
+    static_assert(sizeof(Field) <= sizeof(uint32_t), "filter fields must be at most 32 bits");
+    return MakeHeaderField(member);
+  }
+
+  template <typename Field>
+  static HeaderFilter Leaf(Op op, Field ProtoHeader::*member, uint32_t a, uint32_t b) {
+    HeaderFilter filter;
+    filter.program_.push_back(Instruction{op, FieldOf(member), a, b});
+    filter.max_depth_ = 1;
+    return filter;
+  }
+
+  static HeaderFilter Combine(const HeaderFilter& lhs, const HeaderFilter& rhs, Op op) {
+    HeaderFilter filter;
+    filter.Append(lhs);
+    filter.Append(rhs);
+    filter.program_.push_back(Instruction{op, HeaderField{}, 0, 0});
+    filter.max_depth_ = std::max<uint32_t>(std::max<uint32_t>(lhs.max_depth_, 1),
+                                           std::max<uint32_t>(rhs.max_depth_, 1) + 1);
+    // a deeper filter stays invalid, as does every filter combining it
+    return filter;
+  }
+
+  /// @brief Append the program of `other`, rebasing its value indices; an empty program is
+  /// appended as a constant true.
+  void Append(const HeaderFilter& other) {
+    if (other.program_.empty()) {
+      program_.push_back(Instruction{Op::kTrue, HeaderField{}, 0, 0});
+      return;
+    }
+    const auto base = static_cast<uint32_t>(values_.size());
+    for (auto ins : other.program_) {
+      if (ins.op == Op::kIn) {
+        ins.a += base;
+      }
+      program_.push_back(ins);
+    }
+    values_.insert(values_.end(), other.values_.begin(), other.values_.end());
+  }
+
+  static void LoadColumn(const HeaderField& field, const ProtoHeader* headers, uint32_t count,
+                         uint32_t* column) {
+    uint32_t i = 0;
+    for (; i < count; ++i) {
+      column[i] = static_cast<uint32_t>(field.Load(&headers[i]));
+    }
+    // pad to the SIMD width so that the vector loop never reads uninitialized lanes
+    for (; i % 4 != 0; ++i) {
+      column[i] = 0;
+    }
+  }
+
+  uint64_t TestColumn(const Instruction& ins, const uint32_t* column, uint32_t count) const {
+    switch (ins.op) {
+      case Op::kIn:
+        return TestIn(column, count, &values_[ins.a], ins.b);
+      case Op::kRange:
+        return TestRange(column, count, ins.a, ins.b);
+      case Op::kAnyBits:
+        return TestMask(column, count, ins.a, false);
+      case Op::kAllBits:
+        return TestMask(column, count, ins.a, true);
+      default:
+        return 0;
+    }
+  }
+
+  static uint64_t TestIn(const uint32_t* column, uint32_t count, const uint32_t* values,
+                         uint32_t num_values) {
+    constexpr uint32_t linear_scan_limit = 8;
+    uint64_t bits = 0;
+    if (num_values > linear_scan_limit) {
+      for (uint32_t i = 0; i < count; ++i) {
+        bits |= static_cast<uint64_t>(std::binary_search(values, values + num_values, column[i]))
+                << i;
+      }
+      return bits;
+    }
+#if defined(__SSE2__)
+    for (uint32_t i = 0; i < count; i += 4) {
+      const __m128i lane = _mm_load_si128(reinterpret_cast<const __m128i*>(column + i));
+      __m128i eq = _mm_setzero_si128();
+      for (uint32_t v = 0; v < num_values; ++v) {
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(lane, _mm_set1_epi32(static_cast<int>(values[v]))));
+      }
+      bits |= static_cast<uint64_t>(_mm_movemask_ps(_mm_castsi128_ps(eq))) << i;
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+      bool eq = false;
+      for (uint32_t v = 0; v < num_values; ++v) {
+        eq |= column[i] == values[v];
+      }
+      bits |= static_cast<uint64_t>(eq) << i;
+    }
+#endif
+    return bits;
+  }
+
+  static uint64_t TestRange(const uint32_t* column, uint32_t count, uint32_t min, uint32_t max) {
+    uint64_t bits = 0;
+#if defined(__SSE2__)
+    // SSE2 only has signed compares, flip the sign bit to compare unsigned values
+    const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+    const __m128i lo = _mm_set1_epi32(static_cast<int>(min ^ 0x80000000u));
+    const __m128i hi = _mm_set1_epi32(static_cast<int>(max ^ 0x80000000u));
+    for (uint32_t i = 0; i < count; i += 4) {
+      const __m128i lane = _mm_xor_si128(
+          _mm_load_si128(reinterpret_cast<const __m128i*>(column + i)), bias);
+      const __m128i out = _mm_or_si128(_mm_cmplt_epi32(lane, lo), _mm_cmpgt_epi32(lane, hi));
+      bits |= static_cast<uint64_t>(~_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xF) << i;
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+      bits |= static_cast<uint64_t>(column[i] >= min && column[i] <= max) << i;
+    }
+#endif
+    return bits;
+  }
+
+  static uint64_t TestMask(const uint32_t* column, uint32_t count, uint32_t mask, bool all) {
+    uint64_t bits = 0;
+#if defined(__SSE2__)
+    const __m128i m = _mm_set1_epi32(static_cast<int>(mask));
+    const __m128i expected = all ? m : _mm_setzero_si128();
+    for (uint32_t i = 0; i < count; i += 4) {
+      const __m128i lane = _mm_load_si128(reinterpret_cast<const __m128i*>(column + i));
+      const int eq =
+          _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(lane, m), expected)));
+      bits |= static_cast<uint64_t>(all ? eq : (~eq & 0xF)) << i;
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+      const uint32_t masked = column[i] & mask;
+      bits |= static_cast<uint64_t>(all ? masked == mask : masked != 0) << i;
+    }
+#endif
+    return bits;
+  }
+
+  std::vector<Instruction> program_;
+  std::vector<uint32_t> values_;
+  uint32_t max_depth_ = 0;
+};
+
+#endif  // SRC_HEADER_FILTER_H_
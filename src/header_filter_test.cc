@@ -0,0 +1,113 @@
+#include "header_filter.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <vector>
+
+struct FilterHeader {
+  uint16_t flags;
+  uint32_t body_length;
+  uint16_t msg_type;
+  uint8_t priority;
+};
+
+using Filter = HeaderFilter<FilterHeader>;
+
+TEST(HeaderFilter, empty_filter_matches_all) {
+  Filter filter;
+  EXPECT_TRUE(filter.empty());
+  FilterHeader headers[3] = {};
+  EXPECT_EQ(filter.Evaluate(headers, 3), 0x7u);
+  EXPECT_TRUE(filter.Match(headers[0]));
+  EXPECT_FALSE((!filter).Match(headers[0]));
+}
+
+TEST(HeaderFilter, field_predicates) {
+  FilterHeader header = {};
+  header.flags = 0x0005;
+  header.msg_type = 42;
+  header.priority = 7;
+
+  EXPECT_TRUE(Filter::In(&FilterHeader::msg_type, {1, 42, 100}).Match(header));
+  EXPECT_FALSE(Filter::In(&FilterHeader::msg_type, {1, 2, 3}).Match(header));
+  EXPECT_TRUE(Filter::Equal(&FilterHeader::priority, 7).Match(header));
+  EXPECT_TRUE(Filter::Range(&FilterHeader::msg_type, 42, 42).Match(header));
+  EXPECT_TRUE(Filter::Range(&FilterHeader::msg_type, 0, 100).Match(header));
+  EXPECT_FALSE(Filter::Range(&FilterHeader::msg_type, 43, 0xFFFFFFFF).Match(header));
+  EXPECT_TRUE(Filter::AnyBits(&FilterHeader::flags, 0x0100 | 0x0001).Match(header));
+  EXPECT_FALSE(Filter::AnyBits(&FilterHeader::flags, 0x00F0).Match(header));
+  EXPECT_TRUE(Filter::AllBits(&FilterHeader::flags, 0x0005).Match(header));
+  EXPECT_FALSE(Filter::AllBits(&FilterHeader::flags, 0x0007).Match(header));
+
+  auto combined = (Filter::In(&FilterHeader::msg_type, {42}) &&
+                   !Filter::AnyBits(&FilterHeader::flags, 0x8000)) ||
+                  Filter::Range(&FilterHeader::priority, 200, 255);
+  EXPECT_TRUE(combined.Match(header));
+  header.flags = 0x8000;
+  EXPECT_FALSE(combined.Match(header));
+  header.priority = 201;
+  EXPECT_TRUE(combined.Match(header));
+}
+
+TEST(HeaderFilter, too_deep_filter_is_invalid) {
+  FilterHeader header = {};
+  header.msg_type = 1;
+  // every `&&` nests the previous filter one level deeper on its right
+  Filter filter = Filter::Equal(&FilterHeader::msg_type, 1);
+  for (uint32_t depth = 1; depth < Filter::max_stack_depth; ++depth) {
+    filter = Filter::Equal(&FilterHeader::msg_type, 1) && filter;
+  }
+  EXPECT_TRUE(filter.valid());
+  EXPECT_TRUE(filter.Match(header));
+  Filter deeper = Filter::Equal(&FilterHeader::msg_type, 1) && filter;
+  EXPECT_FALSE(deeper.valid());
+  EXPECT_FALSE(deeper.Match(header));
+  // combining an invalid filter keeps it invalid
+  EXPECT_FALSE((filter && deeper).valid());
+  EXPECT_FALSE((!deeper).valid());
+}
+
+TEST(HeaderFilter, batch_matches_scalar_reference) {
+  std::srand(7);
+  std::vector<uint32_t> many_types;
+  for (uint32_t i = 0; i < 20; ++i) {
+    many_types.push_back(i * 3);
+  }
+  auto filter = (Filter::In(&FilterHeader::msg_type, {1, 5, 9, 33}) ||
+                 Filter::Range(&FilterHeader::body_length, 100, 200)) &&
+                !Filter::AllBits(&FilterHeader::flags, 0x3);
+  auto reference = [](const FilterHeader& h) {
+    bool in = h.msg_type == 1 || h.msg_type == 5 || h.msg_type == 9 || h.msg_type == 33;
+    bool range = h.body_length >= 100 && h.body_length <= 200;
+    return (in || range) && (h.flags & 0x3) != 0x3;
+  };
+
+  for (uint32_t count : {1u, 3u, 4u, 17u, 63u, 64u}) {
+    std::vector<FilterHeader> headers(count);
+    for (auto& h : headers) {
+      h.flags = static_cast<uint16_t>(std::rand() & 0x7);
+      h.body_length = static_cast<uint32_t>(std::rand() % 300);
+      h.msg_type = static_cast<uint16_t>(std::rand() % 40);
+    }
+    uint64_t bits = filter.Evaluate(headers.data(), count);
+    for (uint32_t i = 0; i < count; ++i) {
+      EXPECT_EQ(((bits >> i) & 1) != 0, reference(headers[i])) << "lane " << i;
+    }
+    if (count < 64) {
+      EXPECT_EQ(bits >> count, 0u);
+    }
+  }
+
+  // large value sets take the sorted lookup path
+  auto large = Filter::In(&FilterHeader::msg_type,
+                          {0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 33, 36, 39});
+  FilterHeader headers[40] = {};
+  for (uint16_t i = 0; i < 40; ++i) {
+    headers[i].msg_type = i;
+  }
+  uint64_t bits = large.Evaluate(headers, 40);
+  for (uint32_t i = 0; i < 40; ++i) {
+    EXPECT_EQ(((bits >> i) & 1) != 0, i % 3 == 0);
+  }
+}
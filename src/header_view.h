@@ -0,0 +1,109 @@
+/**
+ * @file header_view.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_HEADER_VIEW_H_
+#define SRC_HEADER_VIEW_H_
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "header_field.h"
+
+template <typename T>
+struct MemberPointerTraits;
+
+template <typename Class, typename Field>
+struct MemberPointerTraits<Field Class::*> {
+  using ClassType = Class;
+  using FieldType = Field;
+};
+
+/// @brief Convert an integral value from network to host byte order.
+template <typename T>
+T NetworkToHost(T value) {
+  static_assert(std::is_integral_v<T>, "only integral fields can be byte swapped");
+  if constexpr (sizeof(T) == sizeof(uint16_t)) {
+    return static_cast<T>(ntohs(static_cast<uint16_t>(value)));
+  } else if constexpr (sizeof(T) == sizeof(uint32_t)) {
+    return static_cast<T>(ntohl(static_cast<uint32_t>(value)));
+  } else if constexpr (sizeof(T) == sizeof(uint64_t)) {
+    return static_cast<T>(be64toh(static_cast<uint64_t>(value)));
+  } else {
+    return value;
+  }
+}
+
+/// @brief A read-only view over the raw bytes of a header, decoding a field only when it is read.
+/// Handlers that look at one or two fields of a wide header avoid copying and converting the rest.
+/// The bytes are only valid during the handler call.
+/// @tparam ProtoHeader The protocol header struct type.
+template <typename ProtoHeader>
+class HeaderView {
+ public:
+  explicit HeaderView(const uint8_t* bytes) : bytes_(bytes) {}
+
+  /// @brief A field as a copied header holds it: `body_length` in host byte order, the other
+  /// fields as they are on the wire.
+  template <auto Member>
+  auto get() const {
+    if constexpr (IsBodyLength<Member>()) {
+      return NetworkToHost(raw<Member>());
+    } else {
+      return raw<Member>();
+    }
+  }
+
+  /// @brief An integral field converted from network byte order.
+  template <auto Member>
+  auto ntoh() const {
+    return NetworkToHost(raw<Member>());
+  }
+
+  /// @brief A field exactly as it is on the wire.
+  template <auto Member>
+  auto raw() const {
+    using Field = typename MemberPointerTraits<decltype(Member)>::FieldType;
+    Field value;
+    std::memcpy(&value, field_data<Member>(), sizeof(value));
+    return value;
+  }
+
+  /// @brief The bytes of a field, e.g. of an array member.
+  template <auto Member>
+  const uint8_t* field_data() const {
+    return bytes_ + FieldOffset(Member);
+  }
+
+  /// @brief Copy the whole header, converted like the header handler receives it.
+  ProtoHeader Materialize() const {
+    ProtoHeader header;
+    std::memcpy(&header, bytes_, sizeof(header));
+    header.body_length = NetworkToHost(header.body_length);
+    return header;
+  }
+
+  const uint8_t* data() const { return bytes_; }
+
+ private:
+  template <auto Member>
+  constexpr static bool IsBodyLength() {
+    if constexpr (std::is_same_v<decltype(Member), decltype(&ProtoHeader::body_length)>) {
+      return Member == &ProtoHeader::body_length;
+    } else {
+      return false;
+    }
+  }
+
+  const uint8_t* bytes_;
+};
+
+#endif  // SRC_HEADER_VIEW_H_
@@ -0,0 +1,162 @@
+#include "header_view.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "streaming_parser.h"
+
+struct WideHeader {
+  uint64_t sequence;
+  uint32_t body_length;
+  uint16_t msg_type;
+  uint16_t flags;
+  uint32_t stream_id;
+  uint8_t trace[20];
+  uint64_t timestamp;
+};
+
+namespace {
+WideHeader MakeHeader(uint16_t msg_type, uint32_t body_length) {
+  WideHeader header = {};
+  header.sequence = htobe64(0x0102030405060708ull + msg_type);
+  header.body_length = htonl(body_length);
+  header.msg_type = msg_type;
+  header.stream_id = htonl(7);
+  for (uint8_t i = 0; i < sizeof(header.trace); ++i) {
+    header.trace[i] = static_cast<uint8_t>(msg_type + i);
+  }
+  return header;
+}
+
+void AppendFrame(std::vector<uint8_t>& stream, uint16_t msg_type, uint32_t body_length) {
+  const WideHeader header = MakeHeader(msg_type, body_length);
+  const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+  stream.insert(stream.end(), raw, raw + sizeof(header));
+  stream.insert(stream.end(), body_length, static_cast<uint8_t>(msg_type));
+}
+}  // namespace
+
+TEST(HeaderView, field_access) {
+  const WideHeader header = MakeHeader(3, 100);
+  HeaderView<WideHeader> view(reinterpret_cast<const uint8_t*>(&header));
+  // `get` matches what a copied header holds: only body_length is converted
+  EXPECT_EQ(view.get<&WideHeader::body_length>(), 100);
+  EXPECT_EQ(view.get<&WideHeader::msg_type>(), 3);
+  EXPECT_EQ(view.get<&WideHeader::stream_id>(), htonl(7));
+  EXPECT_EQ(view.ntoh<&WideHeader::stream_id>(), 7);
+  EXPECT_EQ(view.ntoh<&WideHeader::sequence>(), 0x0102030405060708ull + 3);
+  EXPECT_EQ(view.raw<&WideHeader::body_length>(), htonl(100));
+  EXPECT_EQ(view.field_data<&WideHeader::trace>()[5], 8);
+  EXPECT_EQ(view.field_data<&WideHeader::trace>() - view.data(), offsetof(WideHeader, trace));
+
+  const WideHeader copy = view.Materialize();
+  EXPECT_EQ(copy.body_length, 100);
+  EXPECT_EQ(copy.sequence, header.sequence);
+  EXPECT_EQ(std::memcmp(copy.trace, header.trace, sizeof(header.trace)), 0);
+}
+
+TEST(HeaderView, parser_view_mode) {
+  std::vector<uint16_t> types;
+  std::vector<uint32_t> streams;
+  std::vector<uint32_t> body_lengths;
+  uint32_t body_bytes = 0;
+  auto parser = std::make_unique<StreamingParser<WideHeader>>(
+      [](const WideHeader&) {
+        ADD_FAILURE() << "the header handler is replaced by the view handler";
+        return true;
+      },
+      [&body_bytes](const uint8_t* data, uint32_t length) {
+        body_bytes += length;
+        return true;
+      });
+  parser->SetHeaderViewHandler([&](const HeaderView<WideHeader>& header) {
+    types.push_back(header.get<&WideHeader::msg_type>());
+    streams.push_back(header.ntoh<&WideHeader::stream_id>());
+    body_lengths.push_back(header.get<&WideHeader::body_length>());
+    return true;
+  });
+  // 64 byte headers and odd bodies in a 2048 byte ring, so some headers wrap around its end
+  std::vector<uint8_t> stream;
+  for (uint16_t msg_type = 0; msg_type < 200; ++msg_type) {
+    AppendFrame(stream, msg_type, msg_type % 3 == 0 ? 0 : 37);
+  }
+  for (size_t offset = 0; offset < stream.size(); offset += 500) {
+    const auto n = static_cast<uint32_t>(std::min<size_t>(500, stream.size() - offset));
+    ASSERT_TRUE(parser->HandleData(stream.data() + offset, n));
+  }
+  ASSERT_EQ(types.size(), 200);
+  for (uint16_t i = 0; i < 200; ++i) {
+    EXPECT_EQ(types[i], i);
+    EXPECT_EQ(streams[i], 7);
+    EXPECT_EQ(body_lengths[i], i % 3 == 0 ? 0 : 37);
+  }
+  EXPECT_EQ(body_bytes, 133 * 37);
+  EXPECT_EQ(parser->control_frames(), 67);
+}
+
+TEST(HeaderView, parser_view_mode_with_filter) {
+  std::vector<uint16_t> types;
+  auto parser = std::make_unique<StreamingParser<WideHeader>>(
+      [](const WideHeader&) { return true; }, [](const uint8_t*, uint32_t) { return true; });
+  parser->SetHeaderFilter(HeaderFilter<WideHeader>::Range(&WideHeader::msg_type, 10, 19));
+  parser->SetHeaderViewHandler([&types](const HeaderView<WideHeader>& header) {
+    types.push_back(header.get<&WideHeader::msg_type>());
+    return true;
+  });
+  std::vector<uint8_t> stream;
+  for (uint16_t msg_type = 0; msg_type < 30; ++msg_type) {
+    AppendFrame(stream, msg_type, 16);
+  }
+  ASSERT_TRUE(parser->HandleData(stream.data(), static_cast<uint32_t>(stream.size())));
+  EXPECT_EQ(types, std::vector<uint16_t>({10, 11, 12, 13, 14, 15, 16, 17, 18, 19}));
+  EXPECT_EQ(parser->filtered_frames(), 20);
+}
+
+TEST(HeaderView, parser_view_mode_with_filter_one_frame_per_call) {
+  // every batch starts with a header that is only viewed, not copied
+  std::vector<uint16_t> types;
+  auto parser = std::make_unique<StreamingParser<WideHeader>>(
+      [](const WideHeader&) { return true; }, [](const uint8_t*, uint32_t) { return true; });
+  parser->SetHeaderFilter(HeaderFilter<WideHeader>::Range(&WideHeader::msg_type, 10, 19));
+  parser->SetHeaderViewHandler([&types](const HeaderView<WideHeader>& header) {
+    types.push_back(header.get<&WideHeader::msg_type>());
+    return true;
+  });
+  for (uint16_t msg_type = 0; msg_type < 30; ++msg_type) {
+    std::vector<uint8_t> frame;
+    AppendFrame(frame, msg_type, 16);
+    ASSERT_TRUE(parser->HandleData(frame.data(), static_cast<uint32_t>(frame.size())));
+  }
+  EXPECT_EQ(types, std::vector<uint16_t>({10, 11, 12, 13, 14, 15, 16, 17, 18, 19}));
+  EXPECT_EQ(parser->filtered_frames(), 20);
+}
+
+TEST(HeaderView, leaving_view_mode_after_counted_frames) {
+  std::vector<uint16_t> types;
+  auto parser = std::make_unique<StreamingParser<WideHeader>>(
+      [&types](const WideHeader& header) {
+        types.push_back(header.msg_type);
+        return true;
+      },
+      [](const uint8_t*, uint32_t) { return true; });
+  parser->SetControlFrameMode(StreamingParser<WideHeader>::ControlFrameMode::kCount);
+  parser->SetHeaderViewHandler([](const HeaderView<WideHeader>&) { return true; });
+  std::vector<uint8_t> stream;
+  for (uint16_t msg_type = 0; msg_type < 5; ++msg_type) {
+    AppendFrame(stream, msg_type, 0);
+  }
+  ASSERT_TRUE(parser->HandleData(stream.data(), static_cast<uint32_t>(stream.size())));
+  EXPECT_EQ(parser->control_frames(), 5);
+
+  // back to copied headers: nothing refers to the drained run any more
+  parser->SetHeaderViewHandler(nullptr);
+  stream.clear();
+  AppendFrame(stream, 40, 16);
+  AppendFrame(stream, 41, 16);
+  ASSERT_TRUE(parser->HandleData(stream.data(), static_cast<uint32_t>(stream.size())));
+  EXPECT_EQ(types, std::vector<uint16_t>({40, 41}));
+}
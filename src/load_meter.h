@@ -0,0 +1,103 @@
+/**
+ * @file load_meter.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_LOAD_METER_H_
+#define SRC_LOAD_METER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+/// @brief Exponentially weighted moving averages of the bytes and of the busy time per second of a
+/// connection. The owner records its work; the rates are folded once per window (a sixteenth of
+/// the half life) and can be read from any thread. A reader sees the rates of an idle connection
+/// decay from the last fold on.
+class LoadMeter final {
+ public:
+  constexpr static uint64_t kDefaultHalfLifeNs = 1000000000;
+
+  explicit LoadMeter(uint64_t half_life_ns = kDefaultHalfLifeNs) { Reset(half_life_ns); }
+  LoadMeter(const LoadMeter&) = delete;
+  LoadMeter& operator=(const LoadMeter&) = delete;
+
+  /// @brief Forget the history, weighing new samples with `half_life_ns`.
+  void Reset(uint64_t half_life_ns) {
+    half_life_ns_ = half_life_ns > 0 ? half_life_ns : kDefaultHalfLifeNs;
+    window_ns_ = std::max<uint64_t>(half_life_ns_ / 16, 1);
+    started_ = false;
+    window_start_ns_ = 0;
+    window_bytes_ = 0;
+    window_busy_ns_ = 0;
+    bytes_rate_.store(0, std::memory_order_relaxed);
+    busy_rate_.store(0, std::memory_order_relaxed);
+    folded_ns_.store(0, std::memory_order_relaxed);
+  }
+
+  /// @brief Account `bytes` received and `busy_ns` spent on them, ending at `now_ns`. Only called
+  /// by the owner of the connection.
+  void Record(uint64_t bytes, uint64_t busy_ns, uint64_t now_ns) {
+    if (!started_) {
+      // the first sample covers the time it took
+      started_ = true;
+      window_start_ns_ = now_ns - std::min(now_ns, busy_ns);
+    }
+    window_bytes_ += bytes;
+    window_busy_ns_ += busy_ns;
+    if (now_ns - window_start_ns_ >= window_ns_) {
+      Fold(now_ns);
+    }
+  }
+
+  /// @brief Moving average of the bytes per second.
+  double bytes_per_second(uint64_t now_ns) const { return Decayed(bytes_rate_, now_ns); }
+
+  /// @brief Moving average of the busy nanoseconds per second, i.e. the share of a core times 1e9.
+  double busy_ns_per_second(uint64_t now_ns) const { return Decayed(busy_rate_, now_ns); }
+
+ private:
+  void Fold(uint64_t now_ns) {
+    const double elapsed = static_cast<double>(now_ns - window_start_ns_);
+    const double weight = 1.0 - std::exp2(-elapsed / static_cast<double>(half_life_ns_));
+    auto fold = [&](std::atomic<double>& rate, uint64_t amount) {
+      const double current = rate.load(std::memory_order_relaxed);
+      rate.store(current + weight * (static_cast<double>(amount) * 1e9 / elapsed - current),
+                 std::memory_order_relaxed);
+    };
+    fold(bytes_rate_, window_bytes_);
+    fold(busy_rate_, window_busy_ns_);
+    folded_ns_.store(now_ns, std::memory_order_relaxed);
+    window_start_ns_ = now_ns;
+    window_bytes_ = 0;
+    window_busy_ns_ = 0;
+  }
+
+  double Decayed(const std::atomic<double>& rate, uint64_t now_ns) const {
+    const double value = rate.load(std::memory_order_relaxed);
+    const uint64_t folded_ns = folded_ns_.load(std::memory_order_relaxed);
+    // a window that is still open is not idle yet
+    if (now_ns <= folded_ns + window_ns_) {
+      return value;
+    }
+    const double idle = static_cast<double>(now_ns - folded_ns - window_ns_);
+    return value * std::exp2(-idle / static_cast<double>(half_life_ns_));
+  }
+
+  uint64_t half_life_ns_ = kDefaultHalfLifeNs;
+  uint64_t window_ns_ = 0;
+  // the open window, owner only
+  bool started_ = false;
+  uint64_t window_start_ns_ = 0;
+  uint64_t window_bytes_ = 0;
+  uint64_t window_busy_ns_ = 0;
+  std::atomic<double> bytes_rate_{0};
+  std::atomic<double> busy_rate_{0};
+  std::atomic<uint64_t> folded_ns_{0};
+};
+
+#endif  // SRC_LOAD_METER_H_
@@ -0,0 +1,358 @@
+#include "outbound_framer.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+namespace {
+constexpr size_t kMaxIov = 64;
+
+void ReleaseBuffer(OutboundBuffer* buffer) {
+  if (buffer->release != nullptr) {
+    buffer->release(buffer);
+  }
+}
+}  // namespace
+
+FrameSender::FrameSender(int fd, const SenderOptions& options) : fd_(fd), options_(options) {
+  if (options_.zerocopy_threshold > 0) {
+    int enable = 1;
+    zerocopy_enabled_ = setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+  }
+}
+
+FrameSender::~FrameSender() {
+  for (const Chunk& chunk : chunks_) {
+    if (chunk.body != nullptr && !chunk.inflight) {
+      ReleaseBuffer(chunk.body);
+    }
+  }
+  WaitCompletions();
+}
+
+/// @brief Reap the completions of the bodies in flight until they are all released or
+/// `completion_wait_ms` passed. Nothing more is sent, so a partly sent body is done once its sends
+/// complete.
+void FrameSender::WaitCompletions() {
+  if (inflight_.empty()) {
+    return;
+  }
+  inflight_.back().fully_sent = true;
+  const uint64_t deadline_ns = NowNs() + options_.completion_wait_ms * 1000000ull;
+  for (;;) {
+    ProcessCompletions();
+    const uint64_t now_ns = NowNs();
+    if (inflight_.empty() || now_ns >= deadline_ns) {
+      return;
+    }
+    // POLLERR is reported when a completion is queued
+    pollfd waiting{fd_, 0, 0};
+    const auto timeout_ms = static_cast<int>((deadline_ns - now_ns + 999999) / 1000000);
+    poll(&waiting, 1, timeout_ms);
+  }
+}
+
+void FrameSender::Discard() {
+  for (const Chunk& chunk : chunks_) {
+    if (chunk.body == nullptr) {
+      continue;
+    }
+    if (chunk.inflight) {
+      inflight_.back().fully_sent = true;
+    } else {
+      ReleaseBuffer(chunk.body);
+    }
+  }
+  chunks_.clear();
+  staging_.clear();
+  pending_bytes_ = 0;
+  corked_frames_ = 0;
+  corked_ns_sum_ = 0;
+  ReleaseCompleted();
+}
+
+void FrameSender::Append(const uint8_t* data, uint32_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (!chunks_.empty() && chunks_.back().body == nullptr) {
+    chunks_.back().length += length;
+  } else {
+    chunks_.push_back(Chunk{nullptr, static_cast<uint32_t>(staging_.size()), length, false, false});
+  }
+  staging_.insert(staging_.end(), data, data + length);
+  pending_bytes_ += length;
+}
+
+void FrameSender::AppendBody(OutboundBuffer* body) {
+  if (options_.zerocopy_threshold == 0 || body->length < options_.zerocopy_threshold) {
+    Append(body->data, body->length);
+    ReleaseBuffer(body);
+    return;
+  }
+  chunks_.push_back(Chunk{body, 0, body->length, zerocopy_enabled_, false});
+  pending_bytes_ += body->length;
+}
+
+std::error_code FrameSender::Flush() {
+  while (!chunks_.empty()) {
+    bool blocked = false;
+    auto err = chunks_.front().zerocopy ? SendZerocopy(chunks_.front(), blocked)
+                                        : SendCopies(blocked);
+    if (err || blocked) {
+      CompactStaging();
+      return err;
+    }
+  }
+  staging_.clear();
+  return std::error_code();
+}
+
+uint64_t FrameSender::NowNs() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+std::error_code FrameSender::FrameQueued() {
+  if (!options_.cork.enabled) {
+    return std::error_code();
+  }
+  const uint64_t now_ns = NowNs();
+  if (corked_frames_ == 0) {
+    first_corked_ns_ = now_ns;
+  }
+  ++corked_frames_;
+  corked_ns_sum_ += now_ns;
+  if (pending_bytes_ >= options_.cork.flush_bytes) {
+    return CorkFlush(now_ns, FlushReason::kSize);
+  }
+  return FlushIfDue(now_ns);
+}
+
+std::error_code FrameSender::EndBatch() {
+  if (corked_frames_ == 0) {
+    return Flush();
+  }
+  return CorkFlush(NowNs(), FlushReason::kBatchEnd);
+}
+
+std::error_code FrameSender::FlushIfDue(uint64_t now_ns) {
+  if (corked_frames_ == 0 || now_ns < flush_deadline_ns()) {
+    return std::error_code();
+  }
+  return CorkFlush(now_ns, FlushReason::kDeadline);
+}
+
+/// @brief Flush the corked frames and account what corking saved and cost. Bytes a non-blocking
+/// socket did not take are written by the next `Flush`, they are not corked any more.
+std::error_code FrameSender::CorkFlush(uint64_t now_ns, FlushReason reason) {
+  if (reason == FlushReason::kSize) {
+    ++stats_.cork_size_flushes;
+  } else if (reason == FlushReason::kBatchEnd) {
+    ++stats_.cork_batch_flushes;
+  } else {
+    ++stats_.cork_deadline_flushes;
+  }
+  stats_.cork_delay_ns += corked_frames_ * now_ns - corked_ns_sum_;
+  stats_.max_cork_delay_ns = std::max(stats_.max_cork_delay_ns, now_ns - first_corked_ns_);
+  const uint64_t syscalls = stats_.syscalls;
+  auto err = Flush();
+  // without corking each frame would have needed at least one send call
+  stats_.syscalls_saved += corked_frames_ - std::min(corked_frames_, stats_.syscalls - syscalls);
+  corked_frames_ = 0;
+  corked_ns_sum_ = 0;
+  return err;
+}
+
+ssize_t FrameSender::SendMsg(const msghdr& msg, int flags, bool& blocked) {
+  ssize_t sent = 0;
+  do {
+    ++stats_.syscalls;
+    sent = sendmsg(fd_, &msg, flags | MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  blocked = sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  return sent;
+}
+
+/// @brief Write the staged bytes and borrowed bodies at the front of the queue in one call.
+std::error_code FrameSender::SendCopies(bool& blocked) {
+  iov_.clear();
+  for (const Chunk& chunk : chunks_) {
+    if (chunk.zerocopy || iov_.size() == kMaxIov) {
+      break;
+    }
+    const uint8_t* base =
+        chunk.body != nullptr ? chunk.body->data + chunk.offset : staging_.data() + chunk.offset;
+    iov_.push_back(iovec{const_cast<uint8_t*>(base), static_cast<size_t>(chunk.length)});
+  }
+  msghdr msg{};
+  msg.msg_iov = iov_.data();
+  msg.msg_iovlen = iov_.size();
+  const ssize_t sent = SendMsg(msg, 0, blocked);
+  if (sent < 0) {
+    return blocked ? std::error_code() : std::error_code(errno, std::system_category());
+  }
+  Consume(static_cast<uint64_t>(sent));
+  return std::error_code();
+}
+
+/// @brief Send the rest of the front body with `MSG_ZEROCOPY`. Each successful call is given the
+/// next sequence number, which the completion notifications refer to.
+std::error_code FrameSender::SendZerocopy(Chunk& chunk, bool& blocked) {
+  iovec iov{const_cast<uint8_t*>(chunk.body->data + chunk.offset),
+            static_cast<size_t>(chunk.length)};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  const ssize_t sent = SendMsg(msg, MSG_ZEROCOPY, blocked);
+  if (sent < 0) {
+    if (errno == ENOBUFS) {
+      // out of option memory to pin pages, copy this body instead
+      chunk.zerocopy = false;
+      ++stats_.zerocopy_fallbacks;
+      return std::error_code();
+    }
+    return blocked ? std::error_code() : std::error_code(errno, std::system_category());
+  }
+  if (!chunk.inflight) {
+    inflight_.push_back(InFlight{chunk.body, next_seq_, next_seq_, 0, false});
+    chunk.inflight = true;
+  }
+  inflight_.back().last_seq = next_seq_++;
+  ++stats_.zerocopy_sends;
+  stats_.zerocopy_bytes += static_cast<uint64_t>(sent);
+  Consume(static_cast<uint64_t>(sent));
+  return std::error_code();
+}
+
+void FrameSender::Consume(uint64_t length) {
+  stats_.bytes_sent += length;
+  pending_bytes_ -= length;
+  while (length > 0) {
+    Chunk& front = chunks_.front();
+    const auto n = static_cast<uint32_t>(std::min<uint64_t>(length, front.length));
+    front.offset += n;
+    front.length -= n;
+    length -= n;
+    if (front.length == 0) {
+      const Chunk done = front;
+      chunks_.pop_front();
+      FinishChunk(done);
+    }
+  }
+}
+
+/// @brief A body sent by copy can be reused right away, a zero-copy one once its last send
+/// completes.
+void FrameSender::FinishChunk(const Chunk& chunk) {
+  if (chunk.body == nullptr) {
+    return;
+  }
+  if (!chunk.inflight) {
+    ReleaseBuffer(chunk.body);
+    return;
+  }
+  inflight_.back().fully_sent = true;
+  ReleaseCompleted();
+}
+
+void FrameSender::ReleaseCompleted() {
+  while (!inflight_.empty()) {
+    const InFlight& front = inflight_.front();
+    if (!front.fully_sent || front.completed < front.last_seq - front.first_seq + 1) {
+      break;
+    }
+    OutboundBuffer* body = front.body;
+    inflight_.pop_front();
+    ReleaseBuffer(body);
+  }
+}
+
+/// @brief The bytes before the first queued chunk were sent, drop them once they are the larger
+/// half of the staging buffer.
+void FrameSender::CompactStaging() {
+  auto first = std::find_if(chunks_.begin(), chunks_.end(),
+                            [](const Chunk& chunk) { return chunk.body == nullptr; });
+  const uint32_t sent = first != chunks_.end() ? first->offset : staging_.size();
+  if (sent < staging_.size() / 2) {
+    return;
+  }
+  staging_.erase(staging_.begin(), staging_.begin() + sent);
+  for (Chunk& chunk : chunks_) {
+    if (chunk.body == nullptr) {
+      chunk.offset -= sent;
+    }
+  }
+}
+
+void FrameSender::ProcessCompletions() {
+  if (!zerocopy_enabled_) {
+    return;
+  }
+  for (;;) {
+    alignas(cmsghdr) uint8_t control[128];
+    msghdr msg{};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t ret = 0;
+    do {
+      ret = recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+      // the error queue is empty
+      return;
+    }
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      const bool recverr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+      if (!recverr) {
+        continue;
+      }
+      sock_extended_err err;
+      std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if (err.ee_errno == 0 && err.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+        Complete(err.ee_info, err.ee_data, (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+      }
+    }
+  }
+}
+
+/// @brief The kernel reports the sends `first` to `last` (inclusive, 32-bit wrapping) as done.
+void FrameSender::Complete(uint32_t first, uint32_t last, bool copied) {
+  // widen the sequence numbers, they are at most 2^32 sends behind `next_seq_`
+  auto widen = [this](uint32_t seq) {
+    return next_seq_ - static_cast<uint32_t>(static_cast<uint32_t>(next_seq_) - seq);
+  };
+  const uint64_t lo = widen(first);
+  const uint64_t hi = widen(last);
+  const uint64_t count = hi - lo + 1;
+  stats_.zerocopy_completions += count;
+  if (copied) {
+    stats_.zerocopy_copied += count;
+  }
+  for (InFlight& entry : inflight_) {
+    if (entry.first_seq > hi) {
+      break;
+    }
+    const uint64_t begin = std::max(lo, entry.first_seq);
+    const uint64_t end = std::min(hi, entry.last_seq);
+    if (begin <= end) {
+      entry.completed += end - begin + 1;
+    }
+  }
+  ReleaseCompleted();
+}
@@ -0,0 +1,228 @@
+/**
+ * @file outbound_framer.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_OUTBOUND_FRAMER_H_
+#define SRC_OUTBOUND_FRAMER_H_
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <deque>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// @brief A body owned by the caller (e.g. a ring region or a pooled buffer). `release` hands it
+/// back once the kernel no longer reads its bytes, which for zero-copy sends is only after the
+/// completion has been reported on the socket error queue.
+struct OutboundBuffer {
+  using ReleaseFn = void (*)(OutboundBuffer* buffer);
+  const uint8_t* data = nullptr;
+  uint32_t length = 0;
+  ReleaseFn release = nullptr;
+  void* opaque = nullptr;  // owner context for `release`
+};
+
+/// @brief Auto-cork: frames are held back and written together once `flush_bytes` are queued, the
+/// oldest frame waited `max_delay_us`, or the current processing batch ends, whichever comes first.
+struct CorkPolicy {
+  bool enabled = false;
+  uint32_t flush_bytes = 16 * 1024;
+  uint32_t max_delay_us = 100;
+};
+
+struct SenderOptions {
+  /// @brief Bodies of at least this many bytes are sent with `MSG_ZEROCOPY`, 0 disables it.
+  uint32_t zerocopy_threshold = 64 * 1024;
+  /// @brief How long the destructor waits for the completions of zero-copy bodies in flight.
+  uint32_t completion_wait_ms = 1000;
+  CorkPolicy cork;
+};
+
+struct SenderStats {
+  uint64_t syscalls = 0;  // send calls made, including the ones that would block
+  uint64_t bytes_sent = 0;
+  uint64_t zerocopy_sends = 0;
+  uint64_t zerocopy_bytes = 0;
+  uint64_t zerocopy_completions = 0;  // zero-copy sends reported complete by the kernel
+  uint64_t zerocopy_copied = 0;       // completions where the kernel copied the data anyway
+  uint64_t zerocopy_fallbacks = 0;    // large bodies sent by copy, e.g. on ENOBUFS
+  uint64_t cork_size_flushes = 0;
+  uint64_t cork_batch_flushes = 0;
+  uint64_t cork_deadline_flushes = 0;
+  uint64_t syscalls_saved = 0;     // corked frames minus the send calls that wrote them
+  uint64_t cork_delay_ns = 0;      // latency added by corking, summed over the frames
+  uint64_t max_cork_delay_ns = 0;  // the longest a frame was held back
+};
+
+/// @brief Writes frames to a stream socket. Small frames are copied into a staging buffer and
+/// written in batches with one `sendmsg`; bodies above the zero-copy threshold are sent from the
+/// caller's buffer with `MSG_ZEROCOPY` and released once the kernel reports their completion. When
+/// the socket does not support zero-copy, large bodies are still written without staging them and
+/// released as soon as they are sent. Works with blocking and non-blocking sockets. Not
+/// thread-safe, the socket is not closed by the sender.
+class FrameSender final {
+ public:
+  explicit FrameSender(int fd, const SenderOptions& options = SenderOptions());
+  FrameSender(const FrameSender&) = delete;
+  FrameSender& operator=(const FrameSender&) = delete;
+  /// @brief Releases the bodies still queued, and the ones in flight once the kernel reports them
+  /// complete, waiting up to `completion_wait_ms`. Bodies still in flight after that are not
+  /// released at all, the kernel may still read them: flush and wait for `inflight_bodies() == 0`
+  /// before destroying a sender whose bodies must come back.
+  ~FrameSender();
+
+  /// @brief Queue a copy of `length` bytes.
+  void Append(const uint8_t* data, uint32_t length);
+
+  /// @brief Queue a body without copying it when it reaches the zero-copy threshold. Smaller
+  /// bodies are copied and released right away.
+  void AppendBody(OutboundBuffer* body);
+
+  /// @brief Write the queued bytes until everything is sent or the socket would block. Returns the
+  /// `errno` of a failed send.
+  std::error_code Flush();
+
+  /// @brief Drop the bytes not sent yet, e.g. after a write error broke the stream. Queued bodies
+  /// are released, a body partly sent with zero-copy once its sends complete.
+  void Discard();
+
+  /// @brief Per-connection auto-cork settings, they apply from the next queued frame.
+  void SetCorkPolicy(const CorkPolicy& policy) { options_.cork = policy; }
+
+  /// @brief Account a complete frame queued with `Append`/`AppendBody`. With auto-cork enabled it
+  /// flushes once the byte threshold or the deadline is reached; otherwise it does nothing and the
+  /// caller flushes.
+  std::error_code FrameQueued();
+
+  /// @brief The current processing batch is done (e.g. the end of an event loop tick): flush
+  /// everything queued.
+  std::error_code EndBatch();
+
+  /// @brief Flush the corked frames if their deadline passed, for the event loop timer.
+  std::error_code FlushIfDue(uint64_t now_ns);
+
+  /// @brief When the oldest corked frame must be flushed (CLOCK_MONOTONIC), 0 if none is corked.
+  uint64_t flush_deadline_ns() const {
+    return corked_frames_ > 0 ? first_corked_ns_ + options_.cork.max_delay_us * 1000ull : 0;
+  }
+
+  /// @brief CLOCK_MONOTONIC in nanoseconds, the clock of the cork deadlines.
+  static uint64_t NowNs();
+
+  /// @brief Read the zero-copy completions from the socket error queue and release the bodies
+  /// that are done. Call it when the socket polls with `POLLERR`, or periodically.
+  void ProcessCompletions();
+
+  /// @brief Bytes queued and not sent yet.
+  uint64_t pending_bytes() const { return pending_bytes_; }
+
+  /// @brief Zero-copy bodies sent and waiting for their completion.
+  size_t inflight_bodies() const { return inflight_.size(); }
+
+  bool zerocopy_enabled() const { return zerocopy_enabled_; }
+  const SenderStats& stats() const { return stats_; }
+
+ private:
+  struct Chunk {
+    OutboundBuffer* body;  // nullptr for bytes in `staging_`
+    uint32_t offset;       // into `staging_`, or bytes of `body` already sent
+    uint32_t length;
+    bool zerocopy;
+    bool inflight;  // part of `body` was sent with zero-copy, the back of `inflight_` tracks it
+  };
+  enum class FlushReason : uint8_t {
+    kSize,
+    kBatchEnd,
+    kDeadline,
+  };
+  struct InFlight {
+    OutboundBuffer* body;
+    uint64_t first_seq;
+    uint64_t last_seq;
+    uint64_t completed;
+    bool fully_sent;
+  };
+
+  ssize_t SendMsg(const msghdr& msg, int flags, bool& blocked);
+  std::error_code SendCopies(bool& blocked);
+  std::error_code SendZerocopy(Chunk& chunk, bool& blocked);
+  void Consume(uint64_t length);
+  void FinishChunk(const Chunk& chunk);
+  void ReleaseCompleted();
+  void WaitCompletions();
+  void CompactStaging();
+  void Complete(uint32_t first, uint32_t last, bool copied);
+  std::error_code CorkFlush(uint64_t now_ns, FlushReason reason);
+
+  int fd_;
+  SenderOptions options_;
+  bool zerocopy_enabled_ = false;
+  std::vector<uint8_t> staging_;
+  std::deque<Chunk> chunks_;
+  std::deque<InFlight> inflight_;  // ordered by sequence number
+  uint64_t next_seq_ = 0;          // the kernel numbers zero-copy sends from 0
+  uint64_t pending_bytes_ = 0;
+  uint64_t corked_frames_ = 0;
+  uint64_t first_corked_ns_ = 0;
+  uint64_t corked_ns_sum_ = 0;  // sum of the queueing times of the corked frames
+  std::vector<iovec> iov_;
+  SenderStats stats_;
+};
+
+/// @brief Encodes frames of a ProtoHeader protocol (the inverse of StreamingParser: only
+/// `body_length` is converted to network byte order) and queues them on a FrameSender.
+/// @tparam ProtoHeader The protocol header struct type.
+template <typename ProtoHeader>
+class OutboundFramer {
+ public:
+  constexpr static uint32_t protocol_header_length = sizeof(ProtoHeader);
+  static_assert(std::is_same_v<decltype(std::declval<ProtoHeader>().body_length), uint16_t> ||
+                    std::is_same_v<decltype(std::declval<ProtoHeader>().body_length), uint32_t>,
+                "ProtoHeader body_length field must be uint16_t or uint32_t");
+
+  explicit OutboundFramer(int fd, const SenderOptions& options = SenderOptions())
+      : sender_(fd, options) {}
+
+  /// @brief Queue a frame, copying its body. Returns the error of an auto-cork flush.
+  std::error_code Send(ProtoHeader header, const uint8_t* body, uint32_t length) {
+    AppendHeader(header, length);
+    sender_.Append(body, length);
+    return sender_.FrameQueued();
+  }
+
+  /// @brief Queue a frame whose body is released by the sender once it has been sent.
+  std::error_code Send(ProtoHeader header, OutboundBuffer* body) {
+    AppendHeader(header, body->length);
+    sender_.AppendBody(body);
+    return sender_.FrameQueued();
+  }
+
+  std::error_code Flush() { return sender_.Flush(); }
+
+  std::error_code EndBatch() { return sender_.EndBatch(); }
+
+  FrameSender& sender() { return sender_; }
+
+ private:
+  void AppendHeader(ProtoHeader& header, uint32_t length) {
+    if constexpr (sizeof(header.body_length) == sizeof(uint16_t)) {
+      header.body_length = htons(static_cast<uint16_t>(length));
+    } else if constexpr (sizeof(header.body_length) == sizeof(uint32_t)) {
+      header.body_length = htonl(length);
+    }
+    sender_.Append(reinterpret_cast<const uint8_t*>(&header), protocol_header_length);
+  }
+
+  FrameSender sender_;
+};
+
+#endif  // SRC_OUTBOUND_FRAMER_H_
@@ -0,0 +1,396 @@
+#include "outbound_framer.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+struct ReplyHeader {
+  uint32_t body_length;
+  uint16_t msg_type;
+};
+
+namespace {
+/// @brief A connected loopback TCP pair, returns false when the sandbox has no network.
+bool TcpPair(int& sender, int& receiver) {
+  const int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {
+    return false;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_length = sizeof(addr);
+  bool ok = bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+            listen(listener, 1) == 0 &&
+            getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_length) == 0;
+  sender = ok ? socket(AF_INET, SOCK_STREAM, 0) : -1;
+  ok = ok && sender >= 0 && connect(sender, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+  receiver = ok ? accept(listener, nullptr, nullptr) : -1;
+  close(listener);
+  return ok && receiver >= 0;
+}
+
+/// @brief Receives the byte stream and decodes it once it is complete. Bodies are larger than a
+/// parser ring, so frames are walked directly.
+struct Receiver {
+  explicit Receiver(int fd) : fd(fd) {}
+
+  void Poll() {
+    uint8_t data[65536];
+    ssize_t n = 0;
+    while ((n = recv(fd, data, sizeof(data), MSG_DONTWAIT)) > 0) {
+      stream.insert(stream.end(), data, data + n);
+    }
+  }
+
+  /// @brief Decode the frames, checking that every body byte equals the low byte of its msg_type.
+  void Decode() {
+    size_t offset = 0;
+    while (offset + sizeof(ReplyHeader) <= stream.size()) {
+      ReplyHeader header;
+      std::memcpy(&header, stream.data() + offset, sizeof(header));
+      const uint32_t body_length = ntohl(header.body_length);
+      offset += sizeof(header);
+      if (offset + body_length > stream.size()) {
+        break;
+      }
+      types.push_back(header.msg_type);
+      const auto expected = static_cast<uint8_t>(header.msg_type);
+      intact &= std::all_of(stream.begin() + offset, stream.begin() + offset + body_length,
+                            [expected](uint8_t byte) { return byte == expected; });
+      body_bytes += body_length;
+      offset += body_length;
+    }
+  }
+
+  int fd;
+  std::vector<uint8_t> stream;
+  std::vector<uint16_t> types;
+  uint64_t body_bytes = 0;
+  bool intact = true;
+};
+
+struct PooledBody {
+  OutboundBuffer buffer;
+  std::vector<uint8_t> storage;
+  bool released = false;
+};
+
+void MarkReleased(OutboundBuffer* buffer) {
+  static_cast<PooledBody*>(buffer->opaque)->released = true;
+}
+
+std::vector<std::unique_ptr<PooledBody>> MakeBodies(uint16_t first_type, int count,
+                                                    uint32_t length) {
+  std::vector<std::unique_ptr<PooledBody>> bodies;
+  for (int i = 0; i < count; ++i) {
+    auto body = std::make_unique<PooledBody>();
+    body->storage.assign(length, static_cast<uint8_t>(first_type + i));
+    body->buffer.data = body->storage.data();
+    body->buffer.length = length;
+    body->buffer.release = MarkReleased;
+    body->buffer.opaque = body.get();
+    bodies.push_back(std::move(body));
+  }
+  return bodies;
+}
+
+/// @brief Flush, receive and reap completions until every body is released or 10s passed.
+void Pump(OutboundFramer<ReplyHeader>& framer, Receiver& receiver,
+          const std::vector<std::unique_ptr<PooledBody>>& bodies) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  auto all_released = [&bodies]() {
+    for (const auto& body : bodies) {
+      if (!body->released) {
+        return false;
+      }
+    }
+    return true;
+  };
+  while (std::chrono::steady_clock::now() < deadline) {
+    EXPECT_FALSE(framer.Flush());
+    receiver.Poll();
+    framer.sender().ProcessCompletions();
+    if (framer.sender().pending_bytes() == 0 && all_released()) {
+      break;
+    }
+  }
+}
+}  // namespace
+
+TEST(OutboundFramer, small_frames_batched) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  OutboundFramer<ReplyHeader> framer(fds[0]);
+  std::vector<uint8_t> body(100);
+  for (uint16_t msg_type = 0; msg_type < 50; ++msg_type) {
+    std::fill(body.begin(), body.end(), static_cast<uint8_t>(msg_type));
+    framer.Send(ReplyHeader{0, msg_type}, body.data(), static_cast<uint32_t>(body.size()));
+  }
+  EXPECT_EQ(framer.sender().pending_bytes(), 50 * (sizeof(ReplyHeader) + 100));
+  EXPECT_FALSE(framer.Flush());
+  EXPECT_EQ(framer.sender().stats().syscalls, 1);
+  EXPECT_EQ(framer.sender().pending_bytes(), 0);
+
+  Receiver receiver(fds[1]);
+  receiver.Poll();
+  receiver.Decode();
+  ASSERT_EQ(receiver.types.size(), 50);
+  EXPECT_EQ(receiver.types.back(), 49);
+  EXPECT_TRUE(receiver.intact);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(OutboundFramer, large_bodies_zerocopy) {
+  int sender_fd = -1;
+  int receiver_fd = -1;
+  if (!TcpPair(sender_fd, receiver_fd)) {
+    GTEST_SKIP() << "no loopback TCP";
+  }
+  fcntl(sender_fd, F_SETFL, fcntl(sender_fd, F_GETFL) | O_NONBLOCK);
+  SenderOptions options;
+  options.zerocopy_threshold = 16 * 1024;
+  auto framer = std::make_unique<OutboundFramer<ReplyHeader>>(sender_fd, options);
+  auto bodies = MakeBodies(10, 3, 1024 * 1024);
+  auto small = MakeBodies(20, 1, 512);
+  framer->Send(ReplyHeader{0, 1}, reinterpret_cast<const uint8_t*>("\x01\x01"), 2);
+  for (auto& body : bodies) {
+    framer->Send(ReplyHeader{0, static_cast<uint16_t>(body->storage[0])}, &body->buffer);
+  }
+  // bodies below the threshold are staged and released right away
+  framer->Send(ReplyHeader{0, 20}, &small[0]->buffer);
+  EXPECT_TRUE(small[0]->released);
+  EXPECT_FALSE(bodies[0]->released);
+
+  Receiver receiver(receiver_fd);
+  Pump(*framer, receiver, bodies);
+  receiver.Decode();
+  for (const auto& body : bodies) {
+    EXPECT_TRUE(body->released);
+  }
+  EXPECT_EQ(receiver.types, std::vector<uint16_t>({1, 10, 11, 12, 20}));
+  EXPECT_TRUE(receiver.intact);
+  EXPECT_EQ(receiver.body_bytes, 2 + 3 * 1024 * 1024 + 512);
+
+  const SenderStats& stats = framer->sender().stats();
+  if (framer->sender().zerocopy_enabled()) {
+    EXPECT_GT(stats.zerocopy_sends, 0);
+    EXPECT_EQ(stats.zerocopy_completions, stats.zerocopy_sends);
+    if (stats.zerocopy_fallbacks == 0) {
+      EXPECT_EQ(stats.zerocopy_bytes, 3 * 1024 * 1024);
+    }
+    EXPECT_EQ(framer->sender().inflight_bodies(), 0);
+  } else {
+    EXPECT_EQ(stats.zerocopy_sends, 0);
+  }
+  framer.reset();
+  close(sender_fd);
+  close(receiver_fd);
+}
+
+TEST(OutboundFramer, large_bodies_without_zerocopy_support) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  SenderOptions options;
+  options.zerocopy_threshold = 16 * 1024;
+  OutboundFramer<ReplyHeader> framer(fds[0], options);
+  // unix sockets cannot pin pages, large bodies are written from the caller's buffer
+  EXPECT_FALSE(framer.sender().zerocopy_enabled());
+  auto bodies = MakeBodies(30, 2, 256 * 1024);
+  for (auto& body : bodies) {
+    framer.Send(ReplyHeader{0, static_cast<uint16_t>(body->storage[0])}, &body->buffer);
+  }
+  Receiver receiver(fds[1]);
+  Pump(framer, receiver, bodies);
+  receiver.Decode();
+  EXPECT_TRUE(bodies[0]->released);
+  EXPECT_TRUE(bodies[1]->released);
+  EXPECT_EQ(receiver.types, std::vector<uint16_t>({30, 31}));
+  EXPECT_TRUE(receiver.intact);
+  EXPECT_EQ(framer.sender().stats().zerocopy_sends, 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(OutboundFramer, queued_bodies_released_on_destruction) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  auto bodies = MakeBodies(0, 1, 128 * 1024);
+  {
+    OutboundFramer<ReplyHeader> framer(fds[0]);
+    framer.Send(ReplyHeader{0, 0}, &bodies[0]->buffer);
+    EXPECT_FALSE(bodies[0]->released);
+  }
+  // never handed to the kernel
+  EXPECT_TRUE(bodies[0]->released);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+namespace {
+std::atomic<bool> peer_reading{false};
+std::atomic<bool> released_while_reading{false};
+
+void MarkReleasedWhileReading(OutboundBuffer* buffer) {
+  released_while_reading = peer_reading.load();
+  MarkReleased(buffer);
+}
+}  // namespace
+
+TEST(OutboundFramer, inflight_bodies_released_on_completion) {
+  int sender_fd = -1;
+  int receiver_fd = -1;
+  if (!TcpPair(sender_fd, receiver_fd)) {
+    GTEST_SKIP() << "no loopback TCP";
+  }
+  fcntl(sender_fd, F_SETFL, fcntl(sender_fd, F_GETFL) | O_NONBLOCK);
+  SenderOptions options;
+  options.zerocopy_threshold = 16 * 1024;
+  auto framer = std::make_unique<OutboundFramer<ReplyHeader>>(sender_fd, options);
+  if (!framer->sender().zerocopy_enabled()) {
+    framer.reset();
+    close(sender_fd);
+    close(receiver_fd);
+    GTEST_SKIP() << "no MSG_ZEROCOPY";
+  }
+  auto bodies = MakeBodies(0, 1, 256 * 1024);
+  bodies[0]->buffer.release = MarkReleasedWhileReading;
+  framer->Send(ReplyHeader{0, 0}, &bodies[0]->buffer);
+  EXPECT_FALSE(framer->Flush());
+  ASSERT_EQ(framer->sender().inflight_bodies(), 1);
+  EXPECT_FALSE(bodies[0]->released);
+
+  // the peer reads late, the destructor waits for the completion instead of releasing at once
+  peer_reading = false;
+  std::thread peer([receiver_fd]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    peer_reading = true;
+    Receiver receiver(receiver_fd);
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (receiver.stream.size() < sizeof(ReplyHeader) + 256 * 1024 &&
+           std::chrono::steady_clock::now() < deadline) {
+      receiver.Poll();
+    }
+  });
+  framer.reset();
+  EXPECT_TRUE(bodies[0]->released);
+  EXPECT_TRUE(released_while_reading);
+  peer.join();
+  close(sender_fd);
+  close(receiver_fd);
+}
+
+TEST(OutboundFramer, inflight_bodies_kept_without_completion) {
+  int sender_fd = -1;
+  int receiver_fd = -1;
+  if (!TcpPair(sender_fd, receiver_fd)) {
+    GTEST_SKIP() << "no loopback TCP";
+  }
+  fcntl(sender_fd, F_SETFL, fcntl(sender_fd, F_GETFL) | O_NONBLOCK);
+  SenderOptions options;
+  options.zerocopy_threshold = 16 * 1024;
+  options.completion_wait_ms = 20;
+  auto framer = std::make_unique<OutboundFramer<ReplyHeader>>(sender_fd, options);
+  if (!framer->sender().zerocopy_enabled()) {
+    framer.reset();
+    close(sender_fd);
+    close(receiver_fd);
+    GTEST_SKIP() << "no MSG_ZEROCOPY";
+  }
+  auto bodies = MakeBodies(0, 1, 256 * 1024);
+  framer->Send(ReplyHeader{0, 0}, &bodies[0]->buffer);
+  EXPECT_FALSE(framer->Flush());
+  ASSERT_EQ(framer->sender().inflight_bodies(), 1);
+  // the peer never reads, the kernel still holds the pages when the wait ends
+  framer.reset();
+  EXPECT_FALSE(bodies[0]->released);
+  close(sender_fd);
+  close(receiver_fd);
+}
+
+TEST(OutboundFramer, cork_flushes_on_size_and_batch_end) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  SenderOptions options;
+  options.cork.enabled = true;
+  options.cork.flush_bytes = 1000;
+  options.cork.max_delay_us = 10 * 1000 * 1000;
+  OutboundFramer<ReplyHeader> framer(fds[0], options);
+  std::vector<uint8_t> body(100 - sizeof(ReplyHeader), 0);
+  // 100 bytes per frame, the tenth frame reaches the threshold
+  for (uint16_t msg_type = 0; msg_type < 25; ++msg_type) {
+    EXPECT_FALSE(framer.Send(ReplyHeader{0, 0}, body.data(), static_cast<uint32_t>(body.size())));
+  }
+  const SenderStats& stats = framer.sender().stats();
+  EXPECT_EQ(stats.cork_size_flushes, 2);
+  EXPECT_EQ(stats.syscalls, 2);
+  EXPECT_EQ(framer.sender().pending_bytes(), 500);
+  EXPECT_GT(framer.sender().flush_deadline_ns(), 0);
+
+  EXPECT_FALSE(framer.EndBatch());
+  EXPECT_EQ(stats.cork_batch_flushes, 1);
+  EXPECT_EQ(stats.syscalls, 3);
+  EXPECT_EQ(stats.syscalls_saved, 22);
+  EXPECT_EQ(framer.sender().pending_bytes(), 0);
+  EXPECT_EQ(framer.sender().flush_deadline_ns(), 0);
+
+  Receiver receiver(fds[1]);
+  receiver.Poll();
+  receiver.Decode();
+  EXPECT_EQ(receiver.types.size(), 25);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(OutboundFramer, cork_deadline) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  OutboundFramer<ReplyHeader> framer(fds[0]);
+  CorkPolicy policy;
+  policy.enabled = true;
+  policy.max_delay_us = 2000;
+  framer.sender().SetCorkPolicy(policy);
+  const uint8_t body[4] = {};
+  EXPECT_FALSE(framer.Send(ReplyHeader{0, 0}, body, sizeof(body)));
+  const uint64_t deadline = framer.sender().flush_deadline_ns();
+  EXPECT_GE(deadline, FrameSender::NowNs());
+  EXPECT_FALSE(framer.sender().FlushIfDue(deadline - 1));
+  EXPECT_EQ(framer.sender().stats().syscalls, 0);
+
+  // the timer fires at the deadline
+  EXPECT_FALSE(framer.sender().FlushIfDue(deadline));
+  const SenderStats& stats = framer.sender().stats();
+  EXPECT_EQ(stats.cork_deadline_flushes, 1);
+  EXPECT_EQ(stats.syscalls, 1);
+  EXPECT_EQ(stats.cork_delay_ns, 2000 * 1000);
+  EXPECT_EQ(stats.max_cork_delay_ns, 2000 * 1000);
+
+  // a frame queued after the deadline of the older ones flushes them all
+  EXPECT_FALSE(framer.Send(ReplyHeader{0, 1}, body, sizeof(body)));
+  std::this_thread::sleep_for(std::chrono::milliseconds(3));
+  EXPECT_FALSE(framer.Send(ReplyHeader{0, 2}, body, sizeof(body)));
+  EXPECT_EQ(stats.cork_deadline_flushes, 2);
+  EXPECT_EQ(stats.syscalls, 2);
+  EXPECT_EQ(stats.syscalls_saved, 1);
+  EXPECT_GE(stats.max_cork_delay_ns, 3000 * 1000);
+
+  Receiver receiver(fds[1]);
+  receiver.Poll();
+  receiver.Decode();
+  EXPECT_EQ(receiver.types, std::vector<uint16_t>({0, 1, 2}));
+  close(fds[0]);
+  close(fds[1]);
+}
@@ -0,0 +1,268 @@
+#include "packet_capture.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+constexpr uint32_t kEthernetHeaderLength = 14;
+constexpr uint32_t kVlanTagLength = 4;
+constexpr uint16_t kEtherTypeVlan = 0x8100;
+constexpr uint16_t kEtherTypeQinQ = 0x88a8;
+
+uint16_t Load16(const uint8_t* p) {
+  uint16_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return ntohs(value);
+}
+
+uint32_t Load32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return ntohl(value);
+}
+
+std::error_code LastError() { return std::error_code(errno, std::system_category()); }
+}  // namespace
+
+bool DecodeTcpPacket(const uint8_t* frame, uint32_t captured, TcpPacket& packet) {
+  if (captured < kEthernetHeaderLength) {
+    return false;
+  }
+  uint32_t offset = kEthernetHeaderLength;
+  uint16_t ether_type = Load16(frame + 12);
+  while ((ether_type == kEtherTypeVlan || ether_type == kEtherTypeQinQ) &&
+         offset + kVlanTagLength <= captured) {
+    ether_type = Load16(frame + offset + 2);
+    offset += kVlanTagLength;
+  }
+  // the IP payload ends where the IP length says, ignoring Ethernet padding
+  uint32_t ip_end = 0;
+  FlowKey& flow = packet.flow;
+  if (ether_type == ETH_P_IP) {
+    if (offset + sizeof(iphdr) > captured) {
+      return false;
+    }
+    const uint8_t* ip = frame + offset;
+    const uint32_t header_length = (ip[0] & 0x0f) * 4u;
+    const uint16_t fragment = Load16(ip + 6);
+    if ((ip[0] >> 4) != 4 || header_length < sizeof(iphdr) || ip[9] != IPPROTO_TCP ||
+        (fragment & (IP_MF | IP_OFFMASK)) != 0) {
+      return false;
+    }
+    ip_end = offset + Load16(ip + 2);
+    flow.family = AF_INET;
+    std::memcpy(flow.src_addr, ip + 12, 4);
+    std::memcpy(flow.dst_addr, ip + 16, 4);
+    offset += header_length;
+  } else if (ether_type == ETH_P_IPV6) {
+    if (offset + sizeof(ip6_hdr) > captured) {
+      return false;
+    }
+    const uint8_t* ip = frame + offset;
+    if ((ip[0] >> 4) != 6 || ip[6] != IPPROTO_TCP) {
+      return false;
+    }
+    ip_end = offset + sizeof(ip6_hdr) + Load16(ip + 4);
+    flow.family = AF_INET6;
+    std::memcpy(flow.src_addr, ip + 8, 16);
+    std::memcpy(flow.dst_addr, ip + 24, 16);
+    offset += sizeof(ip6_hdr);
+  } else {
+    return false;
+  }
+  if (offset + sizeof(tcphdr) > captured || offset + sizeof(tcphdr) > ip_end) {
+    return false;
+  }
+  const uint8_t* tcp = frame + offset;
+  const uint32_t header_length = (tcp[12] >> 4) * 4u;
+  if (header_length < sizeof(tcphdr) || offset + header_length > ip_end) {
+    return false;
+  }
+  flow.src_port = Load16(tcp);
+  flow.dst_port = Load16(tcp + 2);
+  packet.seq = Load32(tcp + 4);
+  packet.flags = tcp[13];
+  offset += header_length;
+  packet.payload = frame + offset;
+  packet.truncated = ip_end > captured;
+  packet.payload_length = (packet.truncated ? captured : ip_end) - offset;
+  return true;
+}
+
+bool TcpStream::Accept(uint32_t seq, const uint8_t* payload, uint32_t length,
+                       const uint8_t*& in_order, uint32_t& in_order_length) {
+  in_order = nullptr;
+  in_order_length = 0;
+  const int64_t offset = OffsetOf(seq);
+  const auto position = static_cast<int64_t>(next_offset_);
+  if (offset + length <= position) {
+    retransmitted_bytes_ += length;
+    return true;
+  }
+  if (offset > position) {
+    ++out_of_order_segments_;
+    auto& kept = reorder_[static_cast<uint64_t>(offset)];
+    if (kept.size() >= length) {
+      retransmitted_bytes_ += length;
+      return true;
+    }
+    if (reorder_bytes_ - kept.size() + length > max_reorder_bytes_) {
+      if (kept.empty()) {
+        reorder_.erase(static_cast<uint64_t>(offset));
+      }
+      return false;
+    }
+    reorder_bytes_ += length - static_cast<uint32_t>(kept.size());
+    kept.assign(payload, payload + length);
+    return true;
+  }
+  // the front of the segment may repeat bytes already seen
+  const auto repeated = static_cast<uint32_t>(position - offset);
+  retransmitted_bytes_ += repeated;
+  in_order = payload + repeated;
+  in_order_length = length - repeated;
+  Advance(in_order_length);
+  return true;
+}
+
+bool TcpStream::PopContiguous(std::vector<uint8_t>& data) {
+  while (!reorder_.empty()) {
+    auto it = reorder_.begin();
+    if (it->first > next_offset_) {
+      return false;
+    }
+    const auto length = static_cast<uint32_t>(it->second.size());
+    const uint64_t end = it->first + length;
+    reorder_bytes_ -= length;
+    if (end <= next_offset_) {
+      retransmitted_bytes_ += length;
+      reorder_.erase(it);
+      continue;
+    }
+    const auto repeated = static_cast<uint32_t>(next_offset_ - it->first);
+    retransmitted_bytes_ += repeated;
+    data = std::move(it->second);
+    data.erase(data.begin(), data.begin() + repeated);
+    reorder_.erase(it);
+    Advance(length - repeated);
+    return true;
+  }
+  return false;
+}
+
+std::error_code PacketRing::Open(const CaptureOptions& options) {
+  Close();
+  fd_ = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd_ < 0) {
+    return LastError();
+  }
+  auto fail = [this]() {
+    auto err = LastError();
+    Close();
+    return err;
+  };
+  int version = TPACKET_V3;
+  if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+    return fail();
+  }
+  tpacket_req3 req{};
+  req.tp_block_size = options.block_size;
+  req.tp_block_nr = options.block_count;
+  req.tp_frame_size = TPACKET_ALIGN(options.frame_size);
+  req.tp_frame_nr = options.block_size / req.tp_frame_size * options.block_count;
+  req.tp_retire_blk_tov = options.block_timeout_ms;
+  if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    return fail();
+  }
+  map_length_ = static_cast<size_t>(options.block_size) * options.block_count;
+  void* map = mmap(nullptr, map_length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    map_length_ = 0;
+    return fail();
+  }
+  map_ = static_cast<uint8_t*>(map);
+  block_size_ = options.block_size;
+  block_count_ = options.block_count;
+  next_block_ = 0;
+
+  sockaddr_ll addr{};
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = static_cast<int>(if_nametoindex(options.interface.c_str()));
+  if (addr.sll_ifindex == 0) {
+    return fail();
+  }
+  if (bind(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
+    return fail();
+  }
+  // counters of packets seen before the ring existed are meaningless
+  CaptureStats discarded;
+  ReadKernelStats(discarded);
+  return std::error_code();
+}
+
+void PacketRing::Close() {
+  if (map_ != nullptr) {
+    munmap(map_, map_length_);
+    map_ = nullptr;
+    map_length_ = 0;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  taken_.clear();
+}
+
+bool PacketRing::Wait(int timeout_ms) {
+  pollfd pfd{fd_, POLLIN | POLLERR, 0};
+  int ret = 0;
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while (ret < 0 && errno == EINTR);
+  return ret > 0;
+}
+
+const tpacket_block_desc* PacketRing::NextBlock() {
+  if (map_ == nullptr || taken_.size() == block_count_) {
+    return nullptr;
+  }
+  auto* block = reinterpret_cast<tpacket_block_desc*>(map_ + static_cast<size_t>(next_block_) *
+                                                                 block_size_);
+  // the kernel publishes the packets of a block with its status
+  if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+    return nullptr;
+  }
+  taken_.push_back(block);
+  next_block_ = next_block_ + 1 == block_count_ ? 0 : next_block_ + 1;
+  return block;
+}
+
+void PacketRing::ReleaseBlocks() {
+  for (tpacket_block_desc* block : taken_) {
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  }
+  taken_.clear();
+}
+
+void PacketRing::ReadKernelStats(CaptureStats& stats) {
+  if (fd_ < 0) {
+    return;
+  }
+  tpacket_stats_v3 kernel{};
+  socklen_t length = sizeof(kernel);
+  if (getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &kernel, &length) == 0) {
+    stats.kernel_packets += kernel.tp_packets;
+    stats.kernel_drops += kernel.tp_drops;
+    stats.kernel_freezes += kernel.tp_freeze_q_cnt;
+  }
+}
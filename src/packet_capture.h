@@ -0,0 +1,496 @@
+/**
+ * @file packet_capture.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_PACKET_CAPTURE_H_
+#define SRC_PACKET_CAPTURE_H_
+
+#include <linux/if_packet.h>
+#include <netinet/tcp.h>
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "body_hash.h"
+#include "segment_chain.h"
+#include "streaming_parser.h"
+
+/// @brief One direction of a TCP connection. Addresses are IPv4 (in the first 4 bytes) or IPv6,
+/// in network byte order; ports are in host byte order.
+struct FlowKey {
+  uint8_t src_addr[16] = {};
+  uint8_t dst_addr[16] = {};
+  uint16_t src_port = 0;
+  uint16_t dst_port = 0;
+  uint8_t family = 0;  // AF_INET or AF_INET6
+  uint8_t reserved[3] = {};
+
+  bool operator==(const FlowKey& other) const {
+    return std::memcmp(this, &other, sizeof(*this)) == 0;
+  }
+};
+
+struct FlowKeyHash {
+  size_t operator()(const FlowKey& key) const {
+    return static_cast<size_t>(
+        BodyHasher::Hash(reinterpret_cast<const uint8_t*>(&key), sizeof(key)));
+  }
+};
+
+/// @brief The TCP segment of a captured frame.
+struct TcpPacket {
+  FlowKey flow;
+  uint32_t seq = 0;
+  uint8_t flags = 0;  // TH_SYN, TH_FIN, TH_RST, ...
+  const uint8_t* payload = nullptr;
+  uint32_t payload_length = 0;
+  /// @brief The capture holds less of the payload than the packet carried.
+  bool truncated = false;
+};
+
+/// @brief Decode an Ethernet frame (optionally VLAN tagged) carrying IPv4 or IPv6 and TCP. Returns
+/// false for any other frame, IP fragments and IPv6 extension headers included.
+bool DecodeTcpPacket(const uint8_t* frame, uint32_t captured, TcpPacket& packet);
+
+struct CaptureOptions {
+  std::string interface = "lo";
+  /// @brief Geometry of the mmap ring: `block_count` blocks of `block_size` bytes (a multiple of
+  /// the page size), each holding variable sized packets.
+  uint32_t block_size = 1 << 20;
+  uint32_t block_count = 64;
+  /// @brief Upper bound of a captured packet, the snap length.
+  uint32_t frame_size = 1 << 16;
+  /// @brief A partially filled block is handed to user space after this many milliseconds.
+  uint32_t block_timeout_ms = 10;
+  /// @brief Blocks processed by `Poll` before they are handed back to the kernel together.
+  uint32_t release_batch = 8;
+  /// @brief Skip packets the host sends. On loopback every packet is seen sent and received.
+  bool ignore_outgoing = false;
+  /// @brief Start following a connection at its first captured segment rather than its SYN. The
+  /// parser then has to start at a frame boundary by luck.
+  bool start_mid_stream = false;
+  /// @brief Bytes of out-of-order segments kept per flow, a flow needing more is abandoned.
+  uint32_t max_reorder_bytes = 1 << 20;
+};
+
+struct CaptureStats {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;  // as on the wire
+  uint64_t blocks = 0;
+  /// @brief The kernel's count of packets it passed to the ring and of packets it dropped because
+  /// the ring was full.
+  uint64_t kernel_packets = 0;
+  uint64_t kernel_drops = 0;
+  uint64_t kernel_freezes = 0;
+  uint64_t non_tcp_packets = 0;
+  uint64_t truncated_packets = 0;
+  /// @brief TCP packets of connections not followed, e.g. whose SYN was not captured.
+  uint64_t unfollowed_packets = 0;
+  uint64_t flows_opened = 0;
+  uint64_t flows_closed = 0;
+  /// @brief Flows given up because of a hole in the stream (reorder limit, truncated capture) or
+  /// a full parser ring.
+  uint64_t flows_abandoned = 0;
+};
+
+struct FlowStats {
+  uint64_t bytes = 0;  // payload bytes passed to the parser
+  uint64_t segments = 0;
+  uint64_t out_of_order_segments = 0;
+  uint64_t retransmitted_bytes = 0;
+  uint64_t first_ns = 0;  // capture timestamps of the first and last segment
+  uint64_t last_ns = 0;
+  uint64_t parse_ns = 0;  // time spent in the parser
+  bool abandoned = false;
+
+  /// @brief Parser throughput, bytes per second of parse time.
+  double parse_bytes_per_second() const { return parse_ns > 0 ? bytes * 1e9 / parse_ns : 0; }
+  /// @brief Flow throughput, bytes per second of capture time.
+  double wire_bytes_per_second() const {
+    return last_ns > first_ns ? bytes * 1e9 / (last_ns - first_ns) : 0;
+  }
+};
+
+/// @brief Places the segments of one direction of a TCP connection in stream order. The part of a
+/// segment that continues the stream is returned in place; segments ahead of it are copied and
+/// kept until the hole before them is filled. Sequence numbers are widened to 64-bit stream
+/// offsets, so wraparound needs no special case.
+class TcpStream final {
+ public:
+  explicit TcpStream(uint32_t max_reorder_bytes) : max_reorder_bytes_(max_reorder_bytes) {}
+
+  /// @brief Start the stream at `seq`, the sequence number of its first payload byte.
+  void Start(uint32_t seq) { next_seq_ = seq; }
+
+  /// @brief Place a segment. Sets `in_order` to the bytes of `payload` that continue the stream,
+  /// if any. Returns false when keeping it would exceed the reorder limit.
+  bool Accept(uint32_t seq, const uint8_t* payload, uint32_t length, const uint8_t*& in_order,
+              uint32_t& in_order_length);
+
+  /// @brief Take the next kept segment made contiguous by the bytes accepted so far, trimmed to
+  /// continue the stream. Returns false when there is none.
+  bool PopContiguous(std::vector<uint8_t>& data);
+
+  /// @brief The stream offset of `seq`, negative before the start of the stream.
+  int64_t OffsetOf(uint32_t seq) const {
+    return static_cast<int64_t>(next_offset_) + static_cast<int32_t>(seq - next_seq_);
+  }
+
+  /// @brief Stream offset of the next expected byte.
+  uint64_t position() const { return next_offset_; }
+  uint32_t reorder_bytes() const { return reorder_bytes_; }
+  uint64_t out_of_order_segments() const { return out_of_order_segments_; }
+  uint64_t retransmitted_bytes() const { return retransmitted_bytes_; }
+
+ private:
+  void Advance(uint32_t length) {
+    next_offset_ += length;
+    next_seq_ += length;
+  }
+
+  uint32_t next_seq_ = 0;
+  uint64_t next_offset_ = 0;
+  std::map<uint64_t, std::vector<uint8_t>> reorder_;  // kept segments by stream offset
+  uint32_t reorder_bytes_ = 0;
+  uint32_t max_reorder_bytes_;
+  uint64_t out_of_order_segments_ = 0;
+  uint64_t retransmitted_bytes_ = 0;
+};
+
+/// @brief An AF_PACKET socket with a TPACKET_V3 receive ring mapped into user space. The kernel
+/// fills blocks of packets; a block taken with `NextBlock` is owned by user space until
+/// `ReleaseBlocks` hands every taken block back at once.
+class PacketRing final {
+ public:
+  PacketRing() = default;
+  PacketRing(const PacketRing&) = delete;
+  PacketRing& operator=(const PacketRing&) = delete;
+  ~PacketRing() { Close(); }
+
+  /// @brief Open the ring on `options.interface`. Needs CAP_NET_RAW.
+  std::error_code Open(const CaptureOptions& options);
+  void Close();
+
+  /// @brief Wait up to `timeout_ms` for a block. Returns whether one is ready.
+  bool Wait(int timeout_ms);
+
+  /// @brief The next block filled by the kernel, or nullptr.
+  const tpacket_block_desc* NextBlock();
+
+  /// @brief Hand every block taken by `NextBlock` back to the kernel.
+  void ReleaseBlocks();
+
+  /// @brief Add the kernel's packet and drop counters, which it resets on each read, to `stats`.
+  void ReadKernelStats(CaptureStats& stats);
+
+  /// @brief Call `fn(frame, captured, wire_length, timestamp_ns, outgoing)` for each packet of
+  /// `block`. Returns the number of packets.
+  template <typename Fn>
+  static uint32_t ForEachPacket(const tpacket_block_desc* block, Fn&& fn);
+
+  bool is_open() const { return fd_ >= 0; }
+  int fd() const { return fd_; }
+
+ private:
+  int fd_ = -1;
+  uint8_t* map_ = nullptr;
+  size_t map_length_ = 0;
+  uint32_t block_size_ = 0;
+  uint32_t block_count_ = 0;
+  uint32_t next_block_ = 0;
+  std::vector<tpacket_block_desc*> taken_;
+};
+
+template <typename Fn>
+uint32_t PacketRing::ForEachPacket(const tpacket_block_desc* block, Fn&& fn) {
+  const uint32_t count = block->hdr.bh1.num_pkts;
+  const auto* base = reinterpret_cast<const uint8_t*>(block);
+  const auto* hdr =
+      reinterpret_cast<const tpacket3_hdr*>(base + block->hdr.bh1.offset_to_first_pkt);
+  for (uint32_t i = 0; i < count; ++i) {
+    const auto* raw = reinterpret_cast<const uint8_t*>(hdr);
+    const auto* sll = reinterpret_cast<const sockaddr_ll*>(raw + TPACKET_ALIGN(sizeof(*hdr)));
+    fn(raw + hdr->tp_mac, hdr->tp_snaplen, hdr->tp_len,
+       static_cast<uint64_t>(hdr->tp_sec) * 1000000000ull + hdr->tp_nsec,
+       sll->sll_pkttype == PACKET_OUTGOING);
+    hdr = reinterpret_cast<const tpacket3_hdr*>(raw + hdr->tp_next_offset);
+  }
+  return count;
+}
+
+/// @brief Passive ingestion of captured traffic: reads blocks from a `PacketRing`, reassembles
+/// each TCP flow and feeds it to a parser of its own.
+///
+/// In-order payload is passed to the parser in place, as an input segment borrowing the ring
+/// memory, so frames inside a packet are delivered without any copy. Only the bytes of a frame
+/// left incomplete at the end of a batch of blocks are copied into the parser's ring, right before
+/// the blocks are released; out-of-order segments are copied once when kept. A flow (one direction
+/// of a connection) is followed from its SYN and closed at its FIN or RST.
+/// @tparam ProtoHeader The protocol header struct type.
+template <typename ProtoHeader>
+class CaptureDriver {
+ public:
+  using Parser = StreamingParser<ProtoHeader>;
+  /// @brief Creates the parser of a new flow, nullptr to not follow it.
+  using ParserFactory = std::function<std::unique_ptr<Parser>(const FlowKey& flow)>;
+  using FlowClosedHandler = std::function<void(const FlowKey& flow, const FlowStats& stats)>;
+
+  explicit CaptureDriver(ParserFactory&& factory, const CaptureOptions& options = CaptureOptions())
+      : factory_(std::move(factory)), options_(options) {}
+  CaptureDriver(const CaptureDriver&) = delete;
+  CaptureDriver& operator=(const CaptureDriver&) = delete;
+
+  /// @brief Open the capture ring.
+  std::error_code Open() { return ring_.Open(options_); }
+
+  void SetFlowClosedHandler(FlowClosedHandler&& handler) { closed_handler_ = std::move(handler); }
+
+  /// @brief Wait up to `timeout_ms` for captured blocks, process up to `release_batch` of them and
+  /// release them. Returns the number of packets processed.
+  size_t Poll(int timeout_ms);
+
+  /// @brief Process one captured Ethernet frame, of which `captured` bytes are available. The
+  /// frame memory is borrowed until `ReleasePackets`; `Poll` uses this for every ring packet, it
+  /// can be fed synthetic or replayed frames directly.
+  void ProcessPacket(const uint8_t* frame, uint32_t captured, uint32_t wire_length,
+                     uint64_t timestamp_ns);
+
+  /// @brief Copy out the bytes the parsers still borrow from the processed packets and finish the
+  /// flows closed meanwhile. The packet memory can be reused afterwards.
+  void ReleasePackets();
+
+  /// @brief Capture counters, the kernel ones as of the last `Poll`.
+  const CaptureStats& stats() const { return stats_; }
+
+  /// @brief Counters of a followed flow, nullptr when it is not followed.
+  const FlowStats* flow_stats(const FlowKey& flow);
+
+  /// @brief Call `fn(key, stats)` for each followed flow.
+  template <typename Fn>
+  void ForEachFlow(Fn&& fn);
+
+  size_t flow_count() const { return flows_.size(); }
+
+ private:
+  struct Flow {
+    Flow(const FlowKey& flow_key, uint32_t max_reorder_bytes)
+        : key(flow_key), stream(max_reorder_bytes) {}
+    FlowKey key;
+    std::unique_ptr<Parser> parser;
+    TcpStream stream;
+    FlowStats stats;
+    int64_t fin_offset = -1;  // stream offset of the FIN, once seen
+    bool touched = false;     // in `touched_`
+    bool closing = false;
+  };
+
+  Flow* OpenFlow(const TcpPacket& packet);
+  void Deliver(Flow& flow, const TcpPacket& packet, uint64_t timestamp_ns);
+  void Touch(Flow& flow) {
+    if (!flow.touched) {
+      flow.touched = true;
+      touched_.push_back(&flow);
+    }
+  }
+  void Abandon(Flow& flow) {
+    flow.stats.abandoned = true;
+    flow.closing = true;
+    Touch(flow);
+  }
+  void SyncStreamStats(Flow& flow) {
+    flow.stats.out_of_order_segments = flow.stream.out_of_order_segments();
+    flow.stats.retransmitted_bytes = flow.stream.retransmitted_bytes();
+  }
+
+  ParserFactory factory_;
+  CaptureOptions options_;
+  PacketRing ring_;
+  FlowClosedHandler closed_handler_;
+  std::unordered_map<FlowKey, std::unique_ptr<Flow>, FlowKeyHash> flows_;
+  std::vector<Flow*> touched_;       // flows given packets since the last release
+  std::deque<InputSegment> segments_;  // borrowed payloads, stable until the release
+  std::vector<uint8_t> reorder_scratch_;
+  CaptureStats stats_;
+};
+
+template <typename ProtoHeader>
+size_t CaptureDriver<ProtoHeader>::Poll(int timeout_ms) {
+  const tpacket_block_desc* block = ring_.NextBlock();
+  if (block == nullptr) {
+    if (!ring_.Wait(timeout_ms) || (block = ring_.NextBlock()) == nullptr) {
+      ring_.ReadKernelStats(stats_);
+      return 0;
+    }
+  }
+  size_t packets = 0;
+  for (uint32_t blocks = 0; block != nullptr;) {
+    ++stats_.blocks;
+    packets += PacketRing::ForEachPacket(
+        block, [this](const uint8_t* frame, uint32_t captured, uint32_t wire_length,
+                      uint64_t timestamp_ns, bool outgoing) {
+          if (!outgoing || !options_.ignore_outgoing) {
+            ProcessPacket(frame, captured, wire_length, timestamp_ns);
+          }
+        });
+    block = ++blocks < options_.release_batch ? ring_.NextBlock() : nullptr;
+  }
+  ReleasePackets();
+  ring_.ReleaseBlocks();
+  ring_.ReadKernelStats(stats_);
+  return packets;
+}
+
+template <typename ProtoHeader>
+void CaptureDriver<ProtoHeader>::ProcessPacket(const uint8_t* frame, uint32_t captured,
+                                               uint32_t wire_length, uint64_t timestamp_ns) {
+  ++stats_.packets;
+  stats_.bytes += wire_length;
+  TcpPacket packet;
+  if (!DecodeTcpPacket(frame, captured, packet)) {
+    ++stats_.non_tcp_packets;
+    return;
+  }
+  if (packet.truncated) {
+    ++stats_.truncated_packets;
+  }
+  Flow* flow = nullptr;
+  auto it = flows_.find(packet.flow);
+  if (it != flows_.end()) {
+    flow = it->second.get();
+  } else if ((packet.flags & TH_SYN) != 0 || options_.start_mid_stream) {
+    flow = OpenFlow(packet);
+  }
+  if (flow == nullptr) {
+    ++stats_.unfollowed_packets;
+    return;
+  }
+  if (flow->closing) {
+    // retransmissions after the end of the stream
+    return;
+  }
+  if (packet.truncated) {
+    // the stream has a hole that will never be filled
+    Abandon(*flow);
+    return;
+  }
+  Deliver(*flow, packet, timestamp_ns);
+}
+
+template <typename ProtoHeader>
+typename CaptureDriver<ProtoHeader>::Flow* CaptureDriver<ProtoHeader>::OpenFlow(
+    const TcpPacket& packet) {
+  std::unique_ptr<Parser> parser = factory_(packet.flow);
+  if (parser == nullptr) {
+    return nullptr;
+  }
+  auto flow = std::make_unique<Flow>(packet.flow, options_.max_reorder_bytes);
+  flow->parser = std::move(parser);
+  // the SYN takes one sequence number
+  flow->stream.Start((packet.flags & TH_SYN) != 0 ? packet.seq + 1 : packet.seq);
+  ++stats_.flows_opened;
+  Flow* raw = flow.get();
+  flows_.emplace(packet.flow, std::move(flow));
+  return raw;
+}
+
+template <typename ProtoHeader>
+void CaptureDriver<ProtoHeader>::Deliver(Flow& flow, const TcpPacket& packet,
+                                         uint64_t timestamp_ns) {
+  FlowStats& stats = flow.stats;
+  if (stats.first_ns == 0) {
+    stats.first_ns = timestamp_ns;
+  }
+  stats.last_ns = timestamp_ns;
+  const uint32_t seq = (packet.flags & TH_SYN) != 0 ? packet.seq + 1 : packet.seq;
+  if ((packet.flags & TH_FIN) != 0) {
+    flow.fin_offset = flow.stream.OffsetOf(seq) + packet.payload_length;
+  }
+  if (packet.payload_length > 0) {
+    ++stats.segments;
+    const uint8_t* in_order = nullptr;
+    uint32_t in_order_length = 0;
+    if (!flow.stream.Accept(seq, packet.payload, packet.payload_length, in_order,
+                            in_order_length)) {
+      Abandon(flow);
+      return;
+    }
+    const uint64_t start_ns = MonotonicNowNs();
+    if (in_order_length > 0) {
+      InputSegment& segment = segments_.emplace_back();
+      segment.data = in_order;
+      segment.length = in_order_length;
+      flow.parser->HandleSegments(&segment);
+      stats.bytes += in_order_length;
+      Touch(flow);
+    }
+    while (flow.stream.PopContiguous(reorder_scratch_)) {
+      const auto length = static_cast<uint32_t>(reorder_scratch_.size());
+      if (!flow.parser->HandleData(reorder_scratch_.data(), length)) {
+        Abandon(flow);
+        break;
+      }
+      stats.bytes += length;
+    }
+    stats.parse_ns += MonotonicNowNs() - start_ns;
+    SyncStreamStats(flow);
+  }
+  if ((packet.flags & TH_RST) != 0 ||
+      (flow.fin_offset >= 0 && static_cast<int64_t>(flow.stream.position()) >= flow.fin_offset)) {
+    flow.closing = true;
+    Touch(flow);
+  }
+}
+
+template <typename ProtoHeader>
+void CaptureDriver<ProtoHeader>::ReleasePackets() {
+  for (Flow* flow : touched_) {
+    flow->touched = false;
+    if (!flow->closing && !flow->parser->DetachSegments()) {
+      flow->stats.abandoned = true;
+      flow->closing = true;
+    }
+  }
+  // closed flows drop their parser, and with it any segments it still borrows
+  for (Flow* flow : touched_) {
+    if (!flow->closing) {
+      continue;
+    }
+    ++(flow->stats.abandoned ? stats_.flows_abandoned : stats_.flows_closed);
+    SyncStreamStats(*flow);
+    if (closed_handler_) {
+      closed_handler_(flow->key, flow->stats);
+    }
+    flows_.erase(flow->key);
+  }
+  touched_.clear();
+  segments_.clear();
+}
+
+template <typename ProtoHeader>
+const FlowStats* CaptureDriver<ProtoHeader>::flow_stats(const FlowKey& flow) {
+  auto it = flows_.find(flow);
+  return it != flows_.end() ? &it->second->stats : nullptr;
+}
+
+template <typename ProtoHeader>
+template <typename Fn>
+void CaptureDriver<ProtoHeader>::ForEachFlow(Fn&& fn) {
+  for (const auto& [key, flow] : flows_) {
+    fn(key, flow->stats);
+  }
+}
+
+#endif  // SRC_PACKET_CAPTURE_H_
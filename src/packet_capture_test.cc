@@ -0,0 +1,290 @@
+#include "packet_capture.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "streaming_parser.h"
+
+struct TapHeader {
+  uint32_t body_length;
+  uint16_t msg_type;
+  uint16_t flags;
+};
+
+namespace {
+using TapParser = StreamingParser<TapHeader>;
+
+void AppendFrame(std::vector<uint8_t>& stream, uint16_t msg_type, uint32_t body_length) {
+  TapHeader header = {};
+  header.body_length = htonl(body_length);
+  header.msg_type = msg_type;
+  const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+  stream.insert(stream.end(), raw, raw + sizeof(header));
+  stream.insert(stream.end(), body_length, static_cast<uint8_t>(msg_type));
+}
+
+void Put16(std::vector<uint8_t>& out, size_t at, uint16_t value) {
+  out[at] = static_cast<uint8_t>(value >> 8);
+  out[at + 1] = static_cast<uint8_t>(value);
+}
+
+void Put32(std::vector<uint8_t>& out, size_t at, uint32_t value) {
+  Put16(out, at, static_cast<uint16_t>(value >> 16));
+  Put16(out, at + 2, static_cast<uint16_t>(value));
+}
+
+/// @brief An Ethernet/IPv4/TCP frame from 10.0.0.1:`src_port` to 10.0.0.2:80.
+std::vector<uint8_t> MakeTcpFrame(uint16_t src_port, uint32_t seq, uint8_t flags,
+                                  const uint8_t* payload = nullptr, uint32_t length = 0) {
+  std::vector<uint8_t> frame(14 + 20 + 20);
+  Put16(frame, 12, 0x0800);
+  frame[14] = 0x45;
+  Put16(frame, 16, static_cast<uint16_t>(20 + 20 + length));
+  frame[23] = IPPROTO_TCP;
+  Put32(frame, 26, 0x0a000001);
+  Put32(frame, 30, 0x0a000002);
+  Put16(frame, 34, src_port);
+  Put16(frame, 36, 80);
+  Put32(frame, 38, seq);
+  frame[46] = 5 << 4;
+  frame[47] = flags;
+  if (payload != nullptr) {
+    frame.insert(frame.end(), payload, payload + length);
+  }
+  return frame;
+}
+
+/// @brief Counts the frames and body bytes of every flow parser it creates.
+struct Collector {
+  uint32_t frames = 0;
+  uint64_t body_bytes = 0;
+  bool bodies_valid = true;
+  uint16_t current_type = 0;
+
+  CaptureDriver<TapHeader>::ParserFactory Factory() {
+    return [this](const FlowKey&) {
+      return std::make_unique<TapParser>(
+          [this](const TapHeader& header) {
+            current_type = header.msg_type;
+            if (header.body_length == 0) {
+              ++frames;
+            }
+            return true;
+          },
+          [this](const uint8_t* data, uint32_t length) {
+            for (uint32_t i = 0; i < length; ++i) {
+              bodies_valid = bodies_valid && data[i] == static_cast<uint8_t>(current_type);
+            }
+            ++frames;
+            body_bytes += length;
+            return true;
+          });
+    };
+  }
+};
+
+/// @brief Feed `frame` from a buffer that is scribbled over once released, like a ring block.
+void Feed(CaptureDriver<TapHeader>& driver, std::vector<uint8_t> frame, uint64_t ts = 1) {
+  driver.ProcessPacket(frame.data(), static_cast<uint32_t>(frame.size()),
+                       static_cast<uint32_t>(frame.size()), ts);
+  driver.ReleasePackets();
+  std::fill(frame.begin(), frame.end(), 0xee);
+}
+}  // namespace
+
+TEST(PacketCapture, decode_tcp_packet) {
+  const uint8_t payload[] = {1, 2, 3};
+  auto frame = MakeTcpFrame(4000, 77, TH_ACK | TH_PUSH, payload, sizeof(payload));
+  frame.insert(frame.end(), 6, 0);  // Ethernet padding is not payload
+  TcpPacket packet;
+  ASSERT_TRUE(DecodeTcpPacket(frame.data(), static_cast<uint32_t>(frame.size()), packet));
+  EXPECT_EQ(packet.flow.family, AF_INET);
+  EXPECT_EQ(packet.flow.src_port, 4000);
+  EXPECT_EQ(packet.flow.dst_port, 80);
+  EXPECT_EQ(packet.flow.dst_addr[3], 2);
+  EXPECT_EQ(packet.seq, 77u);
+  EXPECT_EQ(packet.payload_length, 3u);
+  EXPECT_EQ(packet.payload[2], 3);
+  EXPECT_FALSE(packet.truncated);
+
+  TcpPacket truncated;
+  ASSERT_TRUE(DecodeTcpPacket(frame.data(), 14 + 40 + 1, truncated));
+  EXPECT_TRUE(truncated.truncated);
+  EXPECT_EQ(truncated.payload_length, 1u);
+
+  frame[23] = IPPROTO_UDP;
+  EXPECT_FALSE(DecodeTcpPacket(frame.data(), static_cast<uint32_t>(frame.size()), packet));
+}
+
+TEST(PacketCapture, tcp_stream_reorders_and_trims) {
+  TcpStream stream(100);
+  stream.Start(0xfffffff0u);  // wraps around within the test
+  const uint8_t bytes[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  const uint8_t* in_order = nullptr;
+  uint32_t length = 0;
+  std::vector<uint8_t> kept;
+
+  ASSERT_TRUE(stream.Accept(0xfffffff0u + 10, bytes + 10, 10, in_order, length));
+  EXPECT_EQ(length, 0u);
+  EXPECT_EQ(stream.reorder_bytes(), 10u);
+  ASSERT_TRUE(stream.Accept(0xfffffff0u, bytes, 12, in_order, length));
+  EXPECT_EQ(length, 12u);
+  EXPECT_EQ(in_order, bytes);
+  ASSERT_TRUE(stream.PopContiguous(kept));
+  EXPECT_EQ(std::string(kept.begin(), kept.end()), "mnopqrst");
+  EXPECT_FALSE(stream.PopContiguous(kept));
+  EXPECT_EQ(stream.position(), 20u);
+
+  // a retransmission overlapping the stream position only yields its new bytes
+  ASSERT_TRUE(stream.Accept(0xfffffff0u + 15, bytes + 15, 10, in_order, length));
+  EXPECT_EQ(length, 5u);
+  EXPECT_EQ(in_order[0], 'u');
+  EXPECT_EQ(stream.retransmitted_bytes(), 2u + 5u);
+  EXPECT_EQ(stream.out_of_order_segments(), 1u);
+
+  // over the reorder limit
+  std::vector<uint8_t> big(101);
+  EXPECT_FALSE(stream.Accept(0xfffffff0u + 40, big.data(), 101, in_order, length));
+}
+
+TEST(PacketCapture, reassembles_flows_into_parsers) {
+  std::vector<uint8_t> stream;
+  uint32_t expected_frames = 0;
+  uint64_t expected_body = 0;
+  for (uint32_t i = 0; i < 60; ++i) {
+    const uint32_t body = (i * 37) % 300;
+    AppendFrame(stream, static_cast<uint16_t>(i + 1), body);
+    ++expected_frames;
+    expected_body += body;
+  }
+  Collector collector;
+  CaptureDriver<TapHeader> driver(collector.Factory());
+  std::vector<FlowStats> closed;
+  driver.SetFlowClosedHandler(
+      [&closed](const FlowKey&, const FlowStats& stats) { closed.push_back(stats); });
+
+  const uint32_t isn = 0xffffff00u;
+  Feed(driver, MakeTcpFrame(5000, isn, TH_SYN));
+  EXPECT_EQ(driver.flow_count(), 1u);
+  // segments of 97 bytes, each second pair swapped and one retransmitted
+  std::vector<std::vector<uint8_t>> frames;
+  for (uint32_t offset = 0; offset < stream.size(); offset += 97) {
+    const uint32_t length = std::min<uint32_t>(97, static_cast<uint32_t>(stream.size()) - offset);
+    frames.push_back(MakeTcpFrame(5000, isn + 1 + offset, TH_ACK, stream.data() + offset, length));
+  }
+  for (size_t i = 0; i + 1 < frames.size(); i += 4) {
+    std::swap(frames[i], frames[i + 1]);
+  }
+  frames.insert(frames.begin() + 7, frames[3]);
+  for (const auto& frame : frames) {
+    Feed(driver, frame);
+  }
+  Feed(driver, MakeTcpFrame(5000, isn + 1 + static_cast<uint32_t>(stream.size()), TH_FIN));
+
+  EXPECT_EQ(collector.frames, expected_frames);
+  EXPECT_EQ(collector.body_bytes, expected_body);
+  EXPECT_TRUE(collector.bodies_valid);
+  EXPECT_EQ(driver.flow_count(), 0u);
+  ASSERT_EQ(closed.size(), 1u);
+  EXPECT_EQ(closed[0].bytes, stream.size());
+  EXPECT_GT(closed[0].out_of_order_segments, 0u);
+  EXPECT_EQ(closed[0].retransmitted_bytes, 97u);
+  EXPECT_FALSE(closed[0].abandoned);
+  EXPECT_EQ(driver.stats().flows_closed, 1u);
+}
+
+TEST(PacketCapture, unfollowed_and_abandoned_flows) {
+  Collector collector;
+  CaptureOptions options;
+  options.max_reorder_bytes = 64;
+  CaptureDriver<TapHeader> driver(collector.Factory(), options);
+  const uint8_t payload[100] = {};
+
+  // no SYN captured
+  Feed(driver, MakeTcpFrame(6000, 1, TH_ACK, payload, 10));
+  EXPECT_EQ(driver.stats().unfollowed_packets, 1u);
+  EXPECT_EQ(driver.flow_count(), 0u);
+
+  // a hole the reorder buffer cannot bridge
+  Feed(driver, MakeTcpFrame(6001, 100, TH_SYN));
+  Feed(driver, MakeTcpFrame(6001, 200, TH_ACK, payload, 100));
+  EXPECT_EQ(driver.stats().flows_abandoned, 1u);
+  EXPECT_EQ(driver.flow_count(), 0u);
+
+  std::vector<uint8_t> other(60, 0);
+  other[12] = 0x08;
+  other[13] = 0x06;  // ARP
+  Feed(driver, other);
+  EXPECT_EQ(driver.stats().non_tcp_packets, 1u);
+}
+
+TEST(PacketCapture, live_loopback_capture) {
+  Collector collector;
+  CaptureOptions options;
+  options.interface = "lo";
+  options.block_size = 1 << 16;
+  options.block_count = 16;
+  options.frame_size = 1 << 16;
+  options.block_timeout_ms = 5;
+  options.ignore_outgoing = true;
+  CaptureDriver<TapHeader> driver(collector.Factory(), options);
+  auto err = driver.Open();
+  if (err) {
+    GTEST_SKIP() << "no packet capture here: " << err.message();
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+  socklen_t addr_length = sizeof(addr);
+  ASSERT_EQ(getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_length), 0);
+  ASSERT_EQ(listen(listener, 1), 0);
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+  int server = accept(listener, nullptr, nullptr);
+  ASSERT_GE(server, 0);
+
+  std::vector<uint8_t> stream;
+  for (uint32_t i = 0; i < 200; ++i) {
+    AppendFrame(stream, static_cast<uint16_t>(i % 250 + 1), (i * 53) % 1500);
+  }
+  ASSERT_EQ(send(client, stream.data(), stream.size(), 0), static_cast<ssize_t>(stream.size()));
+  std::vector<uint8_t> sink(stream.size());
+  size_t received = 0;
+  while (received < stream.size()) {
+    const ssize_t n = recv(server, sink.data() + received, sink.size() - received, 0);
+    ASSERT_GT(n, 0);
+    received += static_cast<size_t>(n);
+  }
+  for (int i = 0; i < 200 && collector.frames < 200; ++i) {
+    driver.Poll(10);
+  }
+  close(client);
+  close(server);
+  close(listener);
+
+  EXPECT_EQ(collector.frames, 200u);
+  EXPECT_TRUE(collector.bodies_valid);
+  EXPECT_EQ(driver.stats().kernel_drops, 0u);
+  EXPECT_GT(driver.stats().blocks, 0u);
+  bool found = false;
+  driver.ForEachFlow([&](const FlowKey& key, const FlowStats& stats) {
+    if (key.dst_port == ntohs(addr.sin_port)) {
+      found = true;
+      EXPECT_EQ(stats.bytes, stream.size());
+      EXPECT_GT(stats.parse_bytes_per_second(), 0);
+    }
+  });
+  EXPECT_TRUE(found);
+}
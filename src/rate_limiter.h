@@ -0,0 +1,115 @@
+/**
+ * @file rate_limiter.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_RATE_LIMITER_H_
+#define SRC_RATE_LIMITER_H_
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdint>
+
+/// @brief A monotonic timestamp in nanoseconds with tick (a few milliseconds) resolution. It is
+/// served from the vDSO, so reading it does not enter the kernel.
+inline uint64_t CoarseNowNs() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+/// @brief A monotonic timestamp in nanoseconds with full resolution.
+inline uint64_t MonotonicNowNs() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+/// @brief A token bucket refilled at `rate` tokens per second up to `burst` tokens (one second
+/// worth of tokens when `burst` is 0). A default constructed bucket is unlimited. The caller
+/// supplies the time, so one clock read can be shared by many buckets and frames. Bursts and
+/// amounts saturate at `kMaxAmount` tokens.
+class TokenBucket final {
+ public:
+  /// @brief The largest amount of tokens that can be represented in nano-tokens.
+  constexpr static uint64_t kMaxAmount = UINT64_MAX / 1000000000ull;
+
+  TokenBucket() = default;
+  TokenBucket(uint64_t rate, uint64_t burst, uint64_t now_ns)
+      : rate_(rate),
+        burst_(Scaled(burst > 0 ? burst : rate)),
+        tokens_(burst_),
+        last_refill_ns_(now_ns) {}
+
+  /// @brief Whether the bucket never limits.
+  bool unlimited() const { return rate_ == 0; }
+
+  /// @brief Add the tokens accumulated since the last refill.
+  void Refill(uint64_t now_ns) {
+    if (unlimited() || now_ns <= last_refill_ns_) {
+      return;
+    }
+    // saturate before `elapsed * rate` can exceed the room left, or overflow
+    const uint64_t elapsed = now_ns - last_refill_ns_;
+    const uint64_t room = burst_ - tokens_;
+    tokens_ = elapsed > room / rate_ ? burst_ : tokens_ + elapsed * rate_;
+    last_refill_ns_ = now_ns;
+  }
+
+  /// @brief Whether `amount` tokens are available. Amounts above the burst only need a full bucket.
+  bool Check(uint64_t amount) const {
+    return unlimited() || tokens_ >= std::min(Scaled(amount), burst_);
+  }
+
+  /// @brief Take `amount` tokens, the caller must have checked that they are available.
+  void Consume(uint64_t amount) {
+    if (!unlimited()) {
+      tokens_ -= std::min(tokens_, Scaled(amount));
+    }
+  }
+
+  /// @brief Nanoseconds until `amount` tokens are available, 0 if they already are.
+  uint64_t WaitTimeNs(uint64_t amount) const {
+    if (Check(amount)) {
+      return 0;
+    }
+    // the deficit is not 0 here, and rounding up this way cannot overflow
+    const uint64_t needed = std::min(Scaled(amount), burst_);
+    return (needed - std::min(needed, tokens_) - 1) / rate_ + 1;
+  }
+
+ private:
+  // tokens are kept in nano-tokens so that refilling needs no division
+  constexpr static uint64_t kScale = 1000000000ull;
+
+  static uint64_t Scaled(uint64_t amount) { return std::min(amount, kMaxAmount) * kScale; }
+
+  uint64_t rate_ = 0;
+  uint64_t burst_ = 0;
+  uint64_t tokens_ = 0;
+  uint64_t last_refill_ns_ = 0;
+};
+
+/// @brief What the parser does with a frame that exceeds the ingress limits.
+enum class RateLimitAction : uint8_t {
+  kSkipBody,  // drain the frame without delivering it
+  kDefer,     // stop parsing and leave the frame in the ring until tokens are available
+  kSignal,    // ask the rate limit handler whether to deliver the frame
+};
+
+/// @brief Per-connection ingress limits, a rate of 0 means unlimited.
+struct IngressLimits {
+  uint64_t frames_per_second = 0;
+  uint64_t frame_burst = 0;
+  uint64_t bytes_per_second = 0;
+  uint64_t byte_burst = 0;
+  RateLimitAction action = RateLimitAction::kSkipBody;
+  /// @brief The clock the limits are checked against, e.g. a fake one in tests.
+  uint64_t (*clock)() = CoarseNowNs;
+};
+
+#endif  // SRC_RATE_LIMITER_H_
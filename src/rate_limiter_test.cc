@@ -0,0 +1,60 @@
+#include "rate_limiter.h"
+
+#include <gtest/gtest.h>
+
+TEST(TokenBucket, unlimited_bucket) {
+  TokenBucket bucket;
+  EXPECT_TRUE(bucket.unlimited());
+  EXPECT_TRUE(bucket.Check(1000000));
+  bucket.Consume(1000000);
+  EXPECT_TRUE(bucket.Check(1000000));
+  EXPECT_EQ(bucket.WaitTimeNs(1000000), 0);
+}
+
+TEST(TokenBucket, consume_and_refill) {
+  const uint64_t start = 1000000000ull;
+  TokenBucket bucket(1000, 10, start);  // 1000 tokens/s, burst 10
+  EXPECT_TRUE(bucket.Check(10));
+  bucket.Consume(10);
+  EXPECT_FALSE(bucket.Check(1));
+  EXPECT_EQ(bucket.WaitTimeNs(1), 1000000ull);
+
+  // 5ms later five tokens are back
+  bucket.Refill(start + 5000000ull);
+  EXPECT_TRUE(bucket.Check(5));
+  EXPECT_FALSE(bucket.Check(6));
+
+  // a long idle period only refills up to the burst
+  bucket.Refill(start + 3600ull * 1000000000ull);
+  EXPECT_TRUE(bucket.Check(10));
+  bucket.Consume(10);
+  EXPECT_FALSE(bucket.Check(1));
+
+  // an amount larger than the burst is admitted by a full bucket
+  bucket.Refill(start + 3601ull * 1000000000ull);
+  EXPECT_TRUE(bucket.Check(50));
+}
+
+TEST(TokenBucket, large_amounts_saturate) {
+  const uint64_t start = 1000000000ull;
+  // a burst above what nano-tokens can hold is capped instead of wrapping around
+  TokenBucket bucket(1ull << 40, UINT64_MAX, start);
+  EXPECT_TRUE(bucket.Check(TokenBucket::kMaxAmount));
+  EXPECT_TRUE(bucket.Check(UINT64_MAX));
+  bucket.Consume(UINT64_MAX);
+  EXPECT_FALSE(bucket.Check(1));
+  // refilling the whole capped burst at 2^40 tokens/s
+  EXPECT_EQ(bucket.WaitTimeNs(UINT64_MAX), 16777216ull);
+
+  // refilling a large rate for a long time does not overflow
+  bucket.Refill(start + 3600ull * 1000000000ull);
+  EXPECT_TRUE(bucket.Check(TokenBucket::kMaxAmount));
+
+  // an amount above the largest one needs the full burst, it does not wrap to a small one
+  TokenBucket bytes(1000000000ull, 10000000000ull, start);
+  bytes.Consume(5000000000ull);
+  EXPECT_FALSE(bytes.Check(20000000000ull));
+  EXPECT_EQ(bytes.WaitTimeNs(20000000000ull), 5000000000ull);
+  bytes.Refill(start + 5000000000ull);
+  EXPECT_TRUE(bytes.Check(20000000000ull));
+}
@@ -1,11 +1,22 @@
 #include "ring_buffer.h"
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 
+#ifdef RING_BUFFER_LOCK_STATS
+#include <time.h>
+#endif
+
 class RingBufferErrorCategory : public std::error_category {
  public:
   const char* name() const noexcept override { return "RingBuffer"; }
@@ -15,6 +26,10 @@ class RingBufferErrorCategory : public std::error_category {
         return "Buffer Overflow";
       case 2:
         return "Invalid Buffer Parameter";
+      case 3:
+        return "Persistent File Mismatch";
+      case 4:
+        return "Persistent File Locked";
       default:
         return "Unknown Error";
     }
@@ -28,6 +43,25 @@ const std::error_category& ring_buffer_category() {
 
 const std::error_code RingBuffer::ErrBufferOverflow = std::error_code(1, ring_buffer_category());
 const std::error_code RingBuffer::ErrInvalidParameter = std::error_code(2, ring_buffer_category());
+const std::error_code RingBuffer::ErrPersistMismatch = std::error_code(3, ring_buffer_category());
+const std::error_code RingBuffer::ErrPersistLocked = std::error_code(4, ring_buffer_category());
+
+/// @brief The start of a persistent file. The cursors are the positions of the ring, the data
+/// starts `persist_header_length` bytes into the file; the state area follows the header.
+struct RingBuffer::PersistHeader {
+  constexpr static uint64_t kMagic = 0x31474e4952505350ull;  // "PSPRING1"
+  constexpr static uint32_t kVersion = 1;
+  std::atomic<uint64_t> magic;  // stored last when the file is created
+  uint32_t version;
+  uint32_t capacity;
+  std::atomic<uint64_t> read_position;
+  std::atomic<uint64_t> write_position;
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "persistent cursors must be plain words in the mapping");
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "unexpected atomic layout");
+static_assert(RingBuffer::persist_header_length - RingBuffer::persistent_state_length >= 32,
+              "the state area overlaps the persistent header");
 
 #define IS_POWER_OF_TWO(x) (((x) != 0) && (((x) & ((x) - 1)) == 0))
 
@@ -35,19 +69,251 @@ RingBuffer::RingBuffer(uint32_t size) : index_mask(static_cast<uint32_t>(size -
   assert(size > 0);
   // "Must be power of two"
   assert(IS_POWER_OF_TWO(size));
-  buffer_.resize(size);
+  heap_.resize(size);
+  data_ = heap_.data();
+  size_ = size;
   read_index_ = 0;
   write_index_ = 0;
 }
 
+#ifdef RING_BUFFER_LOCK_STATS
+namespace {
+uint64_t LockClockNs() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+/// @brief Bucket i counts durations in [2^i, 2^(i+1)) ns, bucket 0 also counts 0 ns.
+uint32_t LockHistogramBucket(uint64_t ns) {
+  const uint32_t bucket = ns == 0 ? 0 : 63 - static_cast<uint32_t>(__builtin_clzll(ns));
+  return std::min(bucket, RingBuffer::lock_histogram_buckets - 1);
+}
+}  // namespace
+
+/// @brief Locks `mutex_` for one operation and records the acquisition. A try_lock comes first so
+/// that contended acquisitions are told apart and only they pay for timing the wait. Nested
+/// acquisitions (an operation calling `buffered_bytes()`) are not recorded.
+class RingBuffer::OpLock {
+ public:
+  OpLock(const RingBuffer& ring, LockOp op)
+      : ring_(ring), stats_(ring.lock_stats_.ops[static_cast<uint32_t>(op)]) {
+    lock();
+  }
+  OpLock(const OpLock&) = delete;
+  OpLock& operator=(const OpLock&) = delete;
+  ~OpLock() {
+    if (owns_) {
+      unlock();
+    }
+  }
+
+  void lock() {
+    uint64_t wait_ns = 0;
+    const bool contended = !ring_.mutex_.try_lock();
+    if (contended) {
+      const uint64_t start_ns = LockClockNs();
+      ring_.mutex_.lock();
+      wait_ns = LockClockNs() - start_ns;
+    }
+    owns_ = true;
+    // the depth is only touched by the owner of the mutex
+    outermost_ = ring_.lock_depth_++ == 0;
+    if (!outermost_) {
+      return;
+    }
+    ++stats_.acquisitions;
+    stats_.contended += contended ? 1 : 0;
+    stats_.wait_ns += wait_ns;
+    ++stats_.wait_histogram[LockHistogramBucket(wait_ns)];
+    acquired_ns_ = LockClockNs();
+  }
+
+  void unlock() {
+    if (outermost_) {
+      const uint64_t hold_ns = LockClockNs() - acquired_ns_;
+      stats_.hold_ns += hold_ns;
+      ++stats_.hold_histogram[LockHistogramBucket(hold_ns)];
+    }
+    --ring_.lock_depth_;
+    owns_ = false;
+    ring_.mutex_.unlock();
+  }
+
+ private:
+  const RingBuffer& ring_;
+  LockOpStats& stats_;
+  uint64_t acquired_ns_ = 0;
+  bool owns_ = false;
+  bool outermost_ = false;
+};
+
+RingBuffer::LockStats RingBuffer::lock_stats() const {
+  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  return lock_stats_;
+}
+
+void RingBuffer::reset_lock_stats() {
+  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  lock_stats_ = LockStats();
+}
+#else
+/// @brief Without RING_BUFFER_LOCK_STATS an operation lock is a plain unique_lock.
+class RingBuffer::OpLock : public std::unique_lock<std::recursive_mutex> {
+ public:
+  OpLock(const RingBuffer& ring, LockOp) : std::unique_lock<std::recursive_mutex>(ring.mutex_) {}
+};
+#endif  // RING_BUFFER_LOCK_STATS
+
 RingBuffer::RingBuffer() : RingBuffer(2048) {
   // default size 2048 bytes
 }
 
-RingBuffer::~RingBuffer() { clear(); }
+RingBuffer::~RingBuffer() {
+  if (persist_header_ == nullptr) {
+    clear();
+    return;
+  }
+  // the buffered bytes stay in the file for the next ring
+  munmap(persist_header_, persist_header_length + static_cast<size_t>(size_));
+  close(persist_fd_);
+}
+
+void RingBuffer::published_write(uint32_t length) {
+  write_position_ += length;
+  if (persist_header_ != nullptr) {
+    persist_header_->write_position.store(write_position_, std::memory_order_release);
+  }
+}
+
+void RingBuffer::published_read(uint32_t length) {
+  read_position_ += length;
+  if (persist_header_ != nullptr) {
+    persist_header_->read_position.store(read_position_, std::memory_order_release);
+  }
+}
+
+std::error_code RingBuffer::persist(const std::string& path, bool& recovered) {
+  OpLock lock(*this, LockOp::kOther);
+  recovered = false;
+  if (persist_header_ != nullptr) {
+    return ErrInvalidParameter;
+  }
+  const size_t file_length = persist_header_length + static_cast<size_t>(size_);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return std::error_code(errno, std::system_category());
+  }
+  // two rings writing the same file would corrupt it, the second one is refused
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    auto err = errno == EWOULDBLOCK ? ErrPersistLocked
+                                    : std::error_code(errno, std::system_category());
+    close(fd);
+    return err;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size == 0 && ftruncate(fd, static_cast<off_t>(file_length)) < 0)) {
+    auto err = std::error_code(errno, std::system_category());
+    close(fd);
+    return err;
+  }
+  if (st.st_size != 0 && static_cast<size_t>(st.st_size) != file_length) {
+    close(fd);
+    return ErrPersistMismatch;
+  }
+  void* map = mmap(nullptr, file_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    auto err = std::error_code(errno, std::system_category());
+    close(fd);
+    return err;
+  }
+  auto* header = static_cast<PersistHeader*>(map);
+  uint8_t* data = static_cast<uint8_t*>(map) + persist_header_length;
+  const uint64_t magic = header->magic.load(std::memory_order_acquire);
+  if (magic == PersistHeader::kMagic) {
+    if (header->version != PersistHeader::kVersion || header->capacity != size_) {
+      munmap(map, file_length);
+      close(fd);
+      return ErrPersistMismatch;
+    }
+    // a crash inside clear() may leave the read cursor ahead, the ring is then empty
+    const uint64_t read = header->read_position.load(std::memory_order_acquire);
+    const uint64_t write = header->write_position.load(std::memory_order_acquire);
+    read_position_ = read;
+    write_position_ = write;
+    if (read > write || write - read > size_) {
+      read_position_ = write_position_ = std::max(read, write);
+      header->read_position.store(read_position_, std::memory_order_release);
+      header->write_position.store(write_position_, std::memory_order_release);
+    }
+    read_index_ = static_cast<uint32_t>(read_position_) & index_mask;
+    write_index_ = static_cast<uint32_t>(write_position_) & index_mask;
+    buffered_bytes_ = static_cast<int32_t>(write_position_ - read_position_);
+    recovered = true;
+  } else {
+    // a new file, or one whose creation did not complete
+    std::memcpy(data, data_, size_);
+    header->version = PersistHeader::kVersion;
+    header->capacity = size_;
+    header->read_position.store(read_position_, std::memory_order_relaxed);
+    header->write_position.store(write_position_, std::memory_order_relaxed);
+    std::memset(reinterpret_cast<uint8_t*>(map) + persist_header_length - persistent_state_length,
+                0, persistent_state_length);
+    header->magic.store(PersistHeader::kMagic, std::memory_order_release);
+  }
+  persist_header_ = header;
+  persist_fd_ = fd;
+  data_ = data;
+  heap_ = std::vector<uint8_t>();
+  return std::error_code();
+}
+
+std::error_code RingBuffer::sync() {
+  OpLock lock(*this, LockOp::kOther);
+  if (persist_header_ == nullptr) {
+    return ErrInvalidParameter;
+  }
+  if (msync(persist_header_, persist_header_length + static_cast<size_t>(size_), MS_SYNC) < 0) {
+    return std::error_code(errno, std::system_category());
+  }
+  return std::error_code();
+}
+
+uint8_t* RingBuffer::persistent_state() {
+  if (persist_header_ == nullptr) {
+    return nullptr;
+  }
+  return reinterpret_cast<uint8_t*>(persist_header_) + persist_header_length -
+         persistent_state_length;
+}
+
+uint64_t RingBuffer::read_position() const {
+  OpLock lock(*this, LockOp::kOther);
+  return read_position_;
+}
+
+uint64_t RingBuffer::write_position() const {
+  OpLock lock(*this, LockOp::kOther);
+  return write_position_;
+}
+
+bool RingBuffer::rewind_read_position(uint64_t position) {
+  OpLock lock(*this, LockOp::kOther);
+  if (position > read_position_ || write_position_ - position > size_) {
+    return false;
+  }
+  read_position_ = position;
+  read_index_ = static_cast<uint32_t>(position) & index_mask;
+  buffered_bytes_ = static_cast<int32_t>(write_position_ - position);
+  if (persist_header_ != nullptr) {
+    persist_header_->read_position.store(read_position_, std::memory_order_release);
+  }
+  return true;
+}
 
 std::error_code RingBuffer::write(const uint8_t* data, uint32_t length) {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  OpLock lock(*this, LockOp::kWrite);
   if (data == nullptr || length == 0) {
     return ErrInvalidParameter;
   }
@@ -59,19 +325,42 @@ std::error_code RingBuffer::write(const uint8_t* data, uint32_t length) {
   uint32_t temp_write_idx = write_index_ & index_mask;
   if (temp_write_idx + length > capacity()) {
     size_t left = capacity() - temp_write_idx;
-    std::memcpy(&buffer_[temp_write_idx], data, left);
-    std::memcpy(&buffer_[0], data + left, length - left);
+    std::memcpy(&data_[temp_write_idx], data, left);
+    std::memcpy(&data_[0], data + left, length - left);
   } else {
-    std::memcpy(&buffer_[temp_write_idx], data, length);
+    std::memcpy(&data_[temp_write_idx], data, length);
   }
   write_index_ = (temp_write_idx + length);
   buffered_bytes_ += length;
   assert(buffered_bytes_ >= 0);
+  published_write(length);
+  return std::error_code();
+}
+
+uint8_t* RingBuffer::reserve(uint32_t length, uint32_t& reserved) {
+  OpLock lock(*this, LockOp::kOther);
+  uint32_t temp_write_idx = write_index_ & index_mask;
+  reserved = std::min({length, capacity() - buffered_bytes(), capacity() - temp_write_idx});
+  return &data_[temp_write_idx];
+}
+
+std::error_code RingBuffer::commit(uint32_t length) {
+  OpLock lock(*this, LockOp::kOther);
+  if (length == 0) {
+    return ErrInvalidParameter;
+  }
+  uint32_t temp_write_idx = write_index_ & index_mask;
+  if (buffered_bytes() + length > capacity() || temp_write_idx + length > capacity()) {
+    return ErrBufferOverflow;
+  }
+  write_index_ = (temp_write_idx + length);
+  buffered_bytes_ += length;
+  published_write(length);
   return std::error_code();
 }
 
 uint32_t RingBuffer::read(uint8_t* data, uint32_t length) {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  OpLock lock(*this, LockOp::kRead);
   if (data == nullptr || length == 0) {
     return 0;
   }
@@ -82,19 +371,20 @@ uint32_t RingBuffer::read(uint8_t* data, uint32_t length) {
   uint32_t read_bytes = std::min(length, buffered_bytes());
   if (temp_read_idx + read_bytes > capacity()) {
     size_t left = capacity() - temp_read_idx;
-    std::memcpy(data, &buffer_[temp_read_idx], left);
-    std::memcpy(data + left, &buffer_[0], read_bytes - left);
+    std::memcpy(data, &data_[temp_read_idx], left);
+    std::memcpy(data + left, &data_[0], read_bytes - left);
   } else {
-    std::memcpy(data, &buffer_[temp_read_idx], read_bytes);
+    std::memcpy(data, &data_[temp_read_idx], read_bytes);
   }
   read_index_ = (temp_read_idx + read_bytes);
   buffered_bytes_ -= read_bytes;
   assert(buffered_bytes_ >= 0);
+  published_read(read_bytes);
   return read_bytes;
 }
 
 uint32_t RingBuffer::read(uint32_t length, ReceiveCallback&& recv_cb) {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  OpLock lock(*this, LockOp::kReadCallback);
   if (length == 0) {
     return 0;
   }
@@ -108,67 +398,150 @@ uint32_t RingBuffer::read(uint32_t length, ReceiveCallback&& recv_cb) {
     size_t left = capacity() - temp_read_idx;
     // optimize(.) happens when read the buffer wraps around
     std::vector<uint8_t> temp_buffer(read_bytes);
-    std::memcpy(temp_buffer.data(), &buffer_[temp_read_idx], left);
-    std::memcpy(temp_buffer.data() + left, &buffer_[0], read_bytes - left);
+    std::memcpy(temp_buffer.data(), &data_[temp_read_idx], left);
+    std::memcpy(temp_buffer.data() + left, &data_[0], read_bytes - left);
     lock.unlock();
     read_ok = recv_cb(temp_buffer.data(), read_bytes);
     lock.lock();
   } else {
     lock.unlock();
-    read_ok = recv_cb(&buffer_[temp_read_idx], read_bytes);
+    read_ok = recv_cb(&data_[temp_read_idx], read_bytes);
     lock.lock();
   }
   if (read_ok) {
     read_index_ = (temp_read_idx + read_bytes);
     buffered_bytes_ -= read_bytes;
     assert(buffered_bytes_ >= 0);
+    published_read(read_bytes);
+    return read_bytes;
+  }
+  return 0;
+}
+
+uint32_t RingBuffer::read_in_place(uint32_t length, InPlaceCallback&& recv_cb) {
+  OpLock lock(*this, LockOp::kOther);
+  if (length == 0) {
+    return 0;
+  }
+  if (buffered_bytes_ == 0) {
+    return 0;
+  }
+  uint32_t temp_read_idx = read_index_ & index_mask;
+  uint32_t read_bytes = std::min(length, buffered_bytes());
+  uint32_t first_length = std::min(read_bytes, capacity() - temp_read_idx);
+  lock.unlock();
+  bool read_ok = recv_cb(&data_[temp_read_idx], first_length, &data_[0],
+                         read_bytes - first_length);
+  lock.lock();
+  if (read_ok) {
+    read_index_ = (temp_read_idx + read_bytes);
+    buffered_bytes_ -= read_bytes;
+    assert(buffered_bytes_ >= 0);
+    published_read(read_bytes);
     return read_bytes;
   }
   return 0;
 }
 
+uint32_t RingBuffer::peek(uint32_t offset, uint8_t* data, uint32_t length) const {
+  OpLock lock(*this, LockOp::kOther);
+  if (data == nullptr || length == 0) {
+    return 0;
+  }
+  if (offset >= buffered_bytes()) {
+    return 0;
+  }
+  uint32_t temp_read_idx = (read_index_ + offset) & index_mask;
+  uint32_t read_bytes = std::min(length, buffered_bytes() - offset);
+  if (temp_read_idx + read_bytes > capacity()) {
+    size_t left = capacity() - temp_read_idx;
+    std::memcpy(data, &data_[temp_read_idx], left);
+    std::memcpy(data + left, &data_[0], read_bytes - left);
+  } else {
+    std::memcpy(data, &data_[temp_read_idx], read_bytes);
+  }
+  return read_bytes;
+}
+
+const uint8_t* RingBuffer::contiguous_data(uint32_t offset, uint32_t length) const {
+  OpLock lock(*this, LockOp::kOther);
+  if (static_cast<uint64_t>(offset) + length > buffered_bytes()) {
+    return nullptr;
+  }
+  uint32_t temp_read_idx = (read_index_ + offset) & index_mask;
+  if (temp_read_idx + length > capacity()) {
+    return nullptr;
+  }
+  return &data_[temp_read_idx];
+}
+
+uint32_t RingBuffer::gather(uint32_t offset, uint32_t length, std::vector<iovec>& iov) const {
+  OpLock lock(*this, LockOp::kOther);
+  if (length == 0 || offset >= buffered_bytes()) {
+    return 0;
+  }
+  uint32_t temp_read_idx = (read_index_ + offset) & index_mask;
+  uint32_t read_bytes = std::min(length, buffered_bytes() - offset);
+  uint32_t first = std::min(read_bytes, capacity() - temp_read_idx);
+  iov.push_back(iovec{const_cast<uint8_t*>(&data_[temp_read_idx]), static_cast<size_t>(first)});
+  if (first < read_bytes) {
+    iov.push_back(iovec{const_cast<uint8_t*>(&data_[0]), static_cast<size_t>(read_bytes - first)});
+  }
+  return read_bytes;
+}
+
 void RingBuffer::clear() {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  OpLock lock(*this, LockOp::kOther);
   read_index_ = 0;
   write_index_ = 0;
   buffered_bytes_ = 0;
+  // the positions move to the next multiple of the capacity, where the indices are 0
+  const uint64_t position = (write_position_ + size_ - 1) & ~static_cast<uint64_t>(index_mask);
+  read_position_ = position;
+  write_position_ = position;
+  if (persist_header_ != nullptr) {
+    // the read cursor first: a crash in between leaves it ahead, which recovers as empty
+    persist_header_->read_position.store(position, std::memory_order_release);
+    persist_header_->write_position.store(position, std::memory_order_release);
+  }
 }
 
 void RingBuffer::drain(uint32_t length) {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  OpLock lock(*this, LockOp::kDrain);
   uint32_t temp_read_idx = read_index_ & index_mask;
   auto read_bytes = std::min(length, buffered_bytes());
   read_index_ = (temp_read_idx + read_bytes) & index_mask;
   buffered_bytes_ -= read_bytes;
   assert(buffered_bytes_ >= 0);
+  published_read(read_bytes);
 }
 
 uint32_t RingBuffer::capacity() const {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
-  return static_cast<uint32_t>(buffer_.size());
+  OpLock lock(*this, LockOp::kOther);
+  return static_cast<uint32_t>(size_);
 }
 
 uint32_t RingBuffer::buffered_bytes() const {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  OpLock lock(*this, LockOp::kBufferedBytes);
   assert(buffered_bytes_ >= 0);
   return buffered_bytes_;
 }
 
 bool RingBuffer::empty() const {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
+  OpLock lock(*this, LockOp::kOther);
   return buffered_bytes_ == 0;
 }
 
 bool RingBuffer::full() const {
-  std::unique_lock<std::recursive_mutex> lock(mutex_);
-  return buffered_bytes_ == static_cast<int32_t>(buffer_.size());
+  OpLock lock(*this, LockOp::kOther);
+  return buffered_bytes_ == static_cast<int32_t>(size_);
 }
 
 std::string RingBuffer::getHexString() {
   uint32_t temp_read_idx = read_index_;
   std::stringstream buf_hex;
   for (size_t i = 0; i < buffered_bytes_; i++) {
-    buf_hex << std::hex << static_cast<int>(buffer_[(i + temp_read_idx) & index_mask]) << " ";
+    buf_hex << std::hex << static_cast<int>(data_[(i + temp_read_idx) & index_mask]) << " ";
   }
   return buf_hex.str();
 }
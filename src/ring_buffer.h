@@ -9,17 +9,40 @@
 #ifndef SRC_RING_BUFFER_H_
 #define SRC_RING_BUFFER_H_
 
+#include <sys/uio.h>
+
 #include <cstdint>
 #include <functional>
 #include <mutex>
+#include <string>
 #include <system_error>
 #include <vector>
 
 class RingBuffer final {
  public:
   using ReceiveCallback = std::function<bool(const uint8_t* data, uint32_t length)>;
+  /// @brief Receives the buffered bytes in place as up to two writable pieces, `second` is only
+  /// non-empty when the bytes wrap around the end of the buffer.
+  using InPlaceCallback = std::function<bool(uint8_t* first, uint32_t first_length, uint8_t* second,
+                                             uint32_t second_length)>;
+  /// @brief The operations whose use of the mutex is told apart by the lock statistics.
+  enum class LockOp : uint8_t {
+    kWrite,
+    kRead,
+    kReadCallback,
+    kDrain,
+    kBufferedBytes,
+    kOther,
+  };
   static const std::error_code ErrBufferOverflow;
   static const std::error_code ErrInvalidParameter;
+  static const std::error_code ErrPersistMismatch;
+  static const std::error_code ErrPersistLocked;
+  /// @brief Bytes of the persistent file before the ring data, see `persist`.
+  constexpr static uint32_t persist_header_length = 4096;
+  /// @brief Bytes of the persistent file header the owner of the ring may use, see
+  /// `persistent_state`.
+  constexpr static uint32_t persistent_state_length = persist_header_length - 64;
 
   RingBuffer();
   explicit RingBuffer(uint32_t size);
@@ -28,12 +51,37 @@ class RingBuffer final {
   /// @brief Writes `length` bytes from `data` into the ring buffer.
   std::error_code write(const uint8_t* data, uint32_t length);
 
+  /// @brief Reserve up to `length` bytes of contiguous free space at the write index for a producer
+  /// writing in place. Returns the region and sets `reserved` to its size, which is smaller than
+  /// `length` when the free space is smaller or wraps around.
+  uint8_t* reserve(uint32_t length, uint32_t& reserved);
+
+  /// @brief Publish `length` bytes written into the region returned by `reserve`.
+  std::error_code commit(uint32_t length);
+
   /// @brief Read up to `length` bytes from the ring buffer into `data`.
   uint32_t read(uint8_t* data, uint32_t length);
 
   /// @brief Read up to `length` bytes from the ring buffer by calling the `recv_cb` callback.
   uint32_t read(uint32_t length, ReceiveCallback&& recv_cb);
 
+  /// @brief Read up to `length` bytes in place by calling `recv_cb` with the pieces of ring memory
+  /// holding them. The callback may modify the bytes, e.g. to decrypt them.
+  uint32_t read_in_place(uint32_t length, InPlaceCallback&& recv_cb);
+
+  /// @brief Copy up to `length` bytes starting `offset` bytes past the read index into `data`,
+  /// without consuming them.
+  uint32_t peek(uint32_t offset, uint8_t* data, uint32_t length) const;
+
+  /// @brief A pointer to the `length` bytes starting `offset` bytes past the read index, or nullptr
+  /// when they are not buffered or wrap around the end of the buffer. The bytes stay valid until
+  /// they are consumed.
+  const uint8_t* contiguous_data(uint32_t offset, uint32_t length) const;
+
+  /// @brief Append to `iov` the (at most two) pieces of ring memory holding up to `length` bytes
+  /// starting `offset` bytes past the read index. Returns the number of bytes described.
+  uint32_t gather(uint32_t offset, uint32_t length, std::vector<iovec>& iov) const;
+
   /// @brief Reset the read and write index.
   void clear();
 
@@ -50,13 +98,79 @@ class RingBuffer final {
   bool full() const;
   std::string getHexString();
 
+  /// @brief Back the ring with a `MAP_SHARED` mapping of the file at `path`, so that its bytes
+  /// outlive the process. A file left by an earlier ring of the same capacity is recovered: its
+  /// buffered bytes become the contents of this ring, in O(1) (`recovered` is set). Otherwise the
+  /// file is created with the current contents. Each operation then publishes its cursor with one
+  /// release store after the bytes, a crashed process leaves a consistent file. The file is locked
+  /// (`flock`) for the life of the mapping. Returns `ErrPersistMismatch` for a file of another ring
+  /// size or format, `ErrPersistLocked` when another ring holds it.
+  std::error_code persist(const std::string& path, bool& recovered);
+
+  /// @brief Flush the mapping to the file, for durability beyond a process crash.
+  std::error_code sync();
+
+  bool persistent() const { return persist_header_ != nullptr; }
+
+  /// @brief `persistent_state_length` bytes of the persistent file reserved for the owner of the
+  /// ring, e.g. the parser state matching the read position, or nullptr when not persistent.
+  uint8_t* persistent_state();
+
+  /// @brief Bytes read and written since the ring was created, persisted ones included.
+  uint64_t read_position() const;
+  uint64_t write_position() const;
+
+  /// @brief Move the read position back to `position`, to re-read bytes consumed but not yet
+  /// overwritten. Returns false when they are not all still in the ring.
+  bool rewind_read_position(uint64_t position);
+
+#ifdef RING_BUFFER_LOCK_STATS
+  constexpr static uint32_t lock_op_count = static_cast<uint32_t>(LockOp::kOther) + 1;
+  constexpr static uint32_t lock_histogram_buckets = 32;
+  /// @brief Mutex usage of one operation. Histogram bucket i counts durations in
+  /// [2^i, 2^(i+1)) nanoseconds.
+  struct LockOpStats {
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;  // acquisitions whose try_lock failed
+    uint64_t wait_ns = 0;
+    uint64_t hold_ns = 0;
+    uint64_t wait_histogram[lock_histogram_buckets] = {};
+    uint64_t hold_histogram[lock_histogram_buckets] = {};
+  };
+  struct LockStats {
+    LockOpStats ops[lock_op_count];
+    const LockOpStats& operator[](LockOp op) const { return ops[static_cast<uint32_t>(op)]; }
+  };
+
+  /// @brief A consistent snapshot of the lock statistics, only built with RING_BUFFER_LOCK_STATS.
+  LockStats lock_stats() const;
+  void reset_lock_stats();
+#endif  // RING_BUFFER_LOCK_STATS
+
  private:
+  class OpLock;
+  struct PersistHeader;
+
+  /// @brief Account `length` bytes produced or consumed, publishing the cursor when persistent.
+  void published_write(uint32_t length);
+  void published_read(uint32_t length);
+
   mutable std::recursive_mutex mutex_;
   const uint32_t index_mask = 0;
-  std::vector<uint8_t> buffer_;
+  std::vector<uint8_t> heap_;  // the storage unless persistent
+  uint8_t* data_ = nullptr;
+  uint32_t size_ = 0;
   uint32_t read_index_ = 0;
   uint32_t write_index_ = 0;    // always point to the next write position
   int32_t buffered_bytes_ = 0;  // number of bytes currently buffered
+  uint64_t read_position_ = 0;
+  uint64_t write_position_ = 0;
+  PersistHeader* persist_header_ = nullptr;  // the start of the file mapping
+  int persist_fd_ = -1;                      // holds the lock on the persistent file
+#ifdef RING_BUFFER_LOCK_STATS
+  mutable LockStats lock_stats_;
+  mutable uint32_t lock_depth_ = 0;  // recursive acquisitions held by the owning thread
+#endif
 };
 
 #endif  // SRC_RING_BUFFER_H_
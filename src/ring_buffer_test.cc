@@ -2,7 +2,11 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
+#include <string>
+#include <thread>
 #include <vector>
 
 TEST(RingBuffer, buffer_init) {
@@ -234,4 +238,251 @@ TEST(RingBuffer, buffer_read_write_content_validation) {
   EXPECT_EQ(std::vector<uint8_t>(read_data.begin(), read_data.begin() + read_bytes),
             std::vector<uint8_t>(write_data.begin() + to_read,
                                  write_data.begin() + to_read + read_bytes));
-}
\ No newline at end of file
+}
+
+TEST(RingBuffer, buffer_peek_test) {
+  auto buffer = std::make_shared<RingBuffer>(16);
+  std::vector<uint8_t> write_data(16);
+  for (uint32_t i = 0; i < write_data.size(); ++i) {
+    write_data[i] = static_cast<uint8_t>(i);
+  }
+  // move the read index close to the end so that the peeked region wraps around
+  EXPECT_FALSE(buffer->write(write_data.data(), 12));
+  buffer->drain(12);
+  EXPECT_FALSE(buffer->write(write_data.data(), 10));
+
+  std::vector<uint8_t> peek_data(10, 0x00);
+  EXPECT_EQ(buffer->peek(2, peek_data.data(), 6), 6);
+  EXPECT_EQ(std::vector<uint8_t>(peek_data.begin(), peek_data.begin() + 6),
+            std::vector<uint8_t>(write_data.begin() + 2, write_data.begin() + 8));
+  EXPECT_EQ(buffer->buffered_bytes(), 10);
+
+  // peeking past the buffered bytes is truncated
+  EXPECT_EQ(buffer->peek(8, peek_data.data(), 6), 2);
+  EXPECT_EQ(buffer->peek(10, peek_data.data(), 1), 0);
+}
+
+TEST(RingBuffer, buffer_contiguous_data_test) {
+  auto buffer = std::make_shared<RingBuffer>(16);
+  std::vector<uint8_t> write_data(16);
+  for (uint32_t i = 0; i < write_data.size(); ++i) {
+    write_data[i] = static_cast<uint8_t>(i);
+  }
+  EXPECT_FALSE(buffer->write(write_data.data(), 14));
+  buffer->drain(14);
+  EXPECT_FALSE(buffer->write(write_data.data(), 8));
+
+  // buffered: [0, 1] at the end of the buffer, then [2..7] from the start
+  const uint8_t* data = buffer->contiguous_data(0, 2);
+  ASSERT_NE(data, nullptr);
+  EXPECT_EQ(data[1], 1);
+  EXPECT_EQ(buffer->contiguous_data(1, 2), nullptr);  // wraps around
+  data = buffer->contiguous_data(2, 6);
+  ASSERT_NE(data, nullptr);
+  EXPECT_EQ(data[5], 7);
+  EXPECT_EQ(buffer->contiguous_data(2, 7), nullptr);  // not buffered
+}
+
+TEST(RingBuffer, buffer_gather_test) {
+  auto buffer = std::make_shared<RingBuffer>(16);
+  std::vector<uint8_t> write_data(16);
+  for (uint32_t i = 0; i < write_data.size(); ++i) {
+    write_data[i] = static_cast<uint8_t>(i);
+  }
+  EXPECT_FALSE(buffer->write(write_data.data(), 14));
+  buffer->drain(14);
+  EXPECT_FALSE(buffer->write(write_data.data(), 8));
+
+  std::vector<iovec> iov;
+  EXPECT_EQ(buffer->gather(1, 20, iov), 7);
+  ASSERT_EQ(iov.size(), 2);
+  EXPECT_EQ(iov[0].iov_len, 1);
+  EXPECT_EQ(static_cast<uint8_t*>(iov[0].iov_base)[0], 1);
+  EXPECT_EQ(iov[1].iov_len, 6);
+  EXPECT_EQ(static_cast<uint8_t*>(iov[1].iov_base)[0], 2);
+  iov.clear();
+  EXPECT_EQ(buffer->gather(3, 2, iov), 2);
+  ASSERT_EQ(iov.size(), 1);
+  EXPECT_EQ(static_cast<uint8_t*>(iov[0].iov_base)[1], 4);
+  EXPECT_EQ(buffer->gather(8, 1, iov), 0);
+}
+
+TEST(RingBuffer, buffer_read_in_place_test) {
+  auto buffer = std::make_shared<RingBuffer>(16);
+  std::vector<uint8_t> write_data(16, 0x01);
+  EXPECT_FALSE(buffer->write(write_data.data(), 12));
+  buffer->drain(12);
+  EXPECT_FALSE(buffer->write(write_data.data(), 10));
+
+  // a rejected read leaves the bytes buffered
+  EXPECT_EQ(buffer->read_in_place(
+                10, [](uint8_t*, uint32_t, uint8_t*, uint32_t) { return false; }),
+            0);
+  EXPECT_EQ(buffer->buffered_bytes(), 10);
+
+  // the pieces wrap around and are writable
+  EXPECT_EQ(buffer->read_in_place(8,
+                                  [](uint8_t* first, uint32_t first_length, uint8_t* second,
+                                     uint32_t second_length) {
+                                    EXPECT_EQ(first_length, 4);
+                                    EXPECT_EQ(second_length, 4);
+                                    std::fill(first, first + first_length, 0xEE);
+                                    std::fill(second, second + second_length, 0xEE);
+                                    return true;
+                                  }),
+            8);
+  EXPECT_EQ(buffer->buffered_bytes(), 2);
+  std::vector<uint8_t> rest(2, 0);
+  EXPECT_EQ(buffer->read(rest.data(), 2), 2);
+  EXPECT_EQ(rest, std::vector<uint8_t>(2, 0x01));
+}
+
+TEST(RingBuffer, buffer_reserve_commit_test) {
+  auto buffer = std::make_shared<RingBuffer>(16);
+  uint32_t reserved = 0;
+  uint8_t* region = buffer->reserve(10, reserved);
+  EXPECT_EQ(reserved, 10);
+  for (uint32_t i = 0; i < reserved; ++i) {
+    region[i] = static_cast<uint8_t>(i);
+  }
+  EXPECT_FALSE(buffer->commit(10));
+  EXPECT_EQ(buffer->buffered_bytes(), 10);
+
+  // the free space wraps around, only the part up to the end is contiguous
+  buffer->drain(8);
+  region = buffer->reserve(16, reserved);
+  EXPECT_EQ(reserved, 6);
+  region[0] = 0xAA;
+  EXPECT_EQ(buffer->commit(7), RingBuffer::ErrBufferOverflow);
+  EXPECT_FALSE(buffer->commit(1));
+  region = buffer->reserve(16, reserved);
+  EXPECT_EQ(reserved, 5);
+
+  std::vector<uint8_t> read_data(3, 0);
+  EXPECT_EQ(buffer->read(read_data.data(), 3), 3);
+  EXPECT_EQ(read_data, std::vector<uint8_t>({8, 9, 0xAA}));
+}
+
+TEST(RingBuffer, persistent_recovery) {
+  const std::string path = testing::TempDir() + "ring_buffer_persistent_recovery";
+  std::remove(path.c_str());
+  std::vector<uint8_t> data(100);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<uint8_t>(i);
+  }
+  {
+    RingBuffer buffer(64);
+    // bytes buffered before the ring is persisted are kept
+    EXPECT_FALSE(buffer.write(data.data(), 10));
+    bool recovered = true;
+    ASSERT_FALSE(buffer.persist(path, recovered));
+    EXPECT_FALSE(recovered);
+    EXPECT_TRUE(buffer.persistent());
+    ASSERT_NE(buffer.persistent_state(), nullptr);
+    uint8_t out[64];
+    EXPECT_EQ(buffer.read(out, 10), 10);
+    // the next bytes wrap around the end of the ring
+    EXPECT_FALSE(buffer.write(data.data() + 10, 40));
+    EXPECT_EQ(buffer.read(out, 30), 30);
+    EXPECT_FALSE(buffer.write(data.data() + 50, 40));
+    EXPECT_FALSE(buffer.sync());
+    EXPECT_EQ(buffer.read_position(), 40);
+    EXPECT_EQ(buffer.write_position(), 90);
+
+    // the file is locked while it is mapped
+    RingBuffer second(64);
+    EXPECT_EQ(second.persist(path, recovered), RingBuffer::ErrPersistLocked);
+    EXPECT_FALSE(second.persistent());
+  }
+  {
+    RingBuffer buffer(64);
+    bool recovered = false;
+    ASSERT_FALSE(buffer.persist(path, recovered));
+    EXPECT_TRUE(recovered);
+    ASSERT_EQ(buffer.buffered_bytes(), 50);
+    EXPECT_EQ(buffer.read_position(), 40);
+    uint8_t out[64];
+    EXPECT_EQ(buffer.read(out, 20), 20);
+    EXPECT_TRUE(std::equal(out, out + 20, data.begin() + 40));
+    // consumed bytes can be read again until they are overwritten
+    EXPECT_FALSE(buffer.rewind_read_position(70));
+    EXPECT_TRUE(buffer.rewind_read_position(50));
+    EXPECT_EQ(buffer.read(out, 40), 40);
+    EXPECT_TRUE(std::equal(out, out + 40, data.begin() + 50));
+    EXPECT_FALSE(buffer.write(data.data(), 64));
+    EXPECT_FALSE(buffer.rewind_read_position(89));
+    buffer.clear();
+  }
+  {
+    RingBuffer buffer(64);
+    bool recovered = false;
+    ASSERT_FALSE(buffer.persist(path, recovered));
+    EXPECT_TRUE(recovered);
+    EXPECT_TRUE(buffer.empty());
+    EXPECT_FALSE(buffer.write(data.data(), 64));
+    EXPECT_TRUE(buffer.full());
+  }
+  RingBuffer other(128);
+  bool recovered = false;
+  EXPECT_EQ(other.persist(path, recovered), RingBuffer::ErrPersistMismatch);
+  EXPECT_FALSE(other.persistent());
+  std::remove(path.c_str());
+}
+
+#ifdef RING_BUFFER_LOCK_STATS
+TEST(RingBuffer, buffer_lock_stats_test) {
+  RingBuffer buffer(1024);
+  std::vector<uint8_t> data(64, 0x11);
+  EXPECT_FALSE(buffer.write(data.data(), 64));
+  EXPECT_EQ(buffer.read(data.data(), 16), 16);
+  EXPECT_EQ(buffer.read(16, [](const uint8_t*, uint32_t) { return true; }), 16);
+  buffer.drain(8);
+  EXPECT_EQ(buffer.buffered_bytes(), 24);
+
+  auto stats = buffer.lock_stats();
+  // operations calling buffered_bytes() internally do not count it
+  EXPECT_EQ(stats[RingBuffer::LockOp::kWrite].acquisitions, 1);
+  EXPECT_EQ(stats[RingBuffer::LockOp::kRead].acquisitions, 1);
+  // read(cb) drops the lock around the callback
+  EXPECT_EQ(stats[RingBuffer::LockOp::kReadCallback].acquisitions, 2);
+  EXPECT_EQ(stats[RingBuffer::LockOp::kDrain].acquisitions, 1);
+  EXPECT_EQ(stats[RingBuffer::LockOp::kBufferedBytes].acquisitions, 1);
+  uint64_t wait_samples = 0;
+  uint64_t hold_samples = 0;
+  for (uint32_t i = 0; i < RingBuffer::lock_histogram_buckets; ++i) {
+    wait_samples += stats[RingBuffer::LockOp::kReadCallback].wait_histogram[i];
+    hold_samples += stats[RingBuffer::LockOp::kReadCallback].hold_histogram[i];
+  }
+  EXPECT_EQ(wait_samples, 2);
+  EXPECT_EQ(hold_samples, 2);
+  EXPECT_EQ(stats[RingBuffer::LockOp::kWrite].contended, 0);
+
+  // a writer and a reader hammering the ring end up waiting for each other
+  buffer.reset_lock_stats();
+  constexpr int kOps = 100000;
+  std::thread writer([&buffer]() {
+    const uint8_t byte = 0x22;
+    for (int i = 0; i < kOps; ++i) {
+      buffer.write(&byte, 1);
+    }
+  });
+  uint8_t byte = 0;
+  for (int i = 0; i < kOps; ++i) {
+    buffer.read(&byte, 1);
+  }
+  writer.join();
+  stats = buffer.lock_stats();
+  const auto& write_stats = stats[RingBuffer::LockOp::kWrite];
+  EXPECT_EQ(write_stats.acquisitions, kOps);
+  EXPECT_EQ(stats[RingBuffer::LockOp::kRead].acquisitions, kOps);
+  EXPECT_LE(write_stats.contended, write_stats.acquisitions);
+  uint64_t write_waits = 0;
+  for (uint32_t i = 0; i < RingBuffer::lock_histogram_buckets; ++i) {
+    write_waits += write_stats.wait_histogram[i];
+  }
+  EXPECT_EQ(write_waits, kOps);
+  if (std::thread::hardware_concurrency() > 1) {
+    EXPECT_GT(write_stats.contended + stats[RingBuffer::LockOp::kRead].contended, 0);
+  }
+}
+#endif  // RING_BUFFER_LOCK_STATS
@@ -0,0 +1,329 @@
+/**
+ * @file rpc_mux.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_RPC_MUX_H_
+#define SRC_RPC_MUX_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "outbound_framer.h"
+#include "streaming_parser.h"
+
+enum class RpcStatus : uint8_t {
+  kOk,
+  kTimeout,
+  kCancelled,
+  kConnectionClosed,
+  kSendFailed,  // the request could not be written, see `send_error`
+};
+
+struct RpcOptions {
+  /// @brief Maximum calls in flight, a power of two. It sizes the pending call table.
+  uint32_t max_inflight = 4096;
+  /// @brief Resolution of the timeouts.
+  uint64_t tick_ns = 1000000;
+  /// @brief Buckets of the timer wheel, a power of two. Longer timeouts take several turns.
+  uint32_t wheel_slots = 512;
+  SenderOptions sender;
+};
+
+/// @brief Pipelines many concurrent calls over one connection and matches the responses by a
+/// request id field of the header (kept in the byte order it is written in).
+///
+/// Pending calls live in a fixed open-addressing table: the multiplexer picks each request id so
+/// that it lands on a free slot (probing over ids rather than slots), so a response finds its call
+/// with one load and claims it with one CAS, without locks or tombstones. A response, a timeout and
+/// `Cancel` race for that CAS and exactly one of them completes the call. Timeouts are kept in a
+/// hashed timer wheel advanced by `Tick`; entries of completed calls are skipped lazily. Requests
+/// are queued on the outbound framer and written in a batch by `Submit`. Response bodies are handed
+/// to the callback as views into the parser's ring.
+///
+/// `Call`, `Submit`, `HandleData`, `Tick` and `Close` run on the connection's I/O thread. `Cancel`
+/// may be called from any thread; the callback then runs on the cancelling thread.
+/// @tparam ProtoHeader The protocol header struct type.
+/// @tparam RequestId The type of the request id field.
+template <typename ProtoHeader, typename RequestId = uint32_t>
+class RpcMultiplexer {
+ public:
+  using Parser = StreamingParser<ProtoHeader>;
+  using RequestIdField = RequestId ProtoHeader::*;
+  /// @brief Receives the outcome of a call. `header` and `body` are only set for `kOk`, they point
+  /// into the parser and are valid during the call.
+  using ResponseHandler = std::function<void(RpcStatus status, const ProtoHeader* header,
+                                             const uint8_t* body, uint32_t length)>;
+
+  RpcMultiplexer(int fd, RequestIdField request_id, const RpcOptions& options = RpcOptions());
+  RpcMultiplexer(const RpcMultiplexer&) = delete;
+  RpcMultiplexer& operator=(const RpcMultiplexer&) = delete;
+  /// @brief Fails the calls still pending with `kConnectionClosed`.
+  ~RpcMultiplexer() { Close(); }
+
+  /// @brief Queue a request, its request id field is assigned by the multiplexer and returned in
+  /// `id`. `handler` is called once, with the response or when the call fails. A write error (from
+  /// an auto-cork flush here, or from `Submit`) leaves the stream cut mid-request: the unsent bytes
+  /// are dropped and every pending call fails with `kConnectionClosed`, this one with `kSendFailed`
+  /// before `Call` returns. Returns false when `max_inflight` calls are pending, `handler` is then
+  /// not called.
+  bool Call(ProtoHeader header, const uint8_t* body, uint32_t length, uint64_t timeout_ns,
+            ResponseHandler&& handler, RequestId* id = nullptr);
+
+  /// @brief Write the requests queued since the last submission, in as few send calls as possible.
+  /// A write error breaks the connection, see `Call`.
+  std::error_code Submit() {
+    auto err = framer_.Flush();
+    if (err) {
+      Broken(err);
+    }
+    return err;
+  }
+
+  /// @brief Feed bytes received on the connection, completing the calls they answer.
+  bool HandleData(const uint8_t* data, uint32_t length) {
+    return parser_->HandleData(data, length);
+  }
+
+  /// @brief Advance the timer wheel to `now_ns` (CLOCK_MONOTONIC), failing the calls whose
+  /// timeout expired. Returns the number of calls timed out.
+  size_t Tick(uint64_t now_ns);
+
+  /// @brief Complete call `id` with `kCancelled`. Returns false when it already completed.
+  bool Cancel(RequestId id);
+
+  /// @brief Fail every pending call with `kConnectionClosed`.
+  void Close();
+
+  uint32_t inflight() const { return inflight_.load(std::memory_order_acquire); }
+  uint64_t completed_calls() const { return completed_calls_; }
+  uint64_t timed_out_calls() const { return timed_out_calls_; }
+  /// @brief Responses without a pending call, e.g. arriving after their call timed out.
+  uint64_t unmatched_responses() const { return unmatched_responses_; }
+  /// @brief The last write error, from `Call` or `Submit`. Later successful writes keep it.
+  std::error_code send_error() const { return send_error_; }
+
+  Parser& parser() { return *parser_; }
+  OutboundFramer<ProtoHeader>& framer() { return framer_; }
+
+ private:
+  // a slot is free (0), holds call `id` (id + 1), or is being completed (kClaimed)
+  constexpr static uint64_t kClaimed = ~0ull;
+  struct Slot {
+    std::atomic<uint64_t> tag{0};
+    uint64_t expiry_tick = 0;
+    ResponseHandler handler;
+  };
+  struct TimerEntry {
+    RequestId id;
+    uint64_t expiry_tick;  // tells the call apart from a later one reusing the id
+  };
+
+  static uint64_t Tag(RequestId id) { return static_cast<uint64_t>(id) + 1; }
+  Slot& SlotOf(RequestId id) { return slots_[static_cast<uint64_t>(id) & slot_mask_]; }
+
+  /// @brief Take the handler of pending call `id`, false if it is not pending.
+  bool Claim(RequestId id, ResponseHandler& handler);
+  /// @brief Drop the unsent requests and fail every pending call after the write error `err`.
+  void Broken(std::error_code err);
+  bool OnHeader(const ProtoHeader& header);
+  bool OnBody(const uint8_t* data, uint32_t length);
+
+  RequestIdField request_id_;
+  RpcOptions options_;
+  std::unique_ptr<Parser> parser_;
+  OutboundFramer<ProtoHeader> framer_;
+  std::unique_ptr<Slot[]> slots_;
+  uint64_t slot_mask_;
+  std::atomic<uint32_t> inflight_{0};
+  RequestId next_id_ = 0;
+  std::vector<std::vector<TimerEntry>> wheel_;
+  std::vector<TimerEntry> expiring_;
+  uint64_t current_tick_;
+  ResponseHandler current_handler_;  // the call answered by the frame being parsed
+  ProtoHeader current_header_;
+  uint64_t completed_calls_ = 0;
+  uint64_t timed_out_calls_ = 0;
+  uint64_t unmatched_responses_ = 0;
+  std::error_code send_error_;
+};
+
+template <typename ProtoHeader, typename RequestId>
+RpcMultiplexer<ProtoHeader, RequestId>::RpcMultiplexer(int fd, RequestIdField request_id,
+                                                       const RpcOptions& options)
+    : request_id_(request_id),
+      options_(options),
+      parser_(std::make_unique<Parser>(
+          [this](const ProtoHeader& header) { return OnHeader(header); },
+          [this](const uint8_t* data, uint32_t length) { return OnBody(data, length); })),
+      framer_(fd, options.sender),
+      slots_(new Slot[options.max_inflight]),
+      slot_mask_(options.max_inflight - 1),
+      wheel_(options.wheel_slots),
+      current_tick_(FrameSender::NowNs() / options.tick_ns) {
+  assert((options.max_inflight & (options.max_inflight - 1)) == 0);
+  assert((options.wheel_slots & (options.wheel_slots - 1)) == 0);
+  assert(sizeof(RequestId) >= sizeof(uint64_t) ||
+         options.max_inflight <= (uint64_t{1} << (8 * sizeof(RequestId))));
+}
+
+template <typename ProtoHeader, typename RequestId>
+bool RpcMultiplexer<ProtoHeader, RequestId>::Call(ProtoHeader header, const uint8_t* body,
+                                                  uint32_t length, uint64_t timeout_ns,
+                                                  ResponseHandler&& handler, RequestId* id) {
+  if (inflight() >= options_.max_inflight) {
+    return false;
+  }
+  // probe over the ids for one whose slot is free, there is one since the table is not full
+  RequestId call_id = next_id_++;
+  while (SlotOf(call_id).tag.load(std::memory_order_acquire) != 0) {
+    call_id = next_id_++;
+  }
+  Slot& slot = SlotOf(call_id);
+  slot.handler = std::move(handler);
+
+  const uint64_t ticks = (timeout_ns + options_.tick_ns - 1) / options_.tick_ns;
+  const uint64_t expiry_tick = current_tick_ + std::max<uint64_t>(1, ticks);
+  slot.expiry_tick = expiry_tick;
+  wheel_[expiry_tick & (options_.wheel_slots - 1)].push_back(TimerEntry{call_id, expiry_tick});
+
+  inflight_.fetch_add(1, std::memory_order_relaxed);
+  slot.tag.store(Tag(call_id), std::memory_order_release);
+
+  header.*request_id_ = call_id;
+  if (id != nullptr) {
+    *id = call_id;
+  }
+  auto err = framer_.Send(header, body, length);
+  ResponseHandler failed;
+  if (err && Claim(call_id, failed)) {
+    // the other calls fail first, a new call issued by this handler starts afresh
+    Broken(err);
+    failed(RpcStatus::kSendFailed, nullptr, nullptr, 0);
+  }
+  return true;
+}
+
+template <typename ProtoHeader, typename RequestId>
+void RpcMultiplexer<ProtoHeader, RequestId>::Broken(std::error_code err) {
+  send_error_ = err;
+  // requests queued behind the failed write must not reach the peer later
+  framer_.sender().Discard();
+  Close();
+}
+
+template <typename ProtoHeader, typename RequestId>
+bool RpcMultiplexer<ProtoHeader, RequestId>::Claim(RequestId id, ResponseHandler& handler) {
+  Slot& slot = SlotOf(id);
+  uint64_t expected = Tag(id);
+  if (!slot.tag.compare_exchange_strong(expected, kClaimed, std::memory_order_acq_rel)) {
+    return false;
+  }
+  handler = std::move(slot.handler);
+  slot.handler = nullptr;
+  slot.tag.store(0, std::memory_order_release);
+  // only once the slot is free, so that `Call` always finds one below `max_inflight`
+  inflight_.fetch_sub(1, std::memory_order_release);
+  return true;
+}
+
+template <typename ProtoHeader, typename RequestId>
+bool RpcMultiplexer<ProtoHeader, RequestId>::OnHeader(const ProtoHeader& header) {
+  if (!Claim(header.*request_id_, current_handler_)) {
+    ++unmatched_responses_;
+    return true;
+  }
+  ++completed_calls_;
+  if (header.body_length == 0) {
+    // no body follows
+    auto handler = std::move(current_handler_);
+    current_handler_ = nullptr;
+    handler(RpcStatus::kOk, &header, nullptr, 0);
+    return true;
+  }
+  current_header_ = header;
+  return true;
+}
+
+template <typename ProtoHeader, typename RequestId>
+bool RpcMultiplexer<ProtoHeader, RequestId>::OnBody(const uint8_t* data, uint32_t length) {
+  if (current_handler_) {
+    // the handler may issue new calls, which must not see it as the current one
+    auto handler = std::move(current_handler_);
+    current_handler_ = nullptr;
+    handler(RpcStatus::kOk, &current_header_, data, length);
+  }
+  return true;
+}
+
+template <typename ProtoHeader, typename RequestId>
+size_t RpcMultiplexer<ProtoHeader, RequestId>::Tick(uint64_t now_ns) {
+  size_t timed_out = 0;
+  const uint64_t target = now_ns / options_.tick_ns;
+  while (current_tick_ < target) {
+    ++current_tick_;
+    auto& bucket = wheel_[current_tick_ & (options_.wheel_slots - 1)];
+    if (bucket.empty()) {
+      continue;
+    }
+    // handlers may queue new calls into this bucket while it is processed
+    expiring_.swap(bucket);
+    for (const TimerEntry& entry : expiring_) {
+      const Slot& slot = SlotOf(entry.id);
+      if (slot.tag.load(std::memory_order_acquire) != Tag(entry.id) ||
+          slot.expiry_tick != entry.expiry_tick) {
+        // completed already
+        continue;
+      }
+      if (entry.expiry_tick > current_tick_) {
+        // due in a later turn of the wheel
+        bucket.push_back(entry);
+        continue;
+      }
+      ResponseHandler handler;
+      if (Claim(entry.id, handler)) {
+        ++timed_out_calls_;
+        ++timed_out;
+        handler(RpcStatus::kTimeout, nullptr, nullptr, 0);
+      }
+    }
+    expiring_.clear();
+  }
+  return timed_out;
+}
+
+template <typename ProtoHeader, typename RequestId>
+bool RpcMultiplexer<ProtoHeader, RequestId>::Cancel(RequestId id) {
+  ResponseHandler handler;
+  if (!Claim(id, handler)) {
+    return false;
+  }
+  handler(RpcStatus::kCancelled, nullptr, nullptr, 0);
+  return true;
+}
+
+template <typename ProtoHeader, typename RequestId>
+void RpcMultiplexer<ProtoHeader, RequestId>::Close() {
+  for (uint64_t index = 0; index <= slot_mask_; ++index) {
+    const uint64_t tag = slots_[index].tag.load(std::memory_order_acquire);
+    ResponseHandler handler;
+    if (tag != 0 && tag != kClaimed && Claim(static_cast<RequestId>(tag - 1), handler)) {
+      handler(RpcStatus::kConnectionClosed, nullptr, nullptr, 0);
+    }
+  }
+  for (auto& bucket : wheel_) {
+    bucket.clear();
+  }
+}
+
+#endif  // SRC_RPC_MUX_H_
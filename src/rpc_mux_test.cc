@@ -0,0 +1,274 @@
+#include "rpc_mux.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+struct RpcHeader {
+  uint32_t body_length;
+  uint16_t msg_type;
+  uint16_t flags;
+  uint32_t request_id;
+};
+
+namespace {
+/// @brief The peer of the multiplexer: collects requests and sends responses on demand.
+class Server {
+ public:
+  explicit Server(int fd)
+      : fd_(fd),
+        framer_(fd),
+        parser_(std::make_unique<StreamingParser<RpcHeader>>(
+            [this](const RpcHeader& header) {
+              requests_.push_back(Request{header, {}});
+              return true;
+            },
+            [this](const uint8_t* data, uint32_t length) {
+              requests_.back().body.assign(data, data + length);
+              return true;
+            })) {}
+
+  /// @brief Read the requests that arrived.
+  void Poll() {
+    uint8_t data[1024];
+    ssize_t n = 0;
+    while ((n = recv(fd_, data, sizeof(data), MSG_DONTWAIT)) > 0) {
+      parser_->HandleData(data, static_cast<uint32_t>(n));
+    }
+  }
+
+  /// @brief Answer request `index` with its own body.
+  void Reply(size_t index) {
+    const Request& request = requests_[index];
+    framer_.Send(request.header, request.body.data(), static_cast<uint32_t>(request.body.size()));
+    EXPECT_FALSE(framer_.Flush());
+  }
+
+  struct Request {
+    RpcHeader header;
+    std::vector<uint8_t> body;
+  };
+  std::vector<Request> requests_;
+
+ private:
+  int fd_;
+  OutboundFramer<RpcHeader> framer_;
+  std::unique_ptr<StreamingParser<RpcHeader>> parser_;
+};
+
+/// @brief Feed the responses waiting on `fd` to `mux`.
+template <typename Mux>
+void Receive(int fd, Mux& mux) {
+  uint8_t data[1024];
+  ssize_t n = 0;
+  while ((n = recv(fd, data, sizeof(data), MSG_DONTWAIT)) > 0) {
+    mux.HandleData(data, static_cast<uint32_t>(n));
+  }
+}
+
+struct Outcome {
+  RpcStatus status;
+  uint32_t request_id;
+  std::vector<uint8_t> body;
+};
+}  // namespace
+
+TEST(RpcMultiplexer, pipelined_calls) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  RpcMultiplexer<RpcHeader> mux(fds[0], &RpcHeader::request_id);
+  Server server(fds[1]);
+  std::vector<Outcome> outcomes;
+  std::vector<uint32_t> ids;
+  for (uint8_t i = 0; i < 100; ++i) {
+    const std::vector<uint8_t> body(i % 7, i);
+    uint32_t id = 0;
+    ASSERT_TRUE(mux.Call(
+        RpcHeader{0, 7, 0, 0}, body.data(), static_cast<uint32_t>(body.size()), 1000000000,
+        [&outcomes](RpcStatus status, const RpcHeader* header, const uint8_t* data,
+                    uint32_t length) {
+          outcomes.push_back(
+              Outcome{status, header->request_id, std::vector<uint8_t>(data, data + length)});
+        },
+        &id));
+    ids.push_back(id);
+  }
+  EXPECT_EQ(mux.inflight(), 100);
+  // the batch goes out in one send call
+  EXPECT_FALSE(mux.Submit());
+  EXPECT_EQ(mux.framer().sender().stats().syscalls, 1);
+
+  server.Poll();
+  ASSERT_EQ(server.requests_.size(), 100);
+  // responses come back out of order
+  for (size_t i = 100; i-- > 0;) {
+    server.Reply(i);
+  }
+  Receive(fds[0], mux);
+  ASSERT_EQ(outcomes.size(), 100);
+  for (size_t i = 0; i < outcomes.size(); ++i) {
+    const size_t index = 99 - i;
+    EXPECT_EQ(outcomes[i].status, RpcStatus::kOk);
+    EXPECT_EQ(outcomes[i].request_id, ids[index]);
+    EXPECT_EQ(outcomes[i].body, std::vector<uint8_t>(index % 7, static_cast<uint8_t>(index)));
+  }
+  EXPECT_EQ(mux.inflight(), 0);
+  EXPECT_EQ(mux.completed_calls(), 100);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(RpcMultiplexer, timeouts) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  RpcOptions options;
+  options.tick_ns = 1000000;
+  options.wheel_slots = 8;
+  RpcMultiplexer<RpcHeader> mux(fds[0], &RpcHeader::request_id, options);
+  Server server(fds[1]);
+  std::vector<RpcStatus> short_call;
+  std::vector<RpcStatus> long_call;
+  const uint64_t start = FrameSender::NowNs();
+  mux.Tick(start);
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 5000000,
+                       [&short_call](RpcStatus status, const RpcHeader*, const uint8_t*,
+                                     uint32_t) { short_call.push_back(status); }));
+  // longer than a turn of the wheel
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 20000000,
+                       [&long_call](RpcStatus status, const RpcHeader*, const uint8_t*,
+                                    uint32_t) { long_call.push_back(status); }));
+  EXPECT_FALSE(mux.Submit());
+
+  EXPECT_EQ(mux.Tick(start + 3000000), 0);
+  EXPECT_EQ(mux.Tick(start + 7000000), 1);
+  EXPECT_EQ(short_call, std::vector<RpcStatus>({RpcStatus::kTimeout}));
+  EXPECT_TRUE(long_call.empty());
+  // a turn of the wheel later the short call's bucket comes up again, the long call stays
+  EXPECT_EQ(mux.Tick(start + 15000000), 0);
+  EXPECT_TRUE(long_call.empty());
+  EXPECT_EQ(mux.Tick(start + 22000000), 1);
+  EXPECT_EQ(long_call, std::vector<RpcStatus>({RpcStatus::kTimeout}));
+  EXPECT_EQ(mux.timed_out_calls(), 2);
+
+  // the responses arrive too late
+  server.Poll();
+  ASSERT_EQ(server.requests_.size(), 2);
+  server.Reply(0);
+  server.Reply(1);
+  Receive(fds[0], mux);
+  EXPECT_EQ(mux.unmatched_responses(), 2);
+  EXPECT_EQ(short_call.size(), 1);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(RpcMultiplexer, table_full_cancel_and_close) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  RpcOptions options;
+  options.max_inflight = 4;
+  RpcMultiplexer<RpcHeader, uint32_t> mux(fds[0], &RpcHeader::request_id, options);
+  std::vector<RpcStatus> outcomes;
+  auto record = [&outcomes](RpcStatus status, const RpcHeader*, const uint8_t*, uint32_t) {
+    outcomes.push_back(status);
+  };
+  std::vector<uint32_t> ids(4);
+  for (auto& id : ids) {
+    ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record, &id));
+  }
+  EXPECT_FALSE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record));
+
+  // cancelled from another thread
+  std::thread canceller([&mux, &ids]() { EXPECT_TRUE(mux.Cancel(ids[1])); });
+  canceller.join();
+  EXPECT_FALSE(mux.Cancel(ids[1]));
+  EXPECT_EQ(mux.inflight(), 3);
+
+  // the freed slot is reused under a new id
+  uint32_t reused = 0;
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record, &reused));
+  EXPECT_NE(reused, ids[1]);
+  EXPECT_EQ(reused % 4, ids[1] % 4);
+
+  mux.Close();
+  EXPECT_EQ(mux.inflight(), 0);
+  ASSERT_EQ(outcomes.size(), 5);
+  EXPECT_EQ(outcomes[0], RpcStatus::kCancelled);
+  EXPECT_EQ(std::count(outcomes.begin(), outcomes.end(), RpcStatus::kConnectionClosed), 4);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(RpcMultiplexer, send_failure_breaks_the_connection) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  RpcOptions options;
+  options.max_inflight = 8;
+  // three requests of 12 bytes are corked, the third one flushes them
+  options.sender.cork.enabled = true;
+  options.sender.cork.flush_bytes = 36;
+  options.sender.cork.max_delay_us = 10 * 1000 * 1000;
+  RpcMultiplexer<RpcHeader, uint32_t> mux(fds[0], &RpcHeader::request_id, options);
+  std::vector<std::pair<uint32_t, RpcStatus>> outcomes;
+  auto record = [&outcomes](uint32_t call) {
+    return [&outcomes, call](RpcStatus status, const RpcHeader*, const uint8_t*, uint32_t) {
+      outcomes.emplace_back(call, status);
+    };
+  };
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record(0)));
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record(1)));
+  EXPECT_EQ(mux.framer().sender().pending_bytes(), 2 * sizeof(RpcHeader));
+  close(fds[1]);
+
+  // the failed flush carried all three: none of them stays pending or queued
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record(2)));
+  EXPECT_EQ(outcomes, (std::vector<std::pair<uint32_t, RpcStatus>>(
+                          {{0, RpcStatus::kConnectionClosed},
+                           {1, RpcStatus::kConnectionClosed},
+                           {2, RpcStatus::kSendFailed}})));
+  EXPECT_EQ(mux.inflight(), 0);
+  EXPECT_EQ(mux.framer().sender().pending_bytes(), 0);
+  EXPECT_EQ(mux.send_error(), std::error_code(EPIPE, std::system_category()));
+
+  // the same through `Submit`
+  outcomes.clear();
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record(3)));
+  ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record(4)));
+  // queueing without a write keeps the last error
+  EXPECT_EQ(mux.send_error(), std::error_code(EPIPE, std::system_category()));
+  EXPECT_EQ(mux.Submit(), std::error_code(EPIPE, std::system_category()));
+  EXPECT_EQ(outcomes, (std::vector<std::pair<uint32_t, RpcStatus>>(
+                          {{3, RpcStatus::kConnectionClosed}, {4, RpcStatus::kConnectionClosed}})));
+  EXPECT_EQ(mux.inflight(), 0);
+  EXPECT_EQ(mux.framer().sender().pending_bytes(), 0);
+  // nothing is left to write
+  EXPECT_FALSE(mux.Submit());
+  close(fds[0]);
+}
+
+TEST(RpcMultiplexer, destruction_fails_pending_calls) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  std::vector<RpcStatus> outcomes;
+  auto record = [&outcomes](RpcStatus status, const RpcHeader*, const uint8_t*, uint32_t) {
+    outcomes.push_back(status);
+  };
+  {
+    RpcMultiplexer<RpcHeader, uint32_t> mux(fds[0], &RpcHeader::request_id);
+    ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record));
+    EXPECT_FALSE(mux.Submit());
+    ASSERT_TRUE(mux.Call(RpcHeader{}, nullptr, 0, 1000000000, record));
+    EXPECT_EQ(mux.inflight(), 2);
+  }
+  // the calls still pending are not dropped with the multiplexer
+  EXPECT_EQ(outcomes, std::vector<RpcStatus>(
+                          {RpcStatus::kConnectionClosed, RpcStatus::kConnectionClosed}));
+  close(fds[0]);
+  close(fds[1]);
+}
@@ -0,0 +1,112 @@
+#include "segment_chain.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+void ReleaseSegment(InputSegment* segment) {
+  if (segment->release != nullptr) {
+    segment->release(segment);
+  }
+}
+}  // namespace
+
+SegmentQueue::~SegmentQueue() { clear(); }
+
+void SegmentQueue::append(InputSegment* chain) {
+  while (chain != nullptr) {
+    // the owner may recycle the segment (and its `next` link) as soon as it is released
+    InputSegment* next = chain->next;
+    if (chain->length == 0) {
+      ReleaseSegment(chain);
+    } else {
+      segments_.push_back(chain);
+      buffered_bytes_ += chain->length;
+    }
+    chain = next;
+  }
+}
+
+bool SegmentQueue::locate(uint32_t offset, size_t& index, uint32_t& segment_offset) const {
+  if (offset >= buffered_bytes_) {
+    return false;
+  }
+  uint64_t position = static_cast<uint64_t>(head_offset_) + offset;
+  for (index = 0; index < segments_.size(); ++index) {
+    if (position < segments_[index]->length) {
+      segment_offset = static_cast<uint32_t>(position);
+      return true;
+    }
+    position -= segments_[index]->length;
+  }
+  return false;
+}
+
+uint32_t SegmentQueue::peek(uint32_t offset, uint8_t* data, uint32_t length) const {
+  size_t index = 0;
+  uint32_t segment_offset = 0;
+  if (data == nullptr || length == 0 || !locate(offset, index, segment_offset)) {
+    return 0;
+  }
+  uint32_t copied = 0;
+  for (; index < segments_.size() && copied < length; ++index, segment_offset = 0) {
+    const uint32_t n = std::min(length - copied, segments_[index]->length - segment_offset);
+    std::memcpy(data + copied, segments_[index]->data + segment_offset, n);
+    copied += n;
+  }
+  return copied;
+}
+
+const uint8_t* SegmentQueue::contiguous_data(uint32_t offset, uint32_t length) const {
+  size_t index = 0;
+  uint32_t segment_offset = 0;
+  if (!locate(offset, index, segment_offset)) {
+    return nullptr;
+  }
+  if (segments_[index]->length - segment_offset < length) {
+    return nullptr;
+  }
+  return segments_[index]->data + segment_offset;
+}
+
+uint32_t SegmentQueue::gather(uint32_t offset, uint32_t length, std::vector<iovec>& iov) const {
+  size_t index = 0;
+  uint32_t segment_offset = 0;
+  if (length == 0 || !locate(offset, index, segment_offset)) {
+    return 0;
+  }
+  uint32_t described = 0;
+  for (; index < segments_.size() && described < length; ++index, segment_offset = 0) {
+    const uint32_t n = std::min(length - described, segments_[index]->length - segment_offset);
+    iov.push_back(
+        iovec{const_cast<uint8_t*>(segments_[index]->data + segment_offset), static_cast<size_t>(n)});
+    described += n;
+  }
+  return described;
+}
+
+void SegmentQueue::drain(uint32_t length) {
+  length = std::min(length, buffered_bytes_);
+  buffered_bytes_ -= length;
+  while (length > 0) {
+    InputSegment* front = segments_.front();
+    const uint32_t n = std::min(length, front->length - head_offset_);
+    head_offset_ += n;
+    length -= n;
+    if (head_offset_ == front->length) {
+      segments_.pop_front();
+      head_offset_ = 0;
+      ReleaseSegment(front);
+    }
+  }
+}
+
+void SegmentQueue::clear() {
+  while (!segments_.empty()) {
+    InputSegment* front = segments_.front();
+    segments_.pop_front();
+    ReleaseSegment(front);
+  }
+  head_offset_ = 0;
+  buffered_bytes_ = 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * @file segment_chain.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_SEGMENT_CHAIN_H_
+#define SRC_SEGMENT_CHAIN_H_
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+/// @brief A block of input bytes owned by the caller (e.g. a NIC or user-space stack buffer).
+/// Segments are linked into chains through `next`; `release` hands a segment back to its owner once
+/// no frame references its bytes any more.
+struct InputSegment {
+  using ReleaseFn = void (*)(InputSegment* segment);
+  const uint8_t* data = nullptr;
+  uint32_t length = 0;
+  InputSegment* next = nullptr;
+  ReleaseFn release = nullptr;
+  void* opaque = nullptr;  // owner context for `release`
+};
+
+/// @brief A FIFO of borrowed input segments, read like a RingBuffer without copying the bytes.
+class SegmentQueue final {
+ public:
+  SegmentQueue() = default;
+  SegmentQueue(const SegmentQueue&) = delete;
+  SegmentQueue& operator=(const SegmentQueue&) = delete;
+  ~SegmentQueue();
+
+  /// @brief Queue every segment of `chain`. Empty segments are released right away.
+  void append(InputSegment* chain);
+
+  /// @brief Copy up to `length` bytes starting `offset` bytes past the head into `data`, without
+  /// consuming them.
+  uint32_t peek(uint32_t offset, uint8_t* data, uint32_t length) const;
+
+  /// @brief A pointer to `length` bytes starting `offset` bytes past the head, or nullptr when they
+  /// are not buffered or span several segments.
+  const uint8_t* contiguous_data(uint32_t offset, uint32_t length) const;
+
+  /// @brief Append the pieces of the `length` bytes starting `offset` bytes past the head to `iov`.
+  /// Returns the number of bytes described.
+  uint32_t gather(uint32_t offset, uint32_t length, std::vector<iovec>& iov) const;
+
+  /// @brief Move the head forward by `length` bytes, releasing every segment fully consumed.
+  void drain(uint32_t length);
+
+  /// @brief Release every queued segment.
+  void clear();
+
+  /// @brief Bytes currently queued.
+  uint32_t buffered_bytes() const { return buffered_bytes_; }
+
+  bool empty() const { return buffered_bytes_ == 0; }
+
+ private:
+  /// @brief Locate the segment holding the byte `offset` bytes past the head.
+  bool locate(uint32_t offset, size_t& index, uint32_t& segment_offset) const;
+
+  std::deque<InputSegment*> segments_;
+  uint32_t head_offset_ = 0;  // bytes of the front segment already consumed
+  uint32_t buffered_bytes_ = 0;
+};
+
+#endif  // SRC_SEGMENT_CHAIN_H_
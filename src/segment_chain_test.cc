@@ -0,0 +1,72 @@
+#include "segment_chain.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+namespace {
+struct OwnedSegment {
+  InputSegment segment;
+  std::vector<uint8_t> bytes;
+  bool released = false;
+};
+
+void MarkReleased(InputSegment* segment) {
+  static_cast<OwnedSegment*>(segment->opaque)->released = true;
+}
+
+std::vector<OwnedSegment> MakeSegments(const std::vector<uint32_t>& lengths) {
+  std::vector<OwnedSegment> owned(lengths.size());
+  uint8_t value = 0;
+  for (size_t i = 0; i < lengths.size(); ++i) {
+    for (uint32_t j = 0; j < lengths[i]; ++j) {
+      owned[i].bytes.push_back(value++);
+    }
+  }
+  for (size_t i = 0; i < lengths.size(); ++i) {
+    owned[i].segment.data = owned[i].bytes.data();
+    owned[i].segment.length = lengths[i];
+    owned[i].segment.next = i + 1 < lengths.size() ? &owned[i + 1].segment : nullptr;
+    owned[i].segment.release = MarkReleased;
+    owned[i].segment.opaque = &owned[i];
+  }
+  return owned;
+}
+}  // namespace
+
+TEST(SegmentQueue, peek_gather_drain) {
+  auto owned = MakeSegments({4, 0, 6, 10});
+  SegmentQueue queue;
+  queue.append(&owned[0].segment);
+  EXPECT_TRUE(owned[1].released);  // empty segments are not queued
+  EXPECT_EQ(queue.buffered_bytes(), 20);
+
+  std::vector<uint8_t> bytes(20, 0);
+  EXPECT_EQ(queue.peek(2, bytes.data(), 6), 6);
+  EXPECT_EQ(bytes[0], 2);
+  EXPECT_EQ(bytes[5], 7);
+
+  EXPECT_NE(queue.contiguous_data(4, 6), nullptr);
+  EXPECT_EQ(*queue.contiguous_data(4, 6), 4);
+  EXPECT_EQ(queue.contiguous_data(2, 4), nullptr);
+  EXPECT_EQ(queue.contiguous_data(20, 1), nullptr);
+
+  std::vector<iovec> iov;
+  EXPECT_EQ(queue.gather(2, 12, iov), 12);
+  ASSERT_EQ(iov.size(), 3);
+  EXPECT_EQ(iov[0].iov_len, 2);
+  EXPECT_EQ(iov[1].iov_len, 6);
+  EXPECT_EQ(iov[2].iov_len, 4);
+
+  queue.drain(3);
+  EXPECT_FALSE(owned[0].released);
+  queue.drain(1);
+  EXPECT_TRUE(owned[0].released);
+  queue.drain(10);
+  EXPECT_TRUE(owned[2].released);
+  EXPECT_FALSE(owned[3].released);
+  EXPECT_EQ(queue.buffered_bytes(), 6);
+  queue.clear();
+  EXPECT_TRUE(owned[3].released);
+  EXPECT_TRUE(queue.empty());
+}
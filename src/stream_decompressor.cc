@@ -0,0 +1,97 @@
+#include "stream_decompressor.h"
+
+#include <zlib.h>
+
+class StreamDecompressorErrorCategory : public std::error_category {
+ public:
+  const char* name() const noexcept override { return "StreamDecompressor"; }
+  std::string message(int ev) const override {
+    switch (ev) {
+      case 1:
+        return "Init Failed";
+      case 2:
+        return "Corrupt Stream";
+      case 3:
+        return "Buffer Full";
+      default:
+        return "Unknown Error";
+    }
+  }
+};
+
+const std::error_category& stream_decompressor_category() {
+  static StreamDecompressorErrorCategory instance;
+  return instance;
+}
+
+const std::error_code StreamDecompressor::ErrInitFailed =
+    std::error_code(1, stream_decompressor_category());
+const std::error_code StreamDecompressor::ErrCorruptStream =
+    std::error_code(2, stream_decompressor_category());
+const std::error_code StreamDecompressor::ErrBufferFull =
+    std::error_code(3, stream_decompressor_category());
+
+StreamDecompressor::StreamDecompressor(Format format, uint32_t min_chunk_length)
+    : min_chunk_length_(min_chunk_length) {
+  int window_bits = MAX_WBITS;
+  if (format == Format::kGzip) {
+    window_bits += 16;
+  } else if (format == Format::kRawDeflate) {
+    window_bits = -MAX_WBITS;
+  }
+  stream_ = new z_stream{};
+  if (inflateInit2(stream_, window_bits) != Z_OK) {
+    delete stream_;
+    stream_ = nullptr;
+  }
+}
+
+StreamDecompressor::~StreamDecompressor() {
+  if (stream_ != nullptr) {
+    inflateEnd(stream_);
+    delete stream_;
+  }
+}
+
+std::error_code StreamDecompressor::Inflate(const uint8_t*& input, uint32_t& input_length,
+                                            uint8_t* out, uint32_t out_length,
+                                            uint32_t& produced) {
+  produced = 0;
+  if (stream_ == nullptr) {
+    return ErrInitFailed;
+  }
+  stream_->next_in = const_cast<Bytef*>(input);
+  stream_->avail_in = input_length;
+  stream_->next_out = out;
+  stream_->avail_out = out_length;
+  std::error_code err;
+  while (stream_->avail_out > 0) {
+    const int ret = inflate(stream_, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      // the next bytes, if any, start a new stream
+      inflateReset(stream_);
+      if (stream_->avail_in == 0) {
+        break;
+      }
+      continue;
+    }
+    if (ret == Z_BUF_ERROR) {
+      // no progress possible, more input is needed
+      break;
+    }
+    if (ret != Z_OK) {
+      err = ErrCorruptStream;
+      break;
+    }
+    if (stream_->avail_in == 0) {
+      break;
+    }
+  }
+  produced = out_length - stream_->avail_out;
+  const uint32_t consumed = input_length - stream_->avail_in;
+  input += consumed;
+  input_length -= consumed;
+  total_in_ += consumed;
+  total_out_ += produced;
+  return err;
+}
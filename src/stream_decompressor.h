@@ -0,0 +1,116 @@
+/**
+ * @file stream_decompressor.h
+ * @author Lei Peng (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-01-20
+ *
+ */
+#ifndef SRC_STREAM_DECOMPRESSOR_H_
+#define SRC_STREAM_DECOMPRESSOR_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <system_error>
+#include <vector>
+
+#include "streaming_parser.h"
+
+struct z_stream_s;
+
+/// @brief Inflates a compressed connection (the whole byte stream, not single frames) with the
+/// system zlib straight into the free space of a parser's ring, so decompressed bytes are written
+/// once and parsed while still in cache. Each step inflates at least the bytes the parser needs to
+/// complete its current frame. Concatenated streams are inflated one after the other. Not
+/// thread-safe, use one instance per parser.
+class StreamDecompressor final {
+ public:
+  enum class Format : uint8_t {
+    kZlib,
+    kGzip,
+    kRawDeflate,
+  };
+  static const std::error_code ErrInitFailed;
+  static const std::error_code ErrCorruptStream;
+  static const std::error_code ErrBufferFull;
+
+  explicit StreamDecompressor(Format format, uint32_t min_chunk_length = 4096);
+  StreamDecompressor(const StreamDecompressor&) = delete;
+  StreamDecompressor& operator=(const StreamDecompressor&) = delete;
+  ~StreamDecompressor();
+
+  /// @brief Inflate `length` compressed bytes into `parser`, which parses them as they arrive.
+  /// Returns `ErrBufferFull` when the ring fills up (e.g. the parser is deferred): the compressed
+  /// bytes left are kept and inflated by the next `Feed` or `Resume`.
+  template <typename ProtoHeader>
+  std::error_code Feed(StreamingParser<ProtoHeader>& parser, const uint8_t* data, uint32_t length);
+
+  /// @brief Continue inflating the compressed bytes kept by an `ErrBufferFull`.
+  template <typename ProtoHeader>
+  std::error_code Resume(StreamingParser<ProtoHeader>& parser) {
+    return Feed(parser, nullptr, 0);
+  }
+
+  /// @brief Compressed bytes waiting for room in the ring.
+  uint32_t pending_bytes() const { return static_cast<uint32_t>(pending_input_.size()); }
+
+  uint64_t total_in() const { return total_in_; }
+  uint64_t total_out() const { return total_out_; }
+
+ private:
+  /// @brief Inflate from `input` into `out`, advancing `input` past the bytes consumed.
+  std::error_code Inflate(const uint8_t*& input, uint32_t& input_length, uint8_t* out,
+                          uint32_t out_length, uint32_t& produced);
+
+  z_stream_s* stream_ = nullptr;
+  uint32_t min_chunk_length_;
+  bool output_pending_ = false;  // the last step filled its region, zlib may hold more output
+  std::vector<uint8_t> pending_input_;
+  uint64_t total_in_ = 0;
+  uint64_t total_out_ = 0;
+};
+
+template <typename ProtoHeader>
+std::error_code StreamDecompressor::Feed(StreamingParser<ProtoHeader>& parser, const uint8_t* data,
+                                         uint32_t length) {
+  const bool from_pending = !pending_input_.empty();
+  if (from_pending && length > 0) {
+    pending_input_.insert(pending_input_.end(), data, data + length);
+  }
+  const uint8_t* input = from_pending ? pending_input_.data() : data;
+  uint32_t input_length = from_pending ? pending_bytes() : length;
+  std::error_code err;
+  while (input_length > 0 || output_pending_) {
+    uint32_t reserved = 0;
+    uint8_t* out =
+        parser.ReserveInput(std::max(parser.bytes_needed(), min_chunk_length_), reserved);
+    if (reserved == 0) {
+      err = ErrBufferFull;
+      break;
+    }
+    uint32_t produced = 0;
+    const uint32_t input_before = input_length;
+    err = Inflate(input, input_length, out, reserved, produced);
+    if (produced > 0) {
+      parser.CommitInput(produced);
+    }
+    if (err) {
+      break;
+    }
+    output_pending_ = produced == reserved;
+    if (produced == 0 && input_before == input_length) {
+      // zlib needs more input
+      break;
+    }
+  }
+  if (err && err != ErrBufferFull) {
+    pending_input_.clear();
+  } else if (from_pending) {
+    pending_input_.erase(pending_input_.begin(), pending_input_.end() - input_length);
+  } else {
+    pending_input_.assign(input, input + input_length);
+  }
+  return err;
+}
+
+#endif  // SRC_STREAM_DECOMPRESSOR_H_
@@ -0,0 +1,150 @@
+#include "stream_decompressor.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "streaming_parser.h"
+
+struct PackedHeader {
+  uint32_t body_length;
+  uint16_t msg_type;
+};
+
+namespace {
+/// @brief Frames whose bodies repeat the low byte of their msg_type.
+std::vector<uint8_t> EncodeFrames(uint16_t count) {
+  std::vector<uint8_t> stream;
+  for (uint16_t msg_type = 0; msg_type < count; ++msg_type) {
+    const uint32_t body_length = (msg_type * 37) % 300;
+    PackedHeader header = {};
+    header.msg_type = msg_type;
+    header.body_length = htonl(body_length);
+    const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+    stream.insert(stream.end(), raw, raw + sizeof(header));
+    stream.insert(stream.end(), body_length, static_cast<uint8_t>(msg_type));
+  }
+  return stream;
+}
+
+/// @brief Compress `plain` with the given zlib window bits (15 zlib, 31 gzip, -15 raw deflate).
+std::vector<uint8_t> Deflate(const std::vector<uint8_t>& plain, int window_bits) {
+  z_stream stream{};
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+  std::vector<uint8_t> out(deflateBound(&stream, plain.size()));
+  stream.next_in = const_cast<Bytef*>(plain.data());
+  stream.avail_in = static_cast<uInt>(plain.size());
+  stream.next_out = out.data();
+  stream.avail_out = static_cast<uInt>(out.size());
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+struct Delivered {
+  std::vector<uint16_t> types;
+  uint64_t body_bytes = 0;
+  bool bodies_intact = true;
+};
+
+std::unique_ptr<StreamingParser<PackedHeader>> MakeParser(Delivered& delivered) {
+  auto current_type = std::make_shared<uint16_t>(0);
+  return std::make_unique<StreamingParser<PackedHeader>>(
+      [&delivered, current_type](const PackedHeader& header) {
+        delivered.types.push_back(header.msg_type);
+        *current_type = header.msg_type;
+        return true;
+      },
+      [&delivered, current_type](const uint8_t* data, uint32_t length) {
+        delivered.body_bytes += length;
+        delivered.bodies_intact &= std::all_of(data, data + length, [&](uint8_t byte) {
+          return byte == static_cast<uint8_t>(*current_type);
+        });
+        return true;
+      });
+}
+}  // namespace
+
+TEST(StreamDecompressor, inflate_into_parser) {
+  const auto plain = EncodeFrames(500);
+  const auto compressed = Deflate(plain, MAX_WBITS);
+  Delivered delivered;
+  auto parser = MakeParser(delivered);
+  StreamDecompressor decompressor(StreamDecompressor::Format::kZlib, 64);
+  // feed in small, odd sized pieces so frames and zlib blocks straddle them
+  for (size_t offset = 0; offset < compressed.size(); offset += 7) {
+    const auto n = static_cast<uint32_t>(std::min<size_t>(7, compressed.size() - offset));
+    EXPECT_FALSE(decompressor.Feed(*parser, compressed.data() + offset, n));
+  }
+  ASSERT_EQ(delivered.types.size(), 500);
+  for (uint16_t i = 0; i < 500; ++i) {
+    EXPECT_EQ(delivered.types[i], i);
+  }
+  EXPECT_TRUE(delivered.bodies_intact);
+  EXPECT_EQ(decompressor.total_in(), compressed.size());
+  EXPECT_EQ(decompressor.total_out(), plain.size());
+  EXPECT_EQ(delivered.body_bytes + 500 * sizeof(PackedHeader), plain.size());
+}
+
+TEST(StreamDecompressor, concatenated_gzip_and_raw_deflate) {
+  const auto plain = EncodeFrames(40);
+  auto compressed = Deflate(plain, MAX_WBITS + 16);
+  const auto second = Deflate(plain, MAX_WBITS + 16);
+  compressed.insert(compressed.end(), second.begin(), second.end());
+  Delivered delivered;
+  auto parser = MakeParser(delivered);
+  StreamDecompressor gzip(StreamDecompressor::Format::kGzip);
+  EXPECT_FALSE(gzip.Feed(*parser, compressed.data(), compressed.size()));
+  EXPECT_EQ(delivered.types.size(), 80);
+  EXPECT_TRUE(delivered.bodies_intact);
+
+  const auto raw = Deflate(plain, -MAX_WBITS);
+  Delivered raw_delivered;
+  auto raw_parser = MakeParser(raw_delivered);
+  StreamDecompressor deflate(StreamDecompressor::Format::kRawDeflate);
+  EXPECT_FALSE(deflate.Feed(*raw_parser, raw.data(), raw.size()));
+  EXPECT_EQ(raw_delivered.types.size(), 40);
+}
+
+TEST(StreamDecompressor, resume_after_buffer_full) {
+  const auto plain = EncodeFrames(200);
+  const auto compressed = Deflate(plain, MAX_WBITS);
+  Delivered delivered;
+  auto parser = MakeParser(delivered);
+  // one frame per second, the parser defers and the ring fills up
+  IngressLimits limits;
+  limits.frames_per_second = 1;
+  limits.action = RateLimitAction::kDefer;
+  parser->SetIngressLimits(limits);
+  StreamDecompressor decompressor(StreamDecompressor::Format::kZlib);
+  EXPECT_EQ(decompressor.Feed(*parser, compressed.data(), compressed.size()),
+            StreamDecompressor::ErrBufferFull);
+  EXPECT_TRUE(parser->deferred());
+  EXPECT_GT(decompressor.pending_bytes(), 0);
+  EXPECT_LT(delivered.types.size(), 200);
+
+  parser->SetIngressLimits(IngressLimits{});
+  parser->ParseBuffered();
+  EXPECT_FALSE(decompressor.Resume(*parser));
+  EXPECT_EQ(decompressor.pending_bytes(), 0);
+  ASSERT_EQ(delivered.types.size(), 200);
+  EXPECT_EQ(delivered.types.back(), 199);
+  EXPECT_TRUE(delivered.bodies_intact);
+}
+
+TEST(StreamDecompressor, corrupt_stream) {
+  auto compressed = Deflate(EncodeFrames(20), MAX_WBITS);
+  // break the adler32 trailer
+  compressed.back() ^= 0xFF;
+  Delivered delivered;
+  auto parser = MakeParser(delivered);
+  StreamDecompressor decompressor(StreamDecompressor::Format::kZlib);
+  EXPECT_EQ(decompressor.Feed(*parser, compressed.data(), compressed.size()),
+            StreamDecompressor::ErrCorruptStream);
+  EXPECT_EQ(decompressor.pending_bytes(), 0);
+  EXPECT_EQ(delivered.types.size(), 20);
+}
@@ -11,14 +11,27 @@
 
 #include <arpa/inet.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <string>
+#include <system_error>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
+#include "body_hash.h"
+#include "header_filter.h"
+#include "header_view.h"
+#include "load_meter.h"
+#include "rate_limiter.h"
 #include "ring_buffer.h"
+#include "segment_chain.h"
 
 template <typename T, typename = void>
 struct has_body_length : std::false_type {};
@@ -38,6 +51,34 @@ class StreamingParser {
                 "ProtoHeader body_length field must be uint16_t or uint32_t");
   using HeaderHandler = std::function<bool(const ProtoHeader& header)>;
   using BodyHandler = std::function<bool(const uint8_t* data, uint32_t length)>;
+  /// @brief A complete frame buffered in the ring, see `PeekFrame`.
+  struct FrameView {
+    ProtoHeader header;  // with body_length converted to host order
+    const uint8_t* body;
+    uint32_t body_length;
+  };
+  /// @brief Receives a body that spans several input segments as a list of pieces.
+  using ScatterBodyHandler = std::function<bool(const iovec* iov, uint32_t iovcnt, uint32_t length)>;
+  /// @brief Called for a frame over the ingress limits with `RateLimitAction::kSignal`; returns
+  /// whether the frame is delivered anyway.
+  using RateLimitHandler = std::function<bool(const ProtoHeader& header)>;
+  /// @brief Receives the header as a view over its bytes in the ring, see `SetHeaderViewHandler`.
+  using HeaderViewHandler = std::function<bool(const HeaderView<ProtoHeader>& header)>;
+  /// @brief Sees the header of a frame about to be handled, see `SetPrefetchDistance`.
+  using PrefetchHandler = std::function<void(const ProtoHeader& header)>;
+  /// @brief Receives a frame without a body (heartbeat, ack, ...) in a single step.
+  using ControlFrameHandler = std::function<bool(const ProtoHeader& header)>;
+  /// @brief Authenticates and decrypts the body made of `first` followed by `second` into `out`.
+  /// `out` is `first` when the body is decrypted in place; returns false when the tag is invalid.
+  using BodyDecryptor =
+      std::function<bool(const ProtoHeader& header, const uint8_t* first, uint32_t first_length,
+                         const uint8_t* second, uint32_t second_length, uint8_t* out)>;
+  /// @brief How frames without a body are handled. The parser knows no message types, a control
+  /// frame is any frame with `body_length == 0`.
+  enum class ControlFrameMode : uint8_t {
+    kDeliver,  // call the control frame handler, or the header handler when none is set
+    kCount,    // only count them, runs of such frames are drained at once
+  };
   StreamingParser(HeaderHandler&& header_handler, BodyHandler&& body_handler)
       : header_handler_(std::move(header_handler)), body_handler_(std::move(body_handler)) {}
   virtual ~StreamingParser() = default;
@@ -45,19 +86,254 @@ class StreamingParser {
   /// @brief The interface to feed data into the parser.
   bool HandleData(const uint8_t* data, uint32_t length);
 
+  /// @brief Feed a chain of externally owned segments without copying them into the ring. Frames
+  /// inside one segment are delivered in place, bodies spanning segments go to the scatter body
+  /// handler (or are linearized when none is set). Each segment is released once its last frame
+  /// has been consumed; a trailing partial frame keeps its segments until the next call.
+  bool HandleSegments(InputSegment* chain);
+
+  /// @brief Copy the bytes still borrowed from input segments (a trailing partial frame) into the
+  /// ring and release the segments, e.g. before their owner reuses the memory. Returns false when
+  /// the ring cannot hold them.
+  bool DetachSegments() { return MoveSegmentsToRing(input_segments_.buffered_bytes()); }
+
+  /// @brief Deliver bodies that span input segments as scatter lists instead of linearizing them.
+  void SetScatterBodyHandler(ScatterBodyHandler&& handler) {
+    scatter_body_handler_ = std::move(handler);
+  }
+
+  /// @brief Buffer data without parsing it, for callers pulling frames with `PeekFrame`.
+  bool BufferData(const uint8_t* data, uint32_t length);
+
+  /// @brief Reserve up to `length` bytes of contiguous free space in the ring, for a producer that
+  /// writes the input in place (e.g. a decompressor). Sets `reserved` to the size of the region,
+  /// which is 0 when the ring is full.
+  uint8_t* ReserveInput(uint32_t length, uint32_t& reserved);
+
+  /// @brief Publish `length` bytes written into the region returned by `ReserveInput` and parse
+  /// them. Returns false when `length` exceeds the reserved region.
+  bool CommitInput(uint32_t length);
+
+  /// @brief Pull mode: view the next complete frame without consuming it. The body points into
+  /// the ring, or into a scratch buffer when it wraps around, and stays valid until `PopFrame`.
+  /// Handlers, filter and ingress limits are not applied to pulled frames.
+  bool PeekFrame(FrameView& frame);
+
+  /// @brief Pull mode: decode the header of the complete frame starting `offset` bytes past the
+  /// head of the ring.
+  bool PeekHeader(uint32_t offset, ProtoHeader& header);
+
+  /// @brief Pull mode: consume the frame returned by the last successful `PeekFrame`.
+  void PopFrame(const FrameView& frame) {
+    recv_buffer_.drain(protocol_header_length + frame.body_length);
+    if (persisted_ != nullptr) {
+      SavePersistedState();
+    }
+  }
+
+  /// @brief Bytes the ring still needs before the parser can make progress.
+  uint32_t bytes_needed() const;
+
+  /// @brief Only deliver frames whose header matches `filter`. The bodies of the other frames are
+  /// drained from the ring without reaching any handler. Buffered headers are evaluated in batches.
+  /// Returns false, keeping the current filter, when `filter` is not valid.
+  bool SetHeaderFilter(HeaderFilter<ProtoHeader> filter);
+
+  /// @brief Number of frames dropped by the header filter.
+  uint64_t filtered_frames() const { return filtered_frames_; }
+
+  /// @brief Limit the frames and bytes (header plus body) accepted per second. Limits are checked
+  /// when a header is decoded, against a coarse clock read once per `HandleData` call.
+  void SetIngressLimits(const IngressLimits& limits, RateLimitHandler&& handler = nullptr);
+
+  /// @brief Parse the frames already buffered, e.g. to resume a connection deferred by the ingress
+  /// limits. Returns whether the parser is still deferred.
+  bool ParseBuffered();
+
+  /// @brief Whether parsing is paused by `RateLimitAction::kDefer`. While deferred, incoming bytes
+  /// stay in the ring and `HandleData` fails once it is full.
+  bool deferred() const { return deferred_; }
+
+  /// @brief Nanoseconds until the deferred frame fits the ingress limits.
+  uint64_t defer_wait_ns() const;
+
+  /// @brief Deliver frames with `body_length == 0` to `handler` instead of the header handler. They
+  /// never enter the body state either way.
+  void SetControlFrameHandler(ControlFrameHandler&& handler) {
+    control_frame_handler_ = std::move(handler);
+  }
+
+  /// @brief Deliver headers to `handler` as views over the ring instead of copies to the header
+  /// handler. Only `body_length` is decoded up front, the other fields when the handler reads them.
+  /// A header wrapping around the end of the ring is copied into a scratch buffer first. With a
+  /// body decryptor set, headers are still copied.
+  void SetHeaderViewHandler(HeaderViewHandler&& handler) {
+    header_view_handler_ = std::move(handler);
+    header_bytes_ = nullptr;
+  }
+
+  /// @brief With `ControlFrameMode::kCount`, frames without a body reach no handler and are only
+  /// tallied in `control_frames`. They are still subject to the header filter, the ingress limits
+  /// and the body decryptor like any other frame: a filtered one counts in `filtered_frames`, one
+  /// over the limits takes a token or is rate limited, and one failing authentication is rejected.
+  /// Runs of them are drained at once only while none of the three is configured.
+  void SetControlFrameMode(ControlFrameMode mode) { control_frame_mode_ = mode; }
+
+  /// @brief Number of frames without a body delivered or tallied.
+  uint64_t control_frames() const { return control_frames_; }
+
+  /// @brief Decrypt every body before delivery, see `MakeAeadBodyDecryptor`. A body is decrypted in
+  /// place in the ring, or while being linearized when it wraps around. The header handler is
+  /// deferred until the body is authenticated, frames failing it reach no handler at all.
+  void SetBodyDecryptor(BodyDecryptor&& decryptor) {
+    body_decryptor_ = std::move(decryptor);
+    // headers are copied from now on
+    header_bytes_ = nullptr;
+  }
+
+  /// @brief Number of frames dropped because their body failed authentication.
+  uint64_t rejected_frames() const { return rejected_frames_; }
+
+  /// @brief Number of frames that exceeded the ingress limits.
+  uint64_t rate_limited_frames() const { return rate_limited_frames_; }
+
+  /// @brief Hash every body with XXH64 while it is being buffered, a piece per `HandleData` call,
+  /// e.g. to look it up in a `DecodeCache`. With a body decryptor set the plaintext is hashed once
+  /// decrypted instead.
+  void SetBodyHashing(bool enabled) { hash_bodies_ = enabled; }
+
+  /// @brief The hash of the body being delivered, valid during the body handler.
+  uint64_t body_digest() const { return body_digest_; }
+
+  /// @brief Keep the ring in the file at `path` (see `RingBuffer::persist`), together with the
+  /// parser state matching its read position, saved after every step. A file left by a parser that
+  /// stopped or crashed is recovered in O(1) and its buffered bytes parsed at once: a body that was
+  /// being buffered is completed without replaying the stream, its header is delivered again
+  /// first. Frames whose handler was interrupted are delivered again, and a body decrypted in place
+  /// is then rejected. Borrowed input segments are copied into the ring from now on.
+  std::error_code PersistTo(const std::string& path);
+
+  /// @brief Keep moving averages of the input bytes and of the time spent parsing them, handlers
+  /// included, per second, see `LoadMeter`. Costs two clock reads per call feeding data.
+  void SetLoadTracking(bool enabled, uint64_t half_life_ns = LoadMeter::kDefaultHalfLifeNs) {
+    track_load_ = enabled;
+    load_meter_.Reset(half_life_ns);
+    unmetered_bytes_ = 0;
+  }
+
+  /// @brief The load of this connection, may be read from any thread.
+  const LoadMeter& load() const { return load_meter_; }
+
+  /// @brief Software pipelining: before a frame is handled from the ring, the headers of the next
+  /// `frames` buffered frames are decoded and their bodies (up to `max_body_bytes` each) and the
+  /// header after them are prefetched, so that the cache misses overlap the handlers of the frames
+  /// before. 0 disables it. Frames parsed in place from input segments are not prefetched.
+  void SetPrefetchDistance(uint32_t frames, uint32_t max_body_bytes = 512) {
+    prefetch_distance_ = frames;
+    prefetch_body_bytes_ = max_body_bytes;
+    prefetch_ends_.clear();
+  }
+
+  /// @brief Receives the header of each frame as it is prefetched, `frames` ahead of its handling,
+  /// e.g. to prefetch the object chosen by its message type.
+  void SetPrefetchHandler(PrefetchHandler&& handler) { prefetch_handler_ = std::move(handler); }
+
+  /// @brief Whether no frame is partially delivered, e.g. for moving the parser to another thread
+  /// without splitting a frame between the handlers of both.
+  bool at_frame_boundary() const { return recv_state_ == RecvState::READ_HEADER && !deferred_; }
+
  private:
+  enum class Admission : uint8_t { kDeliver, kSkip, kDefer };
+
   void DoBytesOrderConversion(ProtoHeader& header);
-  bool PerformStreamingParse();
+  template <typename Source>
+  bool PerformStreamingParse(Source& source);
+  template <typename Source>
+  bool MatchHeaderFilter(const Source& source, uint32_t body_offset);
+  Admission AdmitFrame();
+  void PopFilterVerdict();
+  template <typename Source>
+  void CountControlFrames(Source& source);
+  template <typename Source>
+  void LoadHeader(const Source& source);
+  const ProtoHeader& FullHeader();
+  void DeliverHeader();
+  void ReadBody(RingBuffer& source);
+  void ReadBody(SegmentQueue& source);
+  bool DecryptBody(const uint8_t* first, uint32_t first_length, const uint8_t* second,
+                   uint32_t second_length, uint8_t* out);
+  bool MoveSegmentsToRing(uint32_t length);
+  template <typename Source>
+  void HashBody(const Source& source);
+  void ParseRing();
+  void SavePersistedState();
+  void PrefetchAhead();
+
+  /// @brief The state saved in the persistent file, two slots written in turn so that a crash
+  /// while writing one leaves the other valid.
+  struct PersistedSlot {
+    uint64_t read_position;
+    uint32_t skip_remaining;
+    uint8_t recv_state;
+    uint8_t header[sizeof(ProtoHeader)];  // with body_length in host order
+  };
+  struct PersistedState {
+    std::atomic<uint32_t> active;  // 0 before the first save, else the valid slot plus one
+    PersistedSlot slots[2];
+  };
+  static_assert(sizeof(PersistedState) <= RingBuffer::persistent_state_length,
+                "ProtoHeader is too large to be persisted");
 
   enum class RecvState : uint8_t {
     READ_HEADER,
     READ_BODY,
+    SKIP_BODY,
   };
   RecvState recv_state_ = RecvState::READ_HEADER;
   ProtoHeader current_header_;
+  uint32_t skip_remaining_ = 0;  // body bytes left to drain in SKIP_BODY
+  HeaderFilter<ProtoHeader> header_filter_;
+  uint64_t filter_verdicts_ = 0;      // pending match bits of already evaluated headers
+  uint32_t filter_verdict_count_ = 0;  // number of valid bits in `filter_verdicts_`
+  uint64_t filtered_frames_ = 0;
+  IngressLimits ingress_limits_;
+  RateLimitHandler rate_limit_handler_;
+  TokenBucket frame_bucket_;
+  TokenBucket byte_bucket_;
+  bool rate_limited_ = false;
+  bool deferred_ = false;
+  uint64_t coarse_now_ns_ = 0;
+  uint64_t rate_limited_frames_ = 0;
+  BodyDecryptor body_decryptor_;
+  uint64_t rejected_frames_ = 0;
+  ControlFrameHandler control_frame_handler_;
+  HeaderViewHandler header_view_handler_;
+  const uint8_t* header_bytes_ = nullptr;  // the raw current header in view mode
+  uint8_t header_scratch_[sizeof(ProtoHeader)];  // a view header that wraps around the ring
+  bool hash_bodies_ = false;
+  BodyHasher body_hasher_;
+  uint32_t hashed_bytes_ = 0;  // body bytes already fed to `body_hasher_`
+  uint64_t body_digest_ = 0;
+  std::vector<iovec> hash_iov_;
+  ControlFrameMode control_frame_mode_ = ControlFrameMode::kDeliver;
+  uint64_t control_frames_ = 0;
   HeaderHandler header_handler_;
   BodyHandler body_handler_;
+  ScatterBodyHandler scatter_body_handler_;
   RingBuffer recv_buffer_;
+  SegmentQueue input_segments_;  // borrowed bytes queued behind `recv_buffer_`
+  std::vector<iovec> scatter_iov_;
+  std::vector<uint8_t> linear_body_;  // linearized body spanning segments
+  PersistedState* persisted_ = nullptr;  // in the persistent file of `recv_buffer_`
+  uint32_t prefetch_distance_ = 0;
+  uint32_t prefetch_body_bytes_ = 0;
+  PrefetchHandler prefetch_handler_;
+  uint64_t prefetch_next_ = 0;          // the ring position of the next frame to prefetch
+  std::deque<uint64_t> prefetch_ends_;  // the end positions of the frames prefetched and pending
+  std::vector<iovec> prefetch_iov_;
+  bool track_load_ = false;
+  LoadMeter load_meter_;
+  uint64_t unmetered_bytes_ = 0;  // input bytes not recorded in `load_meter_` yet
 };
 
 template <typename ProtoHeader>
@@ -69,33 +345,612 @@ void StreamingParser<ProtoHeader>::DoBytesOrderConversion(ProtoHeader& header) {
   }
 }
 
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::SetHeaderFilter(HeaderFilter<ProtoHeader> filter) {
+  if (!filter.valid()) {
+    return false;
+  }
+  header_filter_ = std::move(filter);
+  filter_verdicts_ = 0;
+  filter_verdict_count_ = 0;
+  return true;
+}
+
+template <typename ProtoHeader>
+void StreamingParser<ProtoHeader>::SetIngressLimits(const IngressLimits& limits,
+                                                    RateLimitHandler&& handler) {
+  ingress_limits_ = limits;
+  rate_limit_handler_ = std::move(handler);
+  coarse_now_ns_ = ingress_limits_.clock();
+  frame_bucket_ = TokenBucket(limits.frames_per_second, limits.frame_burst, coarse_now_ns_);
+  byte_bucket_ = TokenBucket(limits.bytes_per_second, limits.byte_burst, coarse_now_ns_);
+  rate_limited_ = !frame_bucket_.unlimited() || !byte_bucket_.unlimited();
+  deferred_ = false;
+}
+
+template <typename ProtoHeader>
+uint64_t StreamingParser<ProtoHeader>::defer_wait_ns() const {
+  if (!deferred_) {
+    return 0;
+  }
+  return std::max(frame_bucket_.WaitTimeNs(1),
+                  byte_bucket_.WaitTimeNs(protocol_header_length + current_header_.body_length));
+}
+
 template <typename ProtoHeader>
 bool StreamingParser<ProtoHeader>::HandleData(const uint8_t* data, uint32_t length) {
+  if (!BufferData(data, length)) {
+    return false;
+  }
+  ParseBuffered();
+  return true;
+}
+
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::BufferData(const uint8_t* data, uint32_t length) {
+  // bytes still borrowed from input segments come first
+  if (!MoveSegmentsToRing(input_segments_.buffered_bytes())) {
+    return false;
+  }
   auto err = recv_buffer_.write(data, length);
   if (err == RingBuffer::ErrBufferOverflow) {
     return false;
   }
-  while ((recv_state_ == RecvState::READ_HEADER &&
-          recv_buffer_.buffered_bytes() >= protocol_header_length) ||
-         (recv_state_ == RecvState::READ_BODY &&
-          recv_buffer_.buffered_bytes() >= current_header_.body_length)) {
-    if (PerformStreamingParse()) {
-      // waiting for more bytes to proceed
+  unmetered_bytes_ += length;
+  return true;
+}
+
+template <typename ProtoHeader>
+uint8_t* StreamingParser<ProtoHeader>::ReserveInput(uint32_t length, uint32_t& reserved) {
+  if (!MoveSegmentsToRing(input_segments_.buffered_bytes())) {
+    reserved = 0;
+    return nullptr;
+  }
+  return recv_buffer_.reserve(length, reserved);
+}
+
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::CommitInput(uint32_t length) {
+  if (length > 0 && recv_buffer_.commit(length)) {
+    return false;
+  }
+  unmetered_bytes_ += length;
+  ParseBuffered();
+  return true;
+}
+
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::HandleSegments(InputSegment* chain) {
+  const uint32_t buffered = input_segments_.buffered_bytes();
+  input_segments_.append(chain);
+  unmetered_bytes_ += input_segments_.buffered_bytes() - buffered;
+  ParseBuffered();
+  return true;
+}
+
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::ParseBuffered() {
+  if (rate_limited_) {
+    coarse_now_ns_ = ingress_limits_.clock();
+  }
+  deferred_ = false;
+  const uint64_t start_ns = track_load_ ? MonotonicNowNs() : 0;
+  ParseRing();
+  // a frame started in the ring is completed with bytes copied from the segments, the following
+  // frames are parsed in place. Only the ring is persistent, a persistent parser copies them all.
+  const bool persistent = persisted_ != nullptr;
+  while (!deferred_ && (persistent || !recv_buffer_.empty()) && !input_segments_.empty()) {
+    const uint32_t stitch =
+        persistent ? std::min(recv_buffer_.capacity() - recv_buffer_.buffered_bytes(),
+                              input_segments_.buffered_bytes())
+                   : std::min(bytes_needed(), input_segments_.buffered_bytes());
+    if (stitch == 0 || !MoveSegmentsToRing(stitch)) {
+      break;
+    }
+    ParseRing();
+  }
+  if (!deferred_ && !persistent && recv_buffer_.empty()) {
+    while (!PerformStreamingParse(input_segments_)) {
+      // keep parsing until more bytes are needed to proceed
+    }
+  }
+  if (track_load_) {
+    const uint64_t end_ns = MonotonicNowNs();
+    load_meter_.Record(unmetered_bytes_, end_ns - start_ns, end_ns);
+    unmetered_bytes_ = 0;
+  }
+  return deferred_;
+}
+
+template <typename ProtoHeader>
+void StreamingParser<ProtoHeader>::ParseRing() {
+  bool needs_bytes = false;
+  while (!needs_bytes) {
+    needs_bytes = PerformStreamingParse(recv_buffer_);
+    if (persisted_ != nullptr) {
+      SavePersistedState();
+    }
+  }
+}
+
+/// @brief Prefetch the frames from the head of the ring up to `prefetch_distance_` frames past it.
+/// Called at a frame boundary. The header of each new frame was itself prefetched one step before,
+/// with the body ahead of it. The ring is only locked to locate the bytes, which cannot change
+/// while the parser runs.
+template <typename ProtoHeader>
+void StreamingParser<ProtoHeader>::PrefetchAhead() {
+  constexpr uint32_t kCacheLine = 64;
+  const uint64_t head = recv_buffer_.read_position();
+  while (!prefetch_ends_.empty() && prefetch_ends_.front() <= head) {
+    prefetch_ends_.pop_front();
+  }
+  if (prefetch_ends_.empty()) {
+    prefetch_next_ = head;
+  }
+  if (prefetch_ends_.size() > prefetch_distance_) {
+    return;
+  }
+  prefetch_iov_.clear();
+  const auto first_offset = static_cast<uint32_t>(prefetch_next_ - head);
+  const uint32_t available = recv_buffer_.gather(first_offset, UINT32_MAX, prefetch_iov_);
+  // the bytes past `first_offset`, in at most two pieces
+  auto at = [this](uint32_t offset) {
+    const auto& first = prefetch_iov_[0];
+    return offset < first.iov_len
+               ? static_cast<const uint8_t*>(first.iov_base) + offset
+               : static_cast<const uint8_t*>(prefetch_iov_[1].iov_base) + (offset - first.iov_len);
+  };
+  auto prefetch = [&](uint32_t offset, uint32_t length) {
+    const uint32_t last = std::min(offset + length, available);
+    for (uint32_t i = offset; i < last; i += kCacheLine) {
+      __builtin_prefetch(at(i), 0, 3);
+    }
+  };
+  uint32_t offset = 0;
+  while (prefetch_ends_.size() <= prefetch_distance_ &&
+         offset + protocol_header_length <= available) {
+    ProtoHeader header;
+    auto* raw = reinterpret_cast<uint8_t*>(&header);
+    const uint8_t* bytes = at(offset);
+    if (offset + protocol_header_length <= prefetch_iov_[0].iov_len ||
+        offset >= prefetch_iov_[0].iov_len) {
+      std::memcpy(raw, bytes, protocol_header_length);
+    } else {
+      for (uint32_t i = 0; i < protocol_header_length; ++i) {
+        raw[i] = *at(offset + i);
+      }
+    }
+    DoBytesOrderConversion(header);
+    const uint32_t body_offset = offset + protocol_header_length;
+    prefetch(body_offset, std::min<uint32_t>(header.body_length, prefetch_body_bytes_));
+    const uint64_t end = static_cast<uint64_t>(body_offset) + header.body_length;
+    if (end < available) {
+      prefetch(static_cast<uint32_t>(end), protocol_header_length);
+    }
+    if (prefetch_handler_) {
+      prefetch_handler_(header);
+    }
+    prefetch_next_ += end - offset;
+    prefetch_ends_.push_back(prefetch_next_);
+    if (end >= available) {
+      break;
+    }
+    offset = static_cast<uint32_t>(end);
+  }
+}
+
+/// @brief Save the state into the slot not holding the last one, then publish it.
+template <typename ProtoHeader>
+void StreamingParser<ProtoHeader>::SavePersistedState() {
+  const uint32_t next = persisted_->active.load(std::memory_order_relaxed) == 1 ? 1 : 0;
+  PersistedSlot& slot = persisted_->slots[next];
+  slot.read_position = recv_buffer_.read_position();
+  slot.skip_remaining = skip_remaining_;
+  slot.recv_state = static_cast<uint8_t>(recv_state_);
+  std::memcpy(slot.header, &current_header_, sizeof(ProtoHeader));
+  persisted_->active.store(next + 1, std::memory_order_release);
+}
+
+template <typename ProtoHeader>
+std::error_code StreamingParser<ProtoHeader>::PersistTo(const std::string& path) {
+  bool recovered = false;
+  auto err = recv_buffer_.persist(path, recovered);
+  if (err) {
+    return err;
+  }
+  persisted_ = reinterpret_cast<PersistedState*>(recv_buffer_.persistent_state());
+  const uint32_t active = persisted_->active.load(std::memory_order_acquire);
+  if (!recovered || (active != 1 && active != 2)) {
+    SavePersistedState();
+    ParseBuffered();
+    return std::error_code();
+  }
+  // the ring may have published a read the state did not catch up with, those bytes are read again
+  const PersistedSlot& slot = persisted_->slots[active - 1];
+  if (slot.recv_state > static_cast<uint8_t>(RecvState::SKIP_BODY) ||
+      !recv_buffer_.rewind_read_position(slot.read_position)) {
+    persisted_ = nullptr;
+    return RingBuffer::ErrPersistMismatch;
+  }
+  recv_state_ = static_cast<RecvState>(slot.recv_state);
+  skip_remaining_ = slot.skip_remaining;
+  std::memcpy(&current_header_, slot.header, sizeof(ProtoHeader));
+  filter_verdicts_ = 0;
+  filter_verdict_count_ = 0;
+  body_hasher_.Reset();
+  hashed_bytes_ = 0;
+  if (recv_state_ == RecvState::READ_BODY && !body_decryptor_) {
+    // the handlers of this process have not seen the header of the body being buffered
+    if (header_view_handler_) {
+      ProtoHeader wire = current_header_;
+      DoBytesOrderConversion(wire);
+      std::memcpy(header_scratch_, &wire, protocol_header_length);
+      header_bytes_ = header_scratch_;
+    }
+    DeliverHeader();
+    header_bytes_ = nullptr;
+  }
+  ParseBuffered();
+  return std::error_code();
+}
+
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::PeekHeader(uint32_t offset, ProtoHeader& header) {
+  // only at a frame boundary, a frame partially consumed by `HandleData` cannot be pulled
+  if (recv_state_ != RecvState::READ_HEADER ||
+      recv_buffer_.peek(offset, reinterpret_cast<uint8_t*>(&header), protocol_header_length) <
+          protocol_header_length) {
+    return false;
+  }
+  DoBytesOrderConversion(header);
+  return static_cast<uint64_t>(offset) + protocol_header_length + header.body_length <=
+         recv_buffer_.buffered_bytes();
+}
+
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::PeekFrame(FrameView& frame) {
+  if (!PeekHeader(0, frame.header)) {
+    return false;
+  }
+  frame.body_length = frame.header.body_length;
+  frame.body = recv_buffer_.contiguous_data(protocol_header_length, frame.body_length);
+  if (frame.body == nullptr && frame.body_length > 0) {
+    linear_body_.resize(frame.body_length);
+    recv_buffer_.peek(protocol_header_length, linear_body_.data(), frame.body_length);
+    frame.body = linear_body_.data();
+  }
+  return true;
+}
+
+template <typename ProtoHeader>
+uint32_t StreamingParser<ProtoHeader>::bytes_needed() const {
+  const uint32_t buffered = recv_buffer_.buffered_bytes();
+  uint32_t frame_part = 0;
+  switch (recv_state_) {
+    case RecvState::READ_HEADER:
+      frame_part = protocol_header_length;
+      break;
+    case RecvState::READ_BODY:
+      frame_part = current_header_.body_length;
+      break;
+    case RecvState::SKIP_BODY:
+      frame_part = skip_remaining_;
+      break;
+    default:
       break;
+  }
+  return frame_part > buffered ? frame_part - buffered : 0;
+}
+
+/// @brief Copy the first `length` bytes of the input segments behind the ring contents.
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::MoveSegmentsToRing(uint32_t length) {
+  if (length == 0) {
+    return true;
+  }
+  if (recv_buffer_.buffered_bytes() + length > recv_buffer_.capacity()) {
+    return false;
+  }
+  scatter_iov_.clear();
+  input_segments_.gather(0, length, scatter_iov_);
+  for (const auto& piece : scatter_iov_) {
+    recv_buffer_.write(static_cast<const uint8_t*>(piece.iov_base),
+                       static_cast<uint32_t>(piece.iov_len));
+  }
+  input_segments_.drain(length);
+  return true;
+}
+
+/// @brief Check the frame of `current_header_` against the ingress limits.
+template <typename ProtoHeader>
+typename StreamingParser<ProtoHeader>::Admission StreamingParser<ProtoHeader>::AdmitFrame() {
+  if (!rate_limited_) {
+    return Admission::kDeliver;
+  }
+  const uint64_t frame_bytes = protocol_header_length + current_header_.body_length;
+  frame_bucket_.Refill(coarse_now_ns_);
+  byte_bucket_.Refill(coarse_now_ns_);
+  if (frame_bucket_.Check(1) && byte_bucket_.Check(frame_bytes)) {
+    frame_bucket_.Consume(1);
+    byte_bucket_.Consume(frame_bytes);
+    return Admission::kDeliver;
+  }
+  switch (ingress_limits_.action) {
+    case RateLimitAction::kDefer:
+      deferred_ = true;
+      return Admission::kDefer;
+    case RateLimitAction::kSignal:
+      ++rate_limited_frames_;
+      if (!rate_limit_handler_ || rate_limit_handler_(FullHeader())) {
+        frame_bucket_.Consume(1);
+        byte_bucket_.Consume(frame_bytes);
+        return Admission::kDeliver;
+      }
+      return Admission::kSkip;
+    default:
+      ++rate_limited_frames_;
+      return Admission::kSkip;
+  }
+}
+
+/// @brief Decide whether the frame of `current_header_`, whose body starts `body_offset` bytes
+/// past the head of `source`, matches the header filter. The first header of a batch is evaluated
+/// together with every following header already complete in `source`; the verdict stays queued
+/// until the caller pops it when the header is consumed.
+template <typename ProtoHeader>
+template <typename Source>
+bool StreamingParser<ProtoHeader>::MatchHeaderFilter(const Source& source, uint32_t body_offset) {
+  if (header_filter_.empty()) {
+    return true;
+  }
+  if (filter_verdict_count_ == 0) {
+    ProtoHeader batch[HeaderFilter<ProtoHeader>::max_batch_size];
+    // in view mode only body_length was decoded so far
+    batch[0] = FullHeader();
+    uint32_t count = 1;
+    uint64_t offset = static_cast<uint64_t>(body_offset) + current_header_.body_length;
+    const uint32_t buffered = source.buffered_bytes();
+    while (count < HeaderFilter<ProtoHeader>::max_batch_size &&
+           offset + protocol_header_length <= buffered) {
+      source.peek(static_cast<uint32_t>(offset), reinterpret_cast<uint8_t*>(&batch[count]),
+                  protocol_header_length);
+      DoBytesOrderConversion(batch[count]);
+      offset += protocol_header_length + batch[count].body_length;
+      ++count;
     }
+    filter_verdicts_ = header_filter_.Evaluate(batch, count);
+    filter_verdict_count_ = count;
+  }
+  return filter_verdicts_ & 1;
+}
+
+template <typename ProtoHeader>
+bool StreamingParser<ProtoHeader>::DecryptBody(const uint8_t* first, uint32_t first_length,
+                                               const uint8_t* second, uint32_t second_length,
+                                               uint8_t* out) {
+  if (!body_decryptor_(current_header_, first, first_length, second, second_length, out)) {
+    ++rejected_frames_;
+    return false;
+  }
+  if (hash_bodies_ && out != nullptr) {
+    body_digest_ = BodyHasher::Hash(out, first_length + second_length);
   }
   return true;
 }
 
+/// @brief Feed the body bytes buffered since the last call to the hasher, so that a large body is
+/// hashed while it arrives. The digest is final once the whole body is buffered.
+template <typename ProtoHeader>
+template <typename Source>
+void StreamingParser<ProtoHeader>::HashBody(const Source& source) {
+  const uint32_t available = std::min(source.buffered_bytes(), current_header_.body_length);
+  if (available <= hashed_bytes_) {
+    return;
+  }
+  hash_iov_.clear();
+  source.gather(hashed_bytes_, available - hashed_bytes_, hash_iov_);
+  for (const iovec& piece : hash_iov_) {
+    body_hasher_.Update(static_cast<const uint8_t*>(piece.iov_base),
+                        static_cast<uint32_t>(piece.iov_len));
+  }
+  hashed_bytes_ = available;
+  if (hashed_bytes_ == current_header_.body_length) {
+    body_digest_ = body_hasher_.Digest();
+  }
+}
+
+template <typename ProtoHeader>
+void StreamingParser<ProtoHeader>::ReadBody(RingBuffer& source) {
+  if (!body_decryptor_) {
+    source.read(current_header_.body_length,
+                [this](const uint8_t* data, uint32_t length) { return body_handler_(data, length); });
+    return;
+  }
+  source.read_in_place(current_header_.body_length, [this](uint8_t* first, uint32_t first_length,
+                                                           uint8_t* second,
+                                                           uint32_t second_length) {
+    uint8_t* out = first;
+    if (second_length > 0) {
+      linear_body_.resize(first_length + second_length);
+      out = linear_body_.data();
+    }
+    if (DecryptBody(first, first_length, second, second_length, out)) {
+      header_handler_(current_header_);
+      body_handler_(out, first_length + second_length);
+    }
+    // a rejected body is consumed as well
+    return true;
+  });
+}
+
+template <typename ProtoHeader>
+void StreamingParser<ProtoHeader>::ReadBody(SegmentQueue& source) {
+  const uint32_t length = current_header_.body_length;
+  const uint8_t* body = source.contiguous_data(0, length);
+  if (body_decryptor_) {
+    // borrowed segments are read-only, the body is decrypted into the scratch buffer
+    linear_body_.resize(length);
+    if (body == nullptr) {
+      source.peek(0, linear_body_.data(), length);
+      body = linear_body_.data();
+    }
+    if (DecryptBody(body, length, nullptr, 0, linear_body_.data())) {
+      header_handler_(current_header_);
+      body_handler_(linear_body_.data(), length);
+    }
+    source.drain(length);
+    return;
+  }
+  if (body != nullptr) {
+    body_handler_(body, length);
+  } else if (scatter_body_handler_) {
+    scatter_iov_.clear();
+    source.gather(0, length, scatter_iov_);
+    scatter_body_handler_(scatter_iov_.data(), static_cast<uint32_t>(scatter_iov_.size()), length);
+  } else {
+    linear_body_.resize(length);
+    source.peek(0, linear_body_.data(), length);
+    body_handler_(linear_body_.data(), length);
+  }
+  source.drain(length);
+}
+
 template <typename ProtoHeader>
-bool StreamingParser<ProtoHeader>::PerformStreamingParse() {
+void StreamingParser<ProtoHeader>::PopFilterVerdict() {
+  if (filter_verdict_count_ > 0) {
+    filter_verdicts_ >>= 1;
+    --filter_verdict_count_;
+  }
+}
+
+/// @brief Decode the header at the head of `source` into `current_header_`. In view mode only
+/// `body_length` is decoded and `header_bytes_` points at the raw header, in the source when it is
+/// contiguous there.
+template <typename ProtoHeader>
+template <typename Source>
+void StreamingParser<ProtoHeader>::LoadHeader(const Source& source) {
+  if (!header_view_handler_ || body_decryptor_) {
+    source.peek(0, reinterpret_cast<uint8_t*>(&current_header_), protocol_header_length);
+    DoBytesOrderConversion(current_header_);
+    return;
+  }
+  header_bytes_ = source.contiguous_data(0, protocol_header_length);
+  if (header_bytes_ == nullptr) {
+    source.peek(0, header_scratch_, protocol_header_length);
+    header_bytes_ = header_scratch_;
+  }
+  current_header_.body_length =
+      HeaderView<ProtoHeader>(header_bytes_).template get<&ProtoHeader::body_length>();
+}
+
+/// @brief The whole current header, copied from the raw bytes in view mode.
+template <typename ProtoHeader>
+const ProtoHeader& StreamingParser<ProtoHeader>::FullHeader() {
+  if (header_bytes_ != nullptr) {
+    current_header_ = HeaderView<ProtoHeader>(header_bytes_).Materialize();
+  }
+  return current_header_;
+}
+
+template <typename ProtoHeader>
+void StreamingParser<ProtoHeader>::DeliverHeader() {
+  if (header_bytes_ != nullptr) {
+    header_view_handler_(HeaderView<ProtoHeader>(header_bytes_));
+  } else {
+    header_handler_(current_header_);
+  }
+}
+
+/// @brief Tally the run of frames without a body at the head of `source` and drain it at once.
+template <typename ProtoHeader>
+template <typename Source>
+void StreamingParser<ProtoHeader>::CountControlFrames(Source& source) {
+  constexpr uint32_t kRunLength = 32;
+  ProtoHeader run[kRunLength];
+  uint32_t counted = 0;
+  bool run_continues = true;
+  while (run_continues) {
+    const uint32_t peeked = source.peek(counted * protocol_header_length,
+                                        reinterpret_cast<uint8_t*>(run), sizeof(run)) /
+                            protocol_header_length;
+    uint32_t i = 0;
+    for (; i < peeked; ++i) {
+      DoBytesOrderConversion(run[i]);
+      if (run[i].body_length != 0) {
+        break;
+      }
+      PopFilterVerdict();
+    }
+    counted += i;
+    run_continues = i == kRunLength;
+  }
+  source.drain(counted * protocol_header_length);
+  control_frames_ += counted;
+}
+
+/// @brief Advance the state machine by one step over the bytes of `source`, either the ring or the
+/// borrowed input segments. Returns true when more bytes are needed to proceed.
+template <typename ProtoHeader>
+template <typename Source>
+bool StreamingParser<ProtoHeader>::PerformStreamingParse(Source& source) {
   switch (recv_state_) {
     case RecvState::READ_HEADER:
-      if (recv_buffer_.buffered_bytes() >= protocol_header_length) {
-        recv_buffer_.read(reinterpret_cast<uint8_t*>(&current_header_), protocol_header_length);
-        DoBytesOrderConversion(current_header_);
-        header_handler_(current_header_);
-        recv_state_ = RecvState::READ_BODY;
+      if constexpr (std::is_same_v<Source, RingBuffer>) {
+        if (prefetch_distance_ > 0) {
+          PrefetchAhead();
+        }
+      }
+      if (source.buffered_bytes() >= protocol_header_length) {
+        LoadHeader(source);
+        if (current_header_.body_length == 0 && control_frame_mode_ == ControlFrameMode::kCount &&
+            header_filter_.empty() && !rate_limited_ && !body_decryptor_) {
+          CountControlFrames(source);
+          // the viewed header was drained with the run
+          header_bytes_ = nullptr;
+          break;
+        }
+        const bool matched = MatchHeaderFilter(source, protocol_header_length);
+        const Admission admission = matched ? AdmitFrame() : Admission::kDeliver;
+        if (admission == Admission::kDefer) {
+          // leave the whole frame buffered until tokens are available
+          return true;
+        }
+        const bool skipped = !matched || admission == Admission::kSkip;
+        if (current_header_.body_length == 0) {
+          // a single step frame, there is no body to wait for
+          if (skipped) {
+            filtered_frames_ += matched ? 0 : 1;
+          } else if (body_decryptor_ && !DecryptBody(nullptr, 0, nullptr, 0, nullptr)) {
+            // the tag of an empty body still authenticates the frame
+          } else if (control_frame_mode_ == ControlFrameMode::kCount) {
+            ++control_frames_;
+          } else if (control_frame_handler_) {
+            ++control_frames_;
+            control_frame_handler_(FullHeader());
+          } else {
+            ++control_frames_;
+            DeliverHeader();
+          }
+        } else if (skipped) {
+          filtered_frames_ += matched ? 0 : 1;
+          skip_remaining_ = current_header_.body_length;
+          recv_state_ = RecvState::SKIP_BODY;
+        } else {
+          if (!body_decryptor_) {
+            DeliverHeader();
+          }
+          body_hasher_.Reset();
+          hashed_bytes_ = 0;
+          recv_state_ = RecvState::READ_BODY;
+          if (persisted_ != nullptr) {
+            // the saved state keeps the whole header, to deliver it again after a restart
+            FullHeader();
+          }
+        }
+        // drained only now, a header view points at these bytes
+        source.drain(protocol_header_length);
+        PopFilterVerdict();
+        header_bytes_ = nullptr;
       } else {
         // length field not ready.
         return true;
@@ -103,10 +958,11 @@ bool StreamingParser<ProtoHeader>::PerformStreamingParse() {
       break;
     case RecvState::READ_BODY:
       assert(current_header_.body_length > 0);
-      if (recv_buffer_.buffered_bytes() >= current_header_.body_length) {
-        recv_buffer_.read(
-            current_header_.body_length,
-            [this](const uint8_t* data, uint32_t length) { return body_handler_(data, length); });
+      if (hash_bodies_ && !body_decryptor_) {
+        HashBody(source);
+      }
+      if (source.buffered_bytes() >= current_header_.body_length) {
+        ReadBody(source);
         recv_state_ = RecvState::READ_HEADER;
         current_header_.body_length = 0;
       } else {
@@ -114,6 +970,17 @@ bool StreamingParser<ProtoHeader>::PerformStreamingParse() {
         return true;
       }
       break;
+    case RecvState::SKIP_BODY: {
+      // the skipped body does not need to be fully buffered, drain whatever arrived
+      const uint32_t drained = std::min(skip_remaining_, source.buffered_bytes());
+      source.drain(drained);
+      skip_remaining_ -= drained;
+      if (skip_remaining_ > 0) {
+        return true;
+      }
+      recv_state_ = RecvState::READ_HEADER;
+      current_header_.body_length = 0;
+    } break;
     default:
       break;
   }
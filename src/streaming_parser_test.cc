@@ -3,8 +3,12 @@
 #include <arpa/inet.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
 struct ProtoHeader {
@@ -86,3 +90,383 @@ TEST(StreamingParser, parser_read_fuzzing) {
                       test_body.size() - body_field_send_byte);
   }
 }
+
+TEST(StreamingParser, parser_header_filter) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  std::vector<uint16_t> delivered_types;
+  uint32_t delivered_bodies = 0;
+  ProtoParser parser(
+      [&delivered_types](const ProtoHeader& header) {
+        delivered_types.push_back(header.msg_type);
+        return true;
+      },
+      [&delivered_bodies](const uint8_t* data, uint32_t length) {
+        EXPECT_EQ(data[0], 0x11);
+        ++delivered_bodies;
+        return true;
+      });
+  EXPECT_TRUE(
+      parser.SetHeaderFilter(HeaderFilter<ProtoHeader>::In(&ProtoHeader::msg_type, {1, 3})));
+
+  // several frames in one write so that the headers are evaluated as one batch
+  std::vector<uint8_t> stream;
+  for (uint16_t msg_type = 0; msg_type < 6; ++msg_type) {
+    ProtoHeader header = {};
+    header.msg_type = msg_type;
+    header.body_length = htonl(32);
+    const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+    stream.insert(stream.end(), raw, raw + sizeof(header));
+    stream.insert(stream.end(), 32, msg_type % 2 == 1 ? 0x11 : 0x22);
+  }
+  parser.HandleData(stream.data(), stream.size());
+  EXPECT_EQ(delivered_types, std::vector<uint16_t>({1, 3}));
+  EXPECT_EQ(delivered_bodies, 2);
+  EXPECT_EQ(parser.filtered_frames(), 4);
+
+  // a skipped body may arrive in pieces
+  ProtoHeader header = {};
+  header.msg_type = 8;
+  header.body_length = htonl(1000);
+  std::vector<uint8_t> body(1000, 0x22);
+  parser.HandleData(reinterpret_cast<uint8_t*>(&header), sizeof(header));
+  parser.HandleData(body.data(), 600);
+  parser.HandleData(body.data() + 600, 400);
+  EXPECT_EQ(parser.filtered_frames(), 5);
+  header.msg_type = 3;
+  header.body_length = htonl(4);
+  parser.HandleData(reinterpret_cast<uint8_t*>(&header), sizeof(header));
+  parser.HandleData(std::vector<uint8_t>(4, 0x11).data(), 4);
+  EXPECT_EQ(delivered_types, std::vector<uint16_t>({1, 3, 3}));
+}
+
+namespace {
+uint64_t fake_now_ns = 0;
+uint64_t FakeNowNs() { return fake_now_ns; }
+
+std::vector<uint8_t> EncodeFrames(uint16_t first_type, uint16_t count, uint32_t body_length) {
+  std::vector<uint8_t> stream;
+  for (uint16_t msg_type = first_type; msg_type < first_type + count; ++msg_type) {
+    ProtoHeader header = {};
+    header.msg_type = msg_type;
+    header.body_length = htonl(body_length);
+    const auto* raw = reinterpret_cast<const uint8_t*>(&header);
+    stream.insert(stream.end(), raw, raw + sizeof(header));
+    stream.insert(stream.end(), body_length, 0x33);
+  }
+  return stream;
+}
+}  // namespace
+
+TEST(StreamingParser, parser_ingress_limits) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  std::vector<uint16_t> delivered_types;
+  ProtoParser parser(
+      [&delivered_types](const ProtoHeader& header) {
+        delivered_types.push_back(header.msg_type);
+        return true;
+      },
+      [](const uint8_t* data, uint32_t length) { return true; });
+
+  // skip: only the burst is delivered, the remaining frames are drained
+  IngressLimits limits;
+  limits.frames_per_second = 1;
+  limits.frame_burst = 2;
+  parser.SetIngressLimits(limits);
+  auto stream = EncodeFrames(0, 5, 16);
+  EXPECT_TRUE(parser.HandleData(stream.data(), stream.size()));
+  EXPECT_EQ(delivered_types, std::vector<uint16_t>({0, 1}));
+  EXPECT_EQ(parser.rate_limited_frames(), 3);
+  EXPECT_FALSE(parser.deferred());
+
+  // signal: the handler decides per frame
+  limits.action = RateLimitAction::kSignal;
+  parser.SetIngressLimits(limits, [](const ProtoHeader& header) { return header.msg_type == 13; });
+  delivered_types.clear();
+  stream = EncodeFrames(10, 5, 16);
+  EXPECT_TRUE(parser.HandleData(stream.data(), stream.size()));
+  EXPECT_EQ(delivered_types, std::vector<uint16_t>({10, 11, 13}));
+
+  // defer: frames stay buffered until the bucket refills
+  limits.action = RateLimitAction::kDefer;
+  limits.frames_per_second = 100;
+  limits.frame_burst = 2;
+  limits.clock = FakeNowNs;
+  fake_now_ns = 1000000000;
+  parser.SetIngressLimits(limits);
+  delivered_types.clear();
+  stream = EncodeFrames(20, 4, 16);
+  EXPECT_TRUE(parser.HandleData(stream.data(), stream.size()));
+  EXPECT_EQ(delivered_types, std::vector<uint16_t>({20, 21}));
+  EXPECT_TRUE(parser.deferred());
+  EXPECT_EQ(parser.defer_wait_ns(), 10000000);
+  fake_now_ns += 5000000;
+  EXPECT_TRUE(parser.ParseBuffered());
+  EXPECT_EQ(parser.defer_wait_ns(), 5000000);
+  fake_now_ns += 15000000;
+  EXPECT_FALSE(parser.ParseBuffered());
+  EXPECT_EQ(delivered_types, std::vector<uint16_t>({20, 21, 22, 23}));
+}
+
+TEST(StreamingParser, parser_input_segments) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  // five frames of 12 + 20 bytes cut into segments of 50 bytes
+  auto stream = EncodeFrames(0, 5, 20);
+  const uint32_t segment_length = 50;
+  const size_t num_segments = (stream.size() + segment_length - 1) / segment_length;
+  std::vector<InputSegment> segments(num_segments);
+  uint32_t released = 0;
+  for (size_t i = 0; i < num_segments; ++i) {
+    segments[i].data = stream.data() + i * segment_length;
+    segments[i].length = std::min<uint32_t>(segment_length,
+                                            static_cast<uint32_t>(stream.size() - i * segment_length));
+    segments[i].opaque = &released;
+    segments[i].release = [](InputSegment* segment) { ++*static_cast<uint32_t*>(segment->opaque); };
+  }
+
+  std::vector<const uint8_t*> in_place_bodies;
+  uint32_t scattered = 0;
+  ProtoParser parser([](const ProtoHeader& header) { return true; },
+                     [&in_place_bodies](const uint8_t* data, uint32_t length) {
+                       EXPECT_EQ(length, 20);
+                       in_place_bodies.push_back(data);
+                       return true;
+                     });
+  parser.SetScatterBodyHandler([&scattered](const iovec* iov, uint32_t iovcnt, uint32_t length) {
+    EXPECT_EQ(iovcnt, 2);
+    EXPECT_EQ(iov[0].iov_len + iov[1].iov_len, length);
+    ++scattered;
+    return true;
+  });
+
+  // the first segment holds one complete frame and a partial header
+  segments[0].next = nullptr;
+  parser.HandleSegments(&segments[0]);
+  ASSERT_EQ(in_place_bodies.size(), 1);
+  EXPECT_EQ(in_place_bodies[0], stream.data() + 12);  // delivered without copying
+  EXPECT_EQ(released, 0);  // the partial second frame still references the segment
+
+  // the remaining frames, the bodies of the second and fifth frames span two segments
+  for (size_t i = 1; i + 1 < num_segments; ++i) {
+    segments[i].next = &segments[i + 1];
+  }
+  parser.HandleSegments(&segments[1]);
+  EXPECT_EQ(in_place_bodies.size() + scattered, 5);
+  EXPECT_EQ(scattered, 2);
+  EXPECT_EQ(released, num_segments);
+
+  // mixing with copied input keeps the byte order
+  auto more = EncodeFrames(5, 1, 20);
+  InputSegment head;
+  head.data = more.data();
+  head.length = 7;
+  parser.HandleSegments(&head);
+  parser.HandleData(more.data() + 7, static_cast<uint32_t>(more.size() - 7));
+  EXPECT_EQ(in_place_bodies.size() + scattered, 6);
+}
+
+TEST(StreamingParser, parser_pull_frames) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  uint32_t pushed = 0;
+  ProtoParser parser([&pushed](const ProtoHeader& header) { return ++pushed > 0; },
+                     [](const uint8_t* data, uint32_t length) { return true; });
+  ProtoParser::FrameView frame;
+  EXPECT_FALSE(parser.PeekFrame(frame));
+
+  // frames of 12 + 500 bytes wrap around the 2048 bytes ring
+  for (uint16_t round = 0; round < 8; ++round) {
+    auto stream = EncodeFrames(round, 1, 500);
+    EXPECT_TRUE(parser.BufferData(stream.data(), 100));
+    EXPECT_FALSE(parser.PeekFrame(frame));
+    EXPECT_TRUE(parser.BufferData(stream.data() + 100, stream.size() - 100));
+    ASSERT_TRUE(parser.PeekFrame(frame));
+    EXPECT_EQ(frame.header.msg_type, round);
+    EXPECT_EQ(frame.body_length, 500);
+    EXPECT_EQ(frame.body[0], 0x33);
+    EXPECT_EQ(frame.body[499], 0x33);
+    parser.PopFrame(frame);
+    EXPECT_FALSE(parser.PeekFrame(frame));
+  }
+  EXPECT_EQ(pushed, 0);
+}
+
+TEST(StreamingParser, parser_control_frames) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  uint32_t headers = 0;
+  uint32_t bodies = 0;
+  ProtoParser parser(
+      [&headers](const ProtoHeader& header) {
+        ++headers;
+        return true;
+      },
+      [&bodies](const uint8_t* data, uint32_t length) {
+        EXPECT_GT(length, 0);
+        ++bodies;
+        return true;
+      });
+
+  // without a control frame handler, a heartbeat only reaches the header handler
+  auto heartbeats = EncodeFrames(0, 3, 0);
+  auto data = EncodeFrames(3, 1, 16);
+  parser.HandleData(heartbeats.data(), heartbeats.size());
+  parser.HandleData(data.data(), data.size());
+  EXPECT_EQ(headers, 4);
+  EXPECT_EQ(bodies, 1);
+  EXPECT_EQ(parser.control_frames(), 3);
+
+  // a dedicated single step handler
+  std::vector<uint16_t> control_types;
+  parser.SetControlFrameHandler([&control_types](const ProtoHeader& header) {
+    control_types.push_back(header.msg_type);
+    return true;
+  });
+  parser.HandleData(heartbeats.data(), heartbeats.size());
+  EXPECT_EQ(control_types, std::vector<uint16_t>({0, 1, 2}));
+  EXPECT_EQ(headers, 4);
+
+  // counting mode: long runs of heartbeats are tallied without any callback
+  parser.SetControlFrameMode(ProtoParser::ControlFrameMode::kCount);
+  auto many = EncodeFrames(0, 100, 0);
+  parser.HandleData(many.data(), many.size());
+  parser.HandleData(data.data(), data.size());
+  parser.HandleData(heartbeats.data(), heartbeats.size() - 5);
+  parser.HandleData(heartbeats.data() + heartbeats.size() - 5, 5);
+  EXPECT_EQ(parser.control_frames(), 3 + 3 + 100 + 3);
+  EXPECT_EQ(control_types.size(), 3);
+  EXPECT_EQ(headers, 5);
+  EXPECT_EQ(bodies, 2);
+}
+
+TEST(StreamingParser, parser_counted_control_frames_are_limited) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  uint32_t headers = 0;
+  ProtoParser parser(
+      [&headers](const ProtoHeader&) {
+        ++headers;
+        return true;
+      },
+      [](const uint8_t*, uint32_t) { return true; });
+  parser.SetControlFrameMode(ProtoParser::ControlFrameMode::kCount);
+
+  // a flood of heartbeats is held to the frame rate like any other frames
+  IngressLimits limits;
+  limits.frames_per_second = 1;
+  limits.frame_burst = 2;
+  limits.clock = FakeNowNs;
+  fake_now_ns = 1000000000;
+  parser.SetIngressLimits(limits);
+  auto heartbeats = EncodeFrames(0, 10, 0);
+  EXPECT_TRUE(parser.HandleData(heartbeats.data(), heartbeats.size()));
+  EXPECT_EQ(parser.control_frames(), 2);
+  EXPECT_EQ(parser.rate_limited_frames(), 8);
+
+  // and filtered like them
+  parser.SetIngressLimits(IngressLimits());
+  EXPECT_TRUE(parser.SetHeaderFilter(HeaderFilter<ProtoHeader>::In(&ProtoHeader::msg_type, {3})));
+  EXPECT_TRUE(parser.HandleData(heartbeats.data(), heartbeats.size()));
+  EXPECT_EQ(parser.control_frames(), 3);
+  EXPECT_EQ(parser.filtered_frames(), 9);
+  EXPECT_EQ(headers, 0);
+}
+
+TEST(StreamingParser, parser_persistent_recovery) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  const std::string path = testing::TempDir() + "streaming_parser_persistent_recovery";
+  std::remove(path.c_str());
+  std::vector<uint16_t> types;
+  std::vector<uint32_t> bodies;
+  auto make_parser = [&types, &bodies]() {
+    return std::make_unique<ProtoParser>(
+        [&types](const ProtoHeader& header) {
+          types.push_back(header.msg_type);
+          return true;
+        },
+        [&bodies](const uint8_t* data, uint32_t length) {
+          bodies.push_back(length);
+          return true;
+        });
+  };
+  auto stream = EncodeFrames(0, 4, 100);
+  const uint32_t cut = 3 * (sizeof(ProtoHeader) + 100) + sizeof(ProtoHeader) + 40;
+  {
+    auto parser = make_parser();
+    ASSERT_FALSE(parser->PersistTo(path));
+    parser->HandleData(stream.data(), cut);
+    EXPECT_EQ(types, std::vector<uint16_t>({0, 1, 2, 3}));
+    EXPECT_EQ(bodies.size(), 3);
+    // the process stops in the middle of the fourth body
+  }
+  types.clear();
+  bodies.clear();
+  {
+    auto parser = make_parser();
+    ASSERT_FALSE(parser->PersistTo(path));
+    // the header of the body being buffered is delivered again, nothing before it
+    EXPECT_EQ(types, std::vector<uint16_t>({3}));
+    EXPECT_TRUE(bodies.empty());
+    parser->HandleData(stream.data() + cut, stream.size() - cut);
+    EXPECT_EQ(bodies, std::vector<uint32_t>({100}));
+  }
+
+  // a crash inside a handler: the frame is delivered again after the restart
+  auto next = EncodeFrames(7, 2, 20);
+  EXPECT_EXIT(
+      {
+        ProtoParser parser([](const ProtoHeader& header) { return true; },
+                           [](const uint8_t* data, uint32_t length) -> bool { std::_Exit(3); });
+        parser.PersistTo(path);
+        parser.HandleData(next.data(), next.size());
+      },
+      testing::ExitedWithCode(3), "");
+  types.clear();
+  bodies.clear();
+  {
+    auto parser = make_parser();
+    ASSERT_FALSE(parser->PersistTo(path));
+    EXPECT_EQ(types, std::vector<uint16_t>({7, 8}));
+    EXPECT_EQ(bodies, std::vector<uint32_t>({20, 20}));
+  }
+  std::remove(path.c_str());
+}
+
+TEST(StreamingParser, parser_prefetch_ahead) {
+  using ProtoParser = StreamingParser<ProtoHeader>;
+  std::vector<uint16_t> handled;
+  std::vector<uint16_t> prefetched;
+  ProtoParser parser(
+      [&handled](const ProtoHeader& header) {
+        handled.push_back(header.msg_type);
+        return true;
+      },
+      [](const uint8_t* data, uint32_t length) { return true; });
+  constexpr uint32_t kDistance = 3;
+  parser.SetPrefetchDistance(kDistance, 64);
+  parser.SetPrefetchHandler([&](const ProtoHeader& header) {
+    // never further ahead than the distance, counting the frame about to be handled
+    EXPECT_LE(prefetched.size(), handled.size() + kDistance);
+    prefetched.push_back(header.msg_type);
+  });
+
+  // every frame is prefetched once and in order, also when it arrives in pieces
+  auto stream = EncodeFrames(0, 20, 100);
+  auto more = EncodeFrames(20, 5, 0);
+  stream.insert(stream.end(), more.begin(), more.end());
+  const uint32_t cut = 7 * (sizeof(ProtoHeader) + 100) + 3;
+  parser.HandleData(stream.data(), cut);
+  EXPECT_EQ(handled.size(), 7);
+  EXPECT_EQ(prefetched.size(), 7);
+  parser.HandleData(stream.data() + cut, stream.size() - cut);
+  ASSERT_EQ(handled.size(), 25);
+  EXPECT_EQ(prefetched, handled);
+  for (uint16_t i = 0; i < 25; ++i) {
+    EXPECT_EQ(handled[i], i);
+  }
+
+  // a filtered frame is prefetched before it is skipped
+  handled.clear();
+  prefetched.clear();
+  parser.SetHeaderFilter(HeaderFilter<ProtoHeader>::In(&ProtoHeader::msg_type, {0, 1, 2}));
+  stream = EncodeFrames(0, 6, 10);
+  parser.HandleData(stream.data(), stream.size());
+  EXPECT_EQ(handled, std::vector<uint16_t>({0, 1, 2}));
+  EXPECT_EQ(prefetched, std::vector<uint16_t>({0, 1, 2, 3, 4, 5}));
+}